@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
@@ -8,104 +9,126 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/time.h>
 #include <pthread.h>
 #include <signal.h>
-
-/**
- * Struct which holds the information describing a resource,
- * the resource name and the amount of that resource at the depot. 
- */ 
-typedef struct {
-    char* resource;
-    int amount;
-} Resource;
-
-/**
- * Contains the information for a neighbouring depot. Provides means
- * of communication by holding FILE* for communication to and from.  
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "depot.h"
+#include "capture.h"
+#include "latency.h"
+#include "flight.h"
+#include "probes.h"
+#include "replica.h"
+#include "rebalance.h"
+#include "zip.h"
+
+/* Times a bootstrap file's dials are tried while the depots listed
+ * are still starting, and the wait before the first retry. */
+#define BOOTSTRAP_TRIES 30
+#define DIAL_BACKOFF_MS 10
+/* Times a standby tries to bind its primary's port, 100 ms apart: the
+ * primary's listener can outlast its replication stream as it dies. */
+#define TAKEOVER_TRIES 50
+
+/**
+ * The sending half of a connection, used as its Link's handle. The
+ * depot's registry can hold it past the end of the session that made
+ * it, so it is reference counted and closed by whoever drops it last.
+ * Once the peer has accepted compression, zip deflates large messages;
+ * it is set and used with the stream locked.
  */
 typedef struct {
-    char* name;
-    int portNo;
     FILE* to;
-    FILE* from;
-} Neighbour;
+    int refs;
+    Zip* zip;
+} Conn;
 
 /**
- * Represents the depot. Holds this depot's network info, neighbours, 
- * and resources. 
+ * Holds the information passed to the thread handlers when threading
+ * for new connections. Wraps the engine's Session with the socket
+ * and FILE* used to talk to the peer. offered holds the goods this end
+ * named when it offered compression, and unzip inflates the peer's
+ * frames once it has offered too.
  */
 typedef struct {
-    int numColons;
-    int numResources;
-    int serverSocket;
+    Depot* depot;
+    int clientSocket;
     int portNo;
-    int numNeighbours;
-    char* name;
-    Resource* resources;
-    Neighbour* neighbours;
-} Depot;
-
-/**
- * Holds the information for a defer command. The key, the arguments 
- * to execute, and whether the command has been executed or not.
- */
-typedef struct {
-    long key;
-    char* args;
-    bool complete;
-} Defer;
+    Conn* to;
+    FILE* from;
+    Session session;
+    char* offered;
+    Zip* unzip;
+} ThreadInfo;
 
 /**
- * Holds the information passed to the thread handlers when threading 
- * for new clients. Contains all of the information of the network.
+ * Ports for one thread to dial all at once, each up to tries times
+ * until it connects.
  */
 typedef struct {
     Depot* depot;
-    int deferCount;
-    int clientSocket;
-    int clientNum;
-    int msgCount;
-    int portNo;
-    FILE* to;
-    FILE* from;
-    Defer* deferred;
-    bool imSent;
-    bool imRecieved;
-} ThreadInfo;
+    int tries;
+    int count;
+    int ports[];
+} DialBatch;
 
 void ignore_sigpipe();
 void* sigcatcher(void* v);
 char* is_name_valid(char* name);
-int is_amount_valid(char* amount);
+int64_t is_amount_valid(char* amount);
 void gather_resources(Depot* depot, int numResources, char** resources);
-int lexo_cmp(const void* a, const void* b);
-int neigh_cmp(const void* a, const void* b);
-void sort_resources(Depot* depot);
-void sort_neigh(Depot* depot);
-void init_server(Depot* depot);
-void create_threads(Depot* depot);
+int local_socket(const char* path, bool listening);
+void run_standby(Depot* depot, const char* path, Standby* standby);
+void start_replication(Depot* depot, const char* path);
+void init_server(Depot* depot, Standby* takeover);
+void create_threads(Depot* depot, int serverSocket);
+void socket_send(void* handle, const char* message);
+void conn_hold(void* handle);
+void conn_drop(void* handle);
+void* heartbeat(void* input);
+void run_session(ThreadInfo* threadInfo, int socket);
+bool take_line(ThreadInfo* threadInfo, const char* line);
+void offer_compression(ThreadInfo* threadInfo);
+void accept_compression(ThreadInfo* threadInfo, char* offer);
+bool take_frame(ThreadInfo* threadInfo, const char* header);
 void* client_connections(void* input);
-void validate_input(char* input, ThreadInfo* threadInfo);
-void do_input(char** args, int msg, ThreadInfo* threadInfo);
-int verify_num(char input[256]);
-char* verify_name(char input[256]);
 void* new_connection(void* input);
-void connect_message(char** args, ThreadInfo* threadInfo);
-void im_message(char** args, ThreadInfo* threadInfo);
-void deliver_message(char** args, ThreadInfo* threadInfo);
-void withdraw_message(char** args, ThreadInfo* threadInfo);
-void transfer_message(char** args, ThreadInfo* threadInfo);
-void defer_message(char** args, ThreadInfo* threadInfo);
-void execute_message(char** args, ThreadInfo* threadInfo);
-char* im_creator(Depot* depot);
-char* defer_creator(char** args);
-char* i_to_s_converter(int input);
+void host_connect(Depot* depot, int portNo);
+void host_connect_many(Depot* depot, const int* ports, int count);
+void start_dials(Depot* depot, const int* ports, int count, int tries);
+void* dial_many(void* input);
+int dial_round(DialBatch* batch, struct pollfd* polls);
+void bootstrap(Depot* depot, const char* path);
+
+/* Set from DEPOT_CAPTURE, every line recieved is recorded here. */
+static Capture* capture;
+static unsigned nextConnId;
+/* DEPOT_HEARTBEAT_MS and DEPOT_TIMEOUT_MS: how often neighbour depots
+ * are sent heartbeats, and how long one may go quiet before its link
+ * is taken to be dead. */
+static int heartbeatMs = 1000;
+static int timeoutMs = 3000;
+/* DEPOT_PORT: the port to listen on, rather than any free one. */
+static int listenPort;
+/* DEPOT_COMPRESS: the zlib level links to neighbour depots are
+ * compressed at, if both ends set it; 0 leaves them plain. */
+static int compressLevel;
+/* Frames sent compressed, over every link, and their bytes before and
+ * after. */
+static uint64_t zipFrames;
+static uint64_t zipText;
+static uint64_t zipPacked;
 
 int main(int argc, char** argv) {
-    Depot* depot = malloc(sizeof(depot) * 16);
     pthread_t tid;
     sigset_t set;
+    Standby standby;
     if (argc < 2) {
         fprintf(stderr, "Usage: 2310depot name {goods qty}\n");
         exit(1);
@@ -114,14 +137,50 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Invalid name(s)\n");
         exit(2);
     }
+    Depot* depot = depot_create(argv[1]);
+    depot->connect = host_connect;
+    depot->connectMany = host_connect_many;
+    if (getenv("DEPOT_LATENCY") && strcmp(getenv("DEPOT_LATENCY"), "0") == 0) {
+        latencyEnabled = false;
+    }
+    if (getenv("DEPOT_WINDOW") && atoi(getenv("DEPOT_WINDOW")) > 0) {
+        depot->window = atoi(getenv("DEPOT_WINDOW"));
+    }
+    if (getenv("DEPOT_HEARTBEAT_MS") &&
+            atoi(getenv("DEPOT_HEARTBEAT_MS")) > 0) {
+        heartbeatMs = atoi(getenv("DEPOT_HEARTBEAT_MS"));
+    }
+    if (getenv("DEPOT_TIMEOUT_MS") && atoi(getenv("DEPOT_TIMEOUT_MS")) > 0) {
+        timeoutMs = atoi(getenv("DEPOT_TIMEOUT_MS"));
+    }
+    if (getenv("DEPOT_PORT")) {
+        listenPort = verify_num(getenv("DEPOT_PORT"));
+    }
+    if (getenv("DEPOT_COMPRESS") && atoi(getenv("DEPOT_COMPRESS")) > 0) {
+        compressLevel = atoi(getenv("DEPOT_COMPRESS")) > 9 ? 9 :
+                atoi(getenv("DEPOT_COMPRESS"));
+    }
+    if (getenv("DEPOT_HOLD_MS") && atoi(getenv("DEPOT_HOLD_MS")) > 0) {
+        depot->holdTtl = (uint64_t) atoi(getenv("DEPOT_HOLD_MS")) * 1000000;
+    }
+    if (getenv("DEPOT_CAPTURE")) {
+        capture = capture_open(getenv("DEPOT_CAPTURE"));
+        if (!capture) {
+            fprintf(stderr, "Cannot open capture file\n");
+        }
+    }
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &set, 0);
     pthread_create(&tid, 0, sigcatcher, (void*) depot);
-    depot->name = argv[1]; 
     gather_resources(depot, argc - 2, argv);
     ignore_sigpipe();
-    init_server(depot);
+    memset(&standby, 0, sizeof(Standby));
+    if (getenv("DEPOT_STANDBY")) {
+        run_standby(depot, getenv("DEPOT_STANDBY"), &standby);
+    }
+    init_server(depot, &standby);
 }
 
 /**
@@ -142,7 +201,9 @@ void ignore_sigpipe() {
 /**
  * Thread handler for handling sighup. When sighup is recieved,
  * prints the depot's neighbours and goods in a lexographically
- * sorted manner.
+ * sorted manner. Runtime statistics go to stderr, with what link
+ * compression has saved, and any capture in progress is flushed.
+ * When sigusr1 is recieved, dumps the flight recorder to stderr.
  * 
  * Params: (void* input) input points to the depot struct. 
  * Return: NULL
@@ -152,24 +213,24 @@ void* sigcatcher(void* input) {
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
     int num;
     while (!sigwait(&set, &num)) { 
-        printf("Goods:\n");
-        fflush(stdout);
-        sort_resources(depot);
-        sort_neigh(depot);
-        for (int i = 0; i < depot->numResources; i++) {
-            if (depot->resources[i].amount != 0) {
-                printf("%s %d\n", depot->resources[i].resource, 
-                        depot->resources[i].amount);
-            }
-            fflush(stdout);
+        if (num == SIGUSR1) {
+            flight_dump(stderr);
+            continue;
         }
-        printf("Neighbours:\n");
-        fflush(stdout);
-        for (int i = 0; i < depot->numNeighbours; i++) {
-            printf("%s\n", depot->neighbours[i].name);
-            fflush(stdout);
+        depot_report(depot, stdout);
+        depot_stats(depot, stderr);
+        if (compressLevel) {
+            fprintf(stderr, "Compression: level %d frames %" PRIu64
+                    " text %" PRIu64 " sent %" PRIu64 "\n", compressLevel,
+                    __atomic_load_n(&zipFrames, __ATOMIC_RELAXED),
+                    __atomic_load_n(&zipText, __ATOMIC_RELAXED),
+                    __atomic_load_n(&zipPacked, __ATOMIC_RELAXED));
+        }
+        if (capture) {
+            capture_flush(capture);
         }
     }
     return 0;
@@ -201,332 +262,473 @@ char* is_name_valid(char* name) {
 
 /**
  * For argv() processing. Returns the input string
- * as an int if it is valid, exitting and setting 
+ * as an int64_t if it is valid, exitting and setting 
  * the error code appropriately otherwise.
  * 
  * Params: (char* amount) amount is the qty to process. 
- * Return: (int) the verified quantity.
+ * Return: (int64_t) the verified quantity.
  */
-int is_amount_valid(char* amount) {
-    char* ptr;
-    long output = strtol(amount, &ptr, 10);
-    if (!(atoi(amount) && (output >= 0) && (strlen(ptr) == 0))) {
+int64_t is_amount_valid(char* amount) {
+    int64_t output = verify_amount(amount);
+    if (!output) {
         fprintf(stderr, "Invalid quantity\n");
         exit(3);       
     }
-    return ((int) output);
+    return output;
 }
 
 /**
  * Takes as input argc and argv from main. Loops through every entry
  * in the input string array ensuring that they are valid goods and 
  * quanities. The quantities and amounts are then ammended to an array
- * of Resources in the Depot struct.
+ * of Resources in the Depot struct. A good given so often that its
+ * total overflows is an invalid quantity.
  * 
  * Params: (Depot* depot, int numResources, char** resources) 
  * Return: Void
  */
 void gather_resources(Depot* depot, int numResources, char** resources) {
-    Resource* loot = malloc(sizeof(Resource) * 2048);
-    int j = 0;
+    char* good = 0;
     for (int i = 0; i < numResources; i++) {
         if (!(i % 2)) {
-            loot[j].resource = is_name_valid(resources[i + 2]);
-        } else {
-            loot[j++].amount = is_amount_valid(resources[i + 2]);
+            good = is_name_valid(resources[i + 2]);
+        } else if (!depot_add_resource(depot, good,
+                is_amount_valid(resources[i + 2]))) {
+            fprintf(stderr, "Invalid quantity\n");
+            exit(3);
         }
     }
-    depot->numResources = j;
-    depot->resources = loot;
 }
 
 /**
- * Defines a comparator for comparing two Resource structs.
- * The names of the resources are compared using strcmp, and the 
- * value is returned.
- * 
- * Params: (const void* a, const void* b) 
- * Return: (int) as per strcmp.
+ * Opens a unix domain stream socket at path, either listening on it
+ * (replacing any stale socket file) or connected to it.
+ *
+ * Params: (const char* path, bool listening)
+ * Return: (int) the socket, or -1 on failure.
  */
-int lexo_cmp(const void* a, const void* b) {
-    const Resource* resource1 = (Resource*) a;
-    const Resource* resource2 = (Resource*) b; 
-    return strcmp(resource1->resource, resource2->resource);
-}
-
-/**
- * Defines a comparator for comparing two Neighbour structs.
- * The names of the neighbours are compared using strcmp, and the 
- * value is returned.
- * 
- * Params: (const void* a, const void* b) 
- * Return: (int) as per strcmp.
- */
-int neigh_cmp(const void* a, const void* b) {
-    const Neighbour* neigh1 = (Neighbour*) a;
-    const Neighbour* neigh2 = (Neighbour*) b;
-    return strcmp(neigh1->name, neigh2->name);
+int local_socket(const char* path, bool listening) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listening) {
+        unlink(path);
+        if (bind(sock, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+                listen(sock, 1) < 0) {
+            close(sock);
+            return -1;
+        }
+    } else if (connect(sock, (struct sockaddr*) &address,
+            sizeof(address)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
 }
 
 /**
- * Sorts the neighbours currently added to the Depot using the 
- * neigh_cmp comparator.
- * 
- * Params: (Depot* depot) pointer to the depot struct.
- * Return: Void
+ * Runs this depot as a hot standby. Waits at path for a primary, then
+ * mirrors its stock until the primary goes away, leaving standby with
+ * the port and neighbours to take over.
+ *
+ * Params: (Depot* depot, const char* path, Standby* standby)
+ * Return: void
  */
-void sort_neigh(Depot* depot) {
-    qsort(depot->neighbours, depot->numNeighbours, 
-            sizeof(Neighbour), neigh_cmp);
+void run_standby(Depot* depot, const char* path, Standby* standby) {
+    int listener = local_socket(path, true);
+    if (listener < 0) {
+        fprintf(stderr, "Cannot listen for primary\n");
+        exit(4);
+    }
+    int primary = accept(listener, 0, 0);
+    close(listener);
+    unlink(path);
+    if (primary < 0) {
+        fprintf(stderr, "Cannot listen for primary\n");
+        exit(4);
+    }
+    replica_follow(depot, primary, standby);
+    close(primary);
+    if (!standby->portNo) {
+        fprintf(stderr, "Primary went away before replicating\n");
+        exit(4);
+    }
 }
 
 /**
- * Sorts the resources currently added to the Depot using the 
- * lexo_cmp comparator.
- * 
- * Params: (Depot* depot) pointer to the depot struct.
- * Return: Void
+ * Starts streaming this depot's changes to the standby listening at
+ * path. Carries on unreplicated if there is none.
+ *
+ * Params: (Depot* depot, const char* path)
+ * Return: void
  */
-void sort_resources(Depot* depot) {
-    qsort(depot->resources, depot->numResources, sizeof(Resource), lexo_cmp);
+void start_replication(Depot* depot, const char* path) {
+    int sock = local_socket(path, false);
+    if (sock < 0) {
+        fprintf(stderr, "Cannot reach standby\n");
+        return;
+    }
+    replica_attach(depot, sock);
 }
 
 /**
  * Initilises the server for this depot. Creating threads after
  * the initilisation which then accept every new connectin on a 
- * unique thread.
+ * unique thread. A standby taking over binds its primary's port and
+ * dials back its primary's neighbours first. Otherwise the port is
+ * listenPort, or any free one, and the depot links up with any
+ * bootstrap file's depots once listening.
  * 
- * Params: (Depot* depot) pointer to the depot struct.
+ * Params: (Depot* depot, Standby* takeover) pointer to the depot
+ * struct, and the state of a standby taking over (portNo 0 if not).
  * Return: void
  */
-void init_server(Depot* depot) {
+void init_server(Depot* depot, Standby* takeover) {
     int serverSocket;
-    int numNeighbours;
     int portNo;
+    int reuse = 1;
     struct sockaddr_in addressInfo;
-    Neighbour* neighbours = malloc(sizeof(Neighbour) * 256);
     memset(&addressInfo, 0, sizeof(addressInfo));
     addressInfo.sin_family = AF_INET;
     addressInfo.sin_addr.s_addr = INADDR_ANY;
-    addressInfo.sin_port = 0;
+    addressInfo.sin_port = htons(takeover->portNo ? takeover->portNo :
+            listenPort);
 
     serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-
-    bind(serverSocket, (struct sockaddr*) &addressInfo, sizeof(addressInfo));
-    listen(serverSocket, 5);
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse,
+            sizeof(reuse));
+    /* Take data in the SYN from peers with a Fast Open cookie, where
+     * net.ipv4.tcp_fastopen allows it. */
+    int fastOpen = SOMAXCONN;
+    setsockopt(serverSocket, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen,
+            sizeof(fastOpen));
+
+    int tries = takeover->portNo ? TAKEOVER_TRIES : 1;
+    while (bind(serverSocket, (struct sockaddr*) &addressInfo,
+            sizeof(addressInfo)) < 0) {
+        if (--tries == 0) {
+            fprintf(stderr, "Cannot take over port\n");
+            exit(4);
+        }
+        usleep(100000);
+    }
+    listen(serverSocket, SOMAXCONN);
 
     struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     socklen_t len = sizeof(address);
     getsockname(serverSocket, (struct sockaddr*) &address, &len);
     portNo = (int) ntohs(address.sin_port);
-    numNeighbours = 0;
     depot->portNo = portNo;
-    depot->numNeighbours = numNeighbours;
-    depot->neighbours = neighbours;
-    depot->serverSocket = serverSocket;
     printf("%d\n", portNo);
     fflush(stdout);
-    create_threads(depot);
+    for (int i = 0; i < takeover->numPeers; i++) {
+        host_connect(depot, takeover->peerPorts[i]);
+    }
+    if (getenv("DEPOT_BOOTSTRAP")) {
+        bootstrap(depot, getenv("DEPOT_BOOTSTRAP"));
+    }
+    if (getenv("DEPOT_REPLICATE")) {
+        start_replication(depot, getenv("DEPOT_REPLICATE"));
+    }
+    pthread_t tid;
+    pthread_create(&tid, 0, heartbeat, (void*) depot);
+    pthread_detach(tid);
+    create_threads(depot, serverSocket);
 }
 
 /**
  * Creates threads for each new connection to the server.
  * 
- * Params: (Depot* depot) pointer to the depot struct.
+ * Params: (Depot* depot, int serverSocket) pointer to the depot struct
+ * and the listening socket.
  * Return: void
  */
-void create_threads(Depot* depot) {
-    int serverSocket = depot->serverSocket, clientSocket, numClients = 0;
+void create_threads(Depot* depot, int serverSocket) {
+    int clientSocket;
     struct sockaddr_in client;
     socklen_t address = sizeof(client);
-    client.sin_family = AF_INET;
-    client.sin_addr.s_addr = INADDR_ANY;
-    client.sin_port = 0;
-
-    ThreadInfo* threadInfo = malloc(sizeof(ThreadInfo) * 2);
 
     while(clientSocket = accept(serverSocket, 
             (struct sockaddr*) &client, &address), clientSocket >= 0) {
         pthread_t tid;
-        numClients++;
+        ThreadInfo* threadInfo = calloc(1, sizeof(ThreadInfo));
+        DEPOT_PROBE1(accept, clientSocket);
         threadInfo->depot = depot;
-        threadInfo->clientNum = numClients - 1;
         threadInfo->clientSocket = clientSocket;
         pthread_create(&tid, 0, client_connections, (void*) threadInfo);
+        pthread_detach(tid);
+        address = sizeof(client);
     }
 }
 
 /**
- * Thread handler for creating new connections for each client of
- * the server. Creates FILE* variables which are stored in the 
- * structs for means of communicating to and from the client.
- * 
- * Params: (void* input) The input contains a pointer to a ThreadInfo
- * struct.
- * Return: NULL;
+ * Link send function for socket backed connections. Writes the lines
+ * to the connection's FILE*. On a compressed link, a message of
+ * ZIP_THRESHOLD bytes or more goes as Compressed:size and then that
+ * many bytes of deflated lines.
+ *
+ * Params: (void* handle, const char* message) handle is a Conn*.
+ * Return: void
  */
-void* client_connections(void* input) {
-    ThreadInfo* threadInfo = (ThreadInfo*) input;
-    Defer* defers = malloc(sizeof(Defer) * 1024);
-    Depot* depot = threadInfo->depot;
-    int clientSocket = threadInfo->clientSocket;
-    int fromSocket = dup(clientSocket);
-    threadInfo->msgCount = 0;
-    FILE* to = fdopen(clientSocket, "w");
-    FILE* from = fdopen(fromSocket, "r");
-
-    threadInfo->to = to;
-    threadInfo->from = from;
-
-    char* inputMessage = malloc(sizeof(char) * 256);
-    char* outputMessage = im_creator(depot);
-    
-    fprintf(to, "%s", outputMessage);
+void socket_send(void* handle, const char* message) {
+    Conn* conn = (Conn*) handle;
+    FILE* to = conn->to;
+    size_t length = strlen(message);
+    char* packed;
+    int size;
+    flockfile(to);
+    if (conn->zip && length >= ZIP_THRESHOLD &&
+            (size = zip_frame(conn->zip, message, length, &packed)) >= 0) {
+        fprintf(to, "Compressed:%d\n", size);
+        fwrite(packed, 1, size, to);
+        free(packed);
+        __atomic_add_fetch(&zipFrames, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&zipText, length, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&zipPacked, size, __ATOMIC_RELAXED);
+    } else {
+        fputs(message, to);
+    }
     fflush(to);
+    funlockfile(to);
+}
 
-    threadInfo->imSent = true;
-    threadInfo->imRecieved = false;
-    threadInfo->deferred = defers;
-    threadInfo->deferCount = 0;
+/**
+ * Link hold function: takes a reference to a connection.
+ *
+ * Params: (void* handle) handle is a Conn*.
+ * Return: void
+ */
+void conn_hold(void* handle) {
+    __atomic_fetch_add(&((Conn*) handle)->refs, 1, __ATOMIC_RELAXED);
+}
 
-    while(fgets(inputMessage, 256, from)) {
-        if (threadInfo->msgCount > 1) {
-            if (!(threadInfo->imRecieved && threadInfo->imSent)) {
-                break;
-            }
-        } 
-        validate_input(inputMessage, threadInfo);
-        threadInfo->msgCount++;
+/**
+ * Link drop function: gives up a reference to a connection, closing it
+ * if that was the last.
+ *
+ * Params: (void* handle) handle is a Conn*.
+ * Return: void
+ */
+void conn_drop(void* handle) {
+    Conn* conn = (Conn*) handle;
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        fclose(conn->to);
+        zip_destroy(conn->zip);
+        free(conn);
     }
-    return NULL;
 }
 
 /**
- * Processes the input stream recieved from the client, treating ':' as a 
- * delimiter and assigning every argument into a 2D char array to be 
- * passed onto subsequent functions.
- * 
- * Params: (char* input, ThreadInfo* threadInfo) newline input recieved
- * from client and a pointer to the ThreadInfo struct containing the 
- * information relevant to this thread.
+ * Thread handler which runs the depot's heartbeat every heartbeatMs,
+ * followed by expiring holds and a pass compacting its resource table.
+ * Other threads get a turn at the depot lock between the pass's steps.
+ *
+ * Params: (void* input) input points to the depot struct.
+ * Return: NULL
+ */
+void* heartbeat(void* input) {
+    Depot* depot = (Depot*) input;
+    struct timespec interval = {heartbeatMs / 1000,
+            (heartbeatMs % 1000) * 1000000L};
+    while (true) {
+        nanosleep(&interval, 0);
+        depot_heartbeat(depot, (uint64_t) heartbeatMs * 1000000);
+        depot_expire(depot);
+        rebalance_round(depot->rebalancer);
+        while (depot_compact(depot)) {
+            sched_yield();
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs a connected socket through the engine. Creates FILE* variables
+ * for means of communicating to and from the peer, sends this depot's
+ * IM and passes every line recieved to the session until the peer
+ * hangs up, fails to IM in time, or, being a depot that sends
+ * heartbeats, goes quiet for timeoutMs.
+ *
+ * Params: (ThreadInfo* threadInfo, int socket) the connection's info
+ * and its connected socket.
  * Return: void
  */
-void validate_input(char* input, ThreadInfo* threadInfo) {
-    Depot* depot = threadInfo->depot;
-    char** args = malloc(sizeof(char*) * 256);
-    for (int i = 0; i < 256; i++) {
-        args[i] = malloc(sizeof(char) * 256);
-    }
-    //Valid commands.
-    char messages[10][10] = {"Connect", "IM", "Deliver", 
-            "Withdraw", "Transfer", "Defer", "Execute"};
-    int i = 0, j = 0, c = 0, numColons = 0;
-    //Fills in args, indexing along by using ':' as a delimiter
-    while (input[c] != '\n') {
-        if (input[c] == ':') {
-            args[i][j] = '\0';
-            j = 0;
-            c++;
-            i++;
-            numColons++;
+void run_session(ThreadInfo* threadInfo, int socket) {
+    int fromSocket = dup(socket);
+    Conn* to = calloc(1, sizeof(Conn));
+    to->to = fdopen(socket, "w");
+    to->refs = 1;
+    FILE* from = fdopen(fromSocket, "r");
+    char inputMessage[MAX_LINE];
+    Link link = {socket_send, to, conn_hold, conn_drop};
+    bool timed = false;
+
+    threadInfo->to = to;
+    threadInfo->from = from;
+    session_init(&threadInfo->session, threadInfo->depot, link);
+    threadInfo->session.connId = __atomic_fetch_add(&nextConnId, 1,
+            __ATOMIC_RELAXED);
+    threadInfo->session.dialled = threadInfo->portNo;
+    session_open(&threadInfo->session);
+
+    while(fgets(inputMessage, MAX_LINE, from)) {
+        /* Only a whole line can head a frame or offer compression. */
+        bool whole = strchr(inputMessage, '\n') != 0;
+        if (whole && threadInfo->unzip &&
+                strncmp(inputMessage, "Compressed:", 11) == 0) {
+            if (!take_frame(threadInfo, inputMessage)) {
+                break;
+            }
+            continue;
+        }
+        if (whole && threadInfo->offered && !threadInfo->unzip &&
+                strncmp(inputMessage, "Compress:", 9) == 0) {
+            accept_compression(threadInfo, inputMessage);
+            continue;
         }
-        if (input[c] == '\n') {
+        if (!take_line(threadInfo, inputMessage)) {
             break;
         }
-        args[i][j++] = input[c++];
-    }
-    depot->numColons = numColons;
-    for (int i = 0; i < 7; i++) {
-        if (strcmp(args[0], messages[i]) == 0) {
-            do_input(args, i, threadInfo);
-            free(args);
+        /* The session refuses a line too long to take whole; the rest
+         * of it is not a command of its own. */
+        int c = 0;
+        while (!whole && c != '\n' && c != EOF) {
+            c = fgetc(from);
+        }
+        if (threadInfo->session.heartbeats && !timed) {
+            struct timeval timeout = {timeoutMs / 1000,
+                    (timeoutMs % 1000) * 1000};
+            setsockopt(fromSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    sizeof(timeout));
+            timed = true;
+            if (compressLevel) {
+                offer_compression(threadInfo);
+            }
         }
     }
+    session_destroy(&threadInfo->session);
+    free(threadInfo->offered);
+    zip_destroy(threadInfo->unzip);
+    /* A neighbour's registry entry may still hold the sending half. */
+    fclose(from);
+    conn_drop(to);
+    free(threadInfo);
 }
 
 /**
- * Calls the relevant function depending on which of the 7 possible
- * commands are being called by the client.
- * 
- * Params: (char** args, int msg, ThreadInfo* threadInfo)
- * Return: void
+ * Hands one line recieved to the session, recording it first.
+ *
+ * Params: (ThreadInfo* threadInfo, const char* line)
+ * Return: (bool) false if the connection is to be closed.
  */
-void do_input(char** args, int msg, ThreadInfo* threadInfo) {
-    switch (msg) {
-        case 0:
-            connect_message(args, threadInfo);
-            break;
-        case 1:
-            im_message(args, threadInfo);
-            break;
-        case 2:
-            deliver_message(args, threadInfo);
-            break;
-        case 3:
-            withdraw_message(args, threadInfo);
-            break;
-        case 4:
-            transfer_message(args, threadInfo);
-            break;
-        case 5:
-            defer_message(args, threadInfo);
-            break;
-        case 6:
-            execute_message(args, threadInfo);
-            break;
-        default:
-            break;
+bool take_line(ThreadInfo* threadInfo, const char* line) {
+    if (latencyEnabled) {
+        threadInfo->session.receivedAt = latency_now();
     }
+    if (capture) {
+        capture_record(capture, threadInfo->session.connId, line);
+    }
+    return session_input(&threadInfo->session, line);
 }
 
 /**
- * Helper method similar to is_amount_valid as before. Does not
- * exit() upon failure, instsead returning 0.
- * 
- * Params: (char input[256]) character array containing to be 
- * converted to int.
- * Return: (int) the converted int.
+ * Offers to compress the link, once the peer has IM'd as a depot, with
+ * Compress: and as many of this depot's goods as fit, ':' separated.
+ * They prime the dictionary of whatever this end compresses. A depot
+ * which does not compress takes the offer as a command it does not
+ * know, and ignores it.
+ *
+ * Params: (ThreadInfo* threadInfo)
+ * Return: void
  */
-int verify_num(char input[256]) {
-    char* ptr;
-    long output = strtol(input, &ptr, 10);
-    int portNum;
-    if (strlen(ptr) == 0 && output > 0) {
-        portNum = (int) output;
-        return portNum;
-    }
-    return 0;
+void offer_compression(ThreadInfo* threadInfo) {
+    char offer[MAX_LINE];
+    int length = sprintf(offer, "Compress:");
+    length += depot_goods(threadInfo->depot, offer + length,
+            MAX_LINE - length - 1);
+    threadInfo->offered = strdup(offer + 9);
+    sprintf(offer + length, "\n");
+    socket_send(threadInfo->to, offer);
 }
 
 /**
- * Helper method similar to verify_name as before. Does not
- * exit() upon failure, instsead returning an empty string.
- * 
- * Params: (char input[256]) character array containing to be 
- * converted to int.
- * Return: (char*) the input string if verified, "" otherwise.
+ * Takes the peer's offer to compress, having made one: from now on
+ * frames from the peer are inflated with its goods as the dictionary,
+ * and large messages to it are deflated with this depot's.
+ *
+ * Params: (ThreadInfo* threadInfo, char* offer) the Compress line.
+ * Return: void
  */
-char* verify_name(char input[256]) {
-    char* name = input;
-    char* invalid = " \n\r:";
-    char* invalidReturn = "";
-    if (!strlen(name) == 0) {
-        for (int i = 0; i < (strlen(name)); i++) {
-            for (int j = 0; j < 4; j++) {
-                if (name[i] == invalid[j]) {
-                    return invalidReturn;
-                }
-            }
+void accept_compression(ThreadInfo* threadInfo, char* offer) {
+    offer[strcspn(offer, "\n")] = '\0';
+    threadInfo->unzip = zip_inflater(offer + 9);
+    Zip* zip = zip_deflater(compressLevel, threadInfo->offered);
+    FILE* to = threadInfo->to->to;
+    flockfile(to);
+    threadInfo->to->zip = zip;
+    funlockfile(to);
+}
+
+/**
+ * Reads the compressed frame a Compressed:size line heads and hands
+ * each line in it to the session.
+ *
+ * Params: (ThreadInfo* threadInfo, const char* header)
+ * Return: (bool) false if the frame was bad or the connection is to
+ * be closed.
+ */
+bool take_frame(ThreadInfo* threadInfo, const char* header) {
+    char number[MAX_LINE];
+    char line[MAX_LINE];
+    snprintf(number, sizeof(number), "%.*s", (int) strcspn(header + 11,
+            "\n"), header + 11);
+    int size = verify_num(number);
+    if (!size || size > ZIP_MAX_FRAME) {
+        return false;
+    }
+    char* packed = malloc(size);
+    char* text = 0;
+    int length = -1;
+    if (fread(packed, 1, size, threadInfo->from) == (size_t) size) {
+        length = zip_unframe(threadInfo->unzip, packed, size, &text);
+    }
+    free(packed);
+    bool open = length >= 0;
+    for (char* next = text; open && next && *next; ) {
+        /* Each line is taken as fgets() would have read it. */
+        int span = strcspn(next, "\n");
+        int taken = span + (next[span] == '\n');
+        if (taken > MAX_LINE - 1) {
+            taken = MAX_LINE - 1;
         }
-        return name;
+        memcpy(line, next, taken);
+        line[taken] = '\0';
+        open = take_line(threadInfo, line);
+        next += taken;
     }
-    return invalidReturn;
+    free(text);
+    return open;
 }
 
 /**
- * Thread handler for the connect message. Listens to the port specified 
- * from connect and deals with the input recieved.
+ * Thread handler for each client accepted by the server.
+ * 
+ * Params: (void* input) The input contains a pointer to a ThreadInfo
+ * struct.
+ * Return: NULL;
+ */
+void* client_connections(void* input) {
+    ThreadInfo* threadInfo = (ThreadInfo*) input;
+    run_session(threadInfo, threadInfo->clientSocket);
+    return NULL;
+}
+
+/**
+ * Thread handler for the connect message. Connects to the port
+ * specified from connect and deals with the input recieved.
  * 
  * Params: (void* input) Pointer to the ThreadInfo struct containing
  * connection information.
@@ -534,335 +736,218 @@ char* verify_name(char input[256]) {
  */
 void* new_connection(void* input) {
     ThreadInfo* threadInfo = (ThreadInfo*) input;
-    Defer* defers = malloc(sizeof(Defer) * 1024);
     struct sockaddr_in addressInfo;
     memset(&addressInfo, 0, sizeof(addressInfo));
     addressInfo.sin_family = AF_INET;
     addressInfo.sin_addr.s_addr = INADDR_ANY;
     addressInfo.sin_port = htons(threadInfo->portNo);
     int newSock = socket(AF_INET, SOCK_STREAM, 0);
-    int fromSocket = dup(newSock);
-    connect(newSock, (struct sockaddr*) &addressInfo, sizeof(addressInfo));
-
-    FILE* to = fdopen(newSock, "w");
-    FILE* from = fdopen(fromSocket, "r");
-
-    char* inputMessage = malloc(sizeof(char) * 256);
-    char* outputMessage = im_creator(threadInfo->depot);
-
-    fprintf(to, "%s", outputMessage);
-    fflush(to);
-    
-    threadInfo->msgCount = 0;
-    threadInfo->imSent = true;
-    threadInfo->imRecieved = false;
-    threadInfo->to = to;
-    threadInfo->from = from;     
-    threadInfo->deferCount = 0;
-    threadInfo->deferred = defers;
-
-    while(fgets(inputMessage, 256, from)) {
-        if (threadInfo->msgCount > 1) {
-            if (!(threadInfo->imRecieved && threadInfo->imSent)) {
-                break;
-            }
-        } 
-        validate_input(inputMessage, threadInfo);
-        threadInfo->msgCount++;
+#ifdef TCP_FASTOPEN_CONNECT
+    /* The IM, and any first flight with it, rides in the SYN when this
+     * host has a Fast Open cookie for the peer. */
+    int yes = 1;
+    setsockopt(newSock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes,
+            sizeof(yes));
+#endif
+    if (connect(newSock, (struct sockaddr*) &addressInfo,
+            sizeof(addressInfo)) < 0) {
+        close(newSock);
+        free(threadInfo);
+        return NULL;
     }
+    run_session(threadInfo, newSock);
     return NULL;
 }
 
 /**
- * Deals with the connect message, creating new threads for each connect
- * request recieved.
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
+ * Connect hook handed to the engine. Creates a new thread which dials
+ * the requested port.
+ *
+ * Params: (Depot* depot, int portNo) the depot and port to connect to.
  * Return: void.
  */
-void connect_message(char** args, ThreadInfo* threadInfo) {
-    ThreadInfo* newConnection = malloc(sizeof(ThreadInfo) * 2);
-    memcpy(&newConnection, &threadInfo, sizeof(threadInfo));
-    int portNum = verify_num(args[1]);
-    newConnection->portNo = portNum;
-    if (portNum != 0 && threadInfo->imRecieved == true) {
-        fflush(stdout);
-        pthread_t tid;
-        pthread_create(&tid, 0, new_connection, (void*) newConnection);
-    }
+void host_connect(Depot* depot, int portNo) {
+    pthread_t tid;
+    ThreadInfo* newConnection = calloc(1, sizeof(ThreadInfo));
+    newConnection->depot = depot;
+    newConnection->portNo = portNo;
+    pthread_create(&tid, 0, new_connection, (void*) newConnection);
+    pthread_detach(tid);
 }
 
 /**
- * Deals with the IM requests recieved. Adds the information of the 
- * client who sent the IM to the neighbours list of the depot if 
- * not already a neighbour. Ignores IM requests from invalid ports and
- * client names. 
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
+ * ConnectMany hook handed to the engine. Creates one thread which
+ * dials every port at once.
+ *
+ * Params: (Depot* depot, const int* ports, int count)
  * Return: void.
  */
-void im_message(char** args, ThreadInfo* threadInfo) {
-    fflush(stdout);
-    Depot* depot = threadInfo->depot;
-    int portNum = verify_num(args[1]);
-    char* depotName = verify_name(args[2]);
-    Neighbour neighbour;
-    bool neighbourFound = false;
-    int numColons = depot->numColons;
-    if (!(portNum == 0 || strcmp(depotName, "") == 0) && 
-            numColons == 2 && !(threadInfo->imRecieved)) {
-        neighbour.name = depotName;
-        neighbour.portNo = portNum;
-        for (int i = 0; i < depot->numNeighbours; i++) {
-            if (strcmp(neighbour.name, depot->neighbours[i].name) == 0) {
-                neighbourFound = true;
-            } else if (neighbour.portNo == depot->neighbours[i].portNo) {
-                neighbourFound = true;
-            }
-        }
-        if (!neighbourFound) {
-            depot->neighbours[depot->numNeighbours++] = neighbour;
-            depot->neighbours[depot->numNeighbours - 1].to = threadInfo->to;
-            depot->neighbours[depot->numNeighbours - 1].from
-                    = threadInfo->from;
-            threadInfo->imRecieved = true;
-            fflush(stdout);
-        }
-    }
+void host_connect_many(Depot* depot, const int* ports, int count) {
+    start_dials(depot, ports, count, 1);
 }
 
 /**
- * Delivers the specified amount of the specified good to the depot's 
- * resources. Processes the input as usual. 
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
+ * Creates a thread dialling a batch of ports, if there are any.
+ *
+ * Params: (Depot* depot, const int* ports, int count, int tries)
  * Return: void.
  */
-void deliver_message(char** args, ThreadInfo* threadInfo) {
-    Depot* depot = threadInfo->depot;
-    int amount = verify_num(args[1]);
-    char* good = verify_name(args[2]);
-    bool delivered = false;
-    int numColons = depot->numColons;
-    if (amount > 0 && numColons == 2) {
-        for (int i = 0; i < depot->numResources; i++) {
-            if (strcmp(good, depot->resources[i].resource) == 0
-                    && !delivered) {
-                depot->resources[i].amount = 
-                        depot->resources[i].amount + amount;
-                delivered = true;
-            }
-        }
-        if (!delivered) {
-            depot->resources[depot->numResources].resource = good;
-            depot->resources[depot->numResources].amount = amount;
-            depot->numResources++;
-        }
+void start_dials(Depot* depot, const int* ports, int count, int tries) {
+    pthread_t tid;
+    if (!count) {
+        return;
     }
+    DialBatch* batch = malloc(sizeof(DialBatch) + sizeof(int) * count);
+    batch->depot = depot;
+    batch->tries = tries;
+    batch->count = count;
+    memcpy(batch->ports, ports, sizeof(int) * count);
+    pthread_create(&tid, 0, dial_many, (void*) batch);
+    pthread_detach(tid);
 }
 
 /**
- * Withdraws the specified amount of the specified good from the depot's 
- * resources. Processes the input as usual. 
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
- * Return: void.
+ * Thread handler for a batch of dials. Each round starts a
+ * non-blocking connect to every port left and waits on them together,
+ * handing each that connects to a session thread of its own. Ports
+ * which fail are tried again, while tries last, after DIAL_BACKOFF_MS
+ * and then twice as long each time, up to a heartbeat.
+ *
+ * Params: (void* input) a DialBatch*, freed here.
+ * Return: NULL
  */
-void withdraw_message(char** args, ThreadInfo* threadInfo) {
-    Depot* depot = threadInfo->depot;
-    int amount = verify_num(args[1]);
-    char* good = verify_name(args[2]);
-    bool delivered = false;
-    int numColons = depot->numColons;
-    if (amount > 0 && numColons == 2) {
-        for (int i = 0; i < depot->numResources; i++) {
-            if (strcmp(good, depot->resources[i].resource)
-                    == 0 && !delivered) {
-                depot->resources[i].amount = 
-                        depot->resources[i].amount - amount;
-                delivered = true;
-            }
-        }
-        if (!delivered) {
-            depot->resources[depot->numResources].resource = good;
-            depot->resources[depot->numResources].amount = 0 - amount;
-            depot->numResources++;
+void* dial_many(void* input) {
+    DialBatch* batch = (DialBatch*) input;
+    struct pollfd* polls = malloc(sizeof(struct pollfd) * batch->count);
+    int backoffMs = DIAL_BACKOFF_MS;
+    for (int i = 0; i < batch->tries && batch->count; i++) {
+        if (i) {
+            struct timespec interval = {backoffMs / 1000,
+                    (backoffMs % 1000) * 1000000L};
+            nanosleep(&interval, 0);
+            backoffMs = backoffMs * 2 < heartbeatMs ? backoffMs * 2 :
+                    heartbeatMs;
         }
+        batch->count = dial_round(batch, polls);
     }
+    free(polls);
+    free(batch);
+    return NULL;
 }
 
 /**
- * Withdraws the specified amount of the specified good from the depot's
- * resources if the destination's name is in the depot's neighbours. 
- * Sends a deliver message to the destination depot. 
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
- * Return: void.
+ * Dials every port in a batch at once, waiting up to timeoutMs for the
+ * lot. Connected sockets go back to blocking and get a session thread.
+ *
+ * Params: (DialBatch* batch, struct pollfd* polls) polls has room for
+ * every port.
+ * Return: (int) how many ports failed, now at the front of the batch.
  */
-void transfer_message(char** args, ThreadInfo* threadInfo) {
-    Depot* depot = threadInfo->depot;
-    char** messageArgs = malloc(sizeof(char*) * 256);
-    for (int i = 0; i < 256; i++) {
-        messageArgs[i] = malloc(sizeof(char) * 256);
-    }
-    messageArgs[1] = args[1];
-    messageArgs[2] = args[2];
-    depot->numColons = 2;
-    bool found = false;
-    FILE* to;
-    for (int i = 0; i < depot->numNeighbours; i++) {
-        if (!found) {
-            if (strcmp(args[3], depot->neighbours[i].name) == 0) {
-                found = true;
-                withdraw_message(messageArgs, threadInfo);
-                to = depot->neighbours[i].to;
-                fflush(to);
-                fprintf(to, "Deliver:%s:%s\n", args[1], args[2]);
-                fflush(to);
-            }
+int dial_round(DialBatch* batch, struct pollfd* polls) {
+    struct sockaddr_in addressInfo;
+    int waiting = 0, failed = 0;
+    memset(&addressInfo, 0, sizeof(addressInfo));
+    addressInfo.sin_family = AF_INET;
+    addressInfo.sin_addr.s_addr = INADDR_ANY;
+    for (int i = 0; i < batch->count; i++) {
+        polls[i].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        polls[i].events = POLLOUT;
+        polls[i].revents = 0;
+        addressInfo.sin_port = htons(batch->ports[i]);
+        if (connect(polls[i].fd, (struct sockaddr*) &addressInfo,
+                sizeof(addressInfo)) < 0 && errno != EINPROGRESS) {
+            close(polls[i].fd);
+            polls[i].fd = -1;
+        } else {
+            waiting++;
         }
     }
-}
-
-/**
- * Processes a defer command, adding the defer request to a list of Defers
- * in the depot.
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
- * Return: void.
- */
-void defer_message(char** args, ThreadInfo* threadInfo) {
-    char* defArgs = malloc(sizeof(char) * 1024);
-    char* ptr;
-    defArgs = defer_creator(args);
-    long key = strtol(args[1], &ptr, 10);
-    if (strlen(ptr) == 0 && key > 0 && strlen(defArgs) > 0) {
-        threadInfo->deferred[threadInfo->deferCount++].args = defArgs;
-        threadInfo->deferred[threadInfo->deferCount - 1].key = key;
-        threadInfo->deferred[threadInfo->deferCount - 1].complete = false;
-    }
-}
-
-/**
- * Processes an execute command. Looks for the input key in the list of 
- * defers held by the depot, executing every command which 
- * has the same key. Marks the defer request as completed upon execution.
- * 
- * Params: (char** args, ThreadInfo* threadInfo) args contains the 
- * arguments processed in validate_input.
- * Return: void.
- */
-void execute_message(char** args, ThreadInfo* threadInfo) {
-    int numToExec = 0;
-    char* ptr;
-    long key = strtol(args[1], &ptr, 10);
-    if (strlen(ptr) == 0 && key > 0) {
-        char** toExec = malloc(sizeof(char*) * threadInfo->deferCount);
-        for (int i = 0; i < threadInfo->deferCount; i++) {
-            if (key == threadInfo->deferred[i].key && 
-                    threadInfo->deferred[i].complete == false) {
-                toExec[numToExec++] = threadInfo->deferred[i].args;
-                threadInfo->deferred[i].complete = true;
-            }
+    uint64_t deadline = latency_now() + (uint64_t) timeoutMs * 1000000;
+    while (waiting) {
+        uint64_t now = latency_now();
+        if (now >= deadline || poll(polls, batch->count,
+                (deadline - now) / 1000000 + 1) <= 0) {
+            break;
         }
-        for (int i = 0; i < numToExec; i++) {
-            validate_input(toExec[i], threadInfo);
+        for (int i = 0; i < batch->count; i++) {
+            if (polls[i].fd < 0 || !polls[i].revents) {
+                continue;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(polls[i].fd, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error) {
+                close(polls[i].fd);
+            } else {
+                pthread_t tid;
+                ThreadInfo* threadInfo = calloc(1, sizeof(ThreadInfo));
+                fcntl(polls[i].fd, F_SETFL, 0);
+                threadInfo->depot = batch->depot;
+                threadInfo->clientSocket = polls[i].fd;
+                threadInfo->portNo = batch->ports[i];
+                pthread_create(&tid, 0, client_connections,
+                        (void*) threadInfo);
+                pthread_detach(tid);
+                /* Connected, so not to be dialled again. */
+                batch->ports[i] = 0;
+            }
+            polls[i].fd = -1;
+            waiting--;
         }
     }
-}
-
-/**
- * Formats the IM message sent by the server upon a successful connection.
- * 
- * Params: (Depot* depot) the depot.
- * Return: (char*) the IM string.
- */
-char* im_creator(Depot* depot) {
-    char* output = malloc(sizeof(char) * 256);
-    int port = depot->portNo;
-    char* portNo = i_to_s_converter(port);
-    char* depotName = depot->name;
-    strcat(output, "IM:");
-    strcat(output, portNo);
-    strcat(output, ":");
-    strcat(output, depotName);
-    strcat(output, "\n");
-    return output;   
-}
-
-/**
- * Creates the formattied command string for the list of defer
- * requests. Takes as input the 2D char array created originally 
- * by the validate_input function and transforms it back into 
- * a single stream of characters adding back in ':' as required.
- * 
- * Params: (char** args) args to process
- * Return: (char*) formatted stream.
- */
-char* defer_creator(char** args) {
-    char* output = malloc(sizeof(char) * 256);
-    int numArgs = 0;
-    for (int i = 2; i < 256; i++) {
-        if (strlen(args[i]) != 0) {
-            numArgs++;
+    for (int i = 0; i < batch->count; i++) {
+        if (polls[i].fd >= 0) {
+            close(polls[i].fd);
+        }
+        if (batch->ports[i]) {
+            batch->ports[failed++] = batch->ports[i];
         }
     }
-    if (numArgs == 3) {
-        strcat(output, args[2]);
-        strcat(output, ":");
-        strcat(output, args[3]);
-        strcat(output, ":");
-        strcat(output, args[4]);
-        strcat(output, "\n");
-    } else if (numArgs == 4) {
-        strcat(output, args[2]);
-        strcat(output, ":");
-        strcat(output, args[3]);
-        strcat(output, ":");
-        strcat(output, args[4]);
-        strcat(output, ":");
-        strcat(output, args[5]);
-        strcat(output, "\n");
-    } else {
-        output = "";
-    }
-    return output;
+    return failed;
 }
 
 /**
- * Helpter method which converts an input integer to a string.
- * 
- * Params: (int input) the int to convert.
- * Return: (char*) converted string.
+ * Links up with the depots listed in a bootstrap file: ports separated
+ * by commas or whitespace, every depot in the mesh listed, this one
+ * included. Of each pair, the depot on the lower port dials, so every
+ * link is made once, and the depots which have not started listening
+ * yet are tried again. The stats report how long it took until every
+ * depot listed had IM'd. Entries which are not ports are skipped.
+ *
+ * Params: (Depot* depot, const char* path)
+ * Return: void
  */
-char* i_to_s_converter(int input) {
-    char nums[10] = "0123456789";
-    char* p = malloc(sizeof(char) * 10);
-    int i = input, digits = 0;
-    if (input == 0) {
-        p[0] = '0';
-        p[1] = '\0';
-        return p;
-    }
-    while(i) {
-        ++p;
-        i = i / 10;
-        digits++;
-        if (digits > 8) {
-            p = realloc(p, sizeof(p) * 2);
-            digits = 0;
+void bootstrap(Depot* depot, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open bootstrap file\n");
+        return;
+    }
+    int count = 0, capacity = 64, dials = 0;
+    int* ports = malloc(sizeof(int) * capacity);
+    char* line = 0;
+    size_t size = 0;
+    while (getline(&line, &size, file) >= 0) {
+        char* rest = line;
+        char* token;
+        while ((token = strsep(&rest, ", \t\r\n"))) {
+            if (count == capacity) {
+                capacity *= 2;
+                ports = realloc(ports, sizeof(int) * capacity);
+            }
+            if ((ports[count] = verify_num(token))) {
+                count++;
+            }
         }
     }
-    *p = '\0';
-    while(input) {
-        *--p = nums[input % 10];
-        input = input / 10;
+    free(line);
+    fclose(file);
+    count = depot_expect(depot, ports, count);
+    for (int i = 0; i < count; i++) {
+        if (ports[i] > depot->portNo) {
+            ports[dials++] = ports[i];
+        }
     }
-    return p;
-}
\ No newline at end of file
+    start_dials(depot, ports, dials, BOOTSTRAP_TRIES);
+    free(ports);
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "capture.h"
+
+static void put_varint(FILE* file, uint64_t value);
+static bool get_varint(FILE* file, uint64_t* value);
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (uint64_t) nanoseconds since an arbitrary point.
+ */
+uint64_t capture_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Creates (truncating) a capture file and writes its header.
+ *
+ * Params: (const char* path) where to write the capture.
+ * Return: (Capture*) the open capture, or NULL if it cannot be created.
+ */
+Capture* capture_open(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return 0;
+    }
+    Capture* capture = malloc(sizeof(Capture));
+    capture->file = file;
+    capture->last = 0;
+    pthread_mutex_init(&capture->lock, 0);
+    fputs(CAPTURE_MAGIC, file);
+    return capture;
+}
+
+/**
+ * Appends a recieved line to the capture. The line's trailing newline,
+ * if any, is not stored.
+ *
+ * Params: (Capture* capture, unsigned connId, const char* line)
+ * Return: void
+ */
+void capture_record(Capture* capture, unsigned connId, const char* line) {
+    size_t length = strcspn(line, "\n");
+    pthread_mutex_lock(&capture->lock);
+    uint64_t now = capture_now();
+    put_varint(capture->file, capture->last ? now - capture->last : 0);
+    put_varint(capture->file, connId);
+    put_varint(capture->file, length);
+    fwrite(line, 1, length, capture->file);
+    capture->last = now;
+    pthread_mutex_unlock(&capture->lock);
+}
+
+/**
+ * Pushes buffered records out to the file.
+ *
+ * Params: (Capture* capture)
+ * Return: void
+ */
+void capture_flush(Capture* capture) {
+    pthread_mutex_lock(&capture->lock);
+    fflush(capture->file);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+/**
+ * Flushes and closes a capture.
+ *
+ * Params: (Capture* capture)
+ * Return: void
+ */
+void capture_close(Capture* capture) {
+    fclose(capture->file);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
+
+/**
+ * Opens a capture for reading, checking its header.
+ *
+ * Params: (const char* path)
+ * Return: (FILE*) positioned at the first record, or NULL if the file
+ * cannot be opened or is not a capture.
+ */
+FILE* capture_reader_open(const char* path) {
+    char magic[sizeof(CAPTURE_MAGIC)] = {0};
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+    if (fread(magic, 1, strlen(CAPTURE_MAGIC), file) != strlen(CAPTURE_MAGIC)
+            || strcmp(magic, CAPTURE_MAGIC) != 0) {
+        fclose(file);
+        return 0;
+    }
+    return file;
+}
+
+/**
+ * Reads the next record of a capture. The line is given back newline
+ * terminated, as it was recieved. record->time accumulates, so the same
+ * record must be passed in for every read of a file.
+ *
+ * Params: (FILE* file, CaptureRecord* record) record should be zeroed
+ * before the first read.
+ * Return: (bool) false at the end of the capture or on a corrupt record.
+ */
+bool capture_read(FILE* file, CaptureRecord* record) {
+    uint64_t delta, connId, length;
+    if (!get_varint(file, &delta) || !get_varint(file, &connId)
+            || !get_varint(file, &length) || length > MAX_LINE - 2) {
+        return false;
+    }
+    if (fread(record->line, 1, length, file) != length) {
+        return false;
+    }
+    record->line[length] = '\n';
+    record->line[length + 1] = '\0';
+    record->time += delta;
+    record->connId = (unsigned) connId;
+    record->length = (int) length + 1;
+    return true;
+}
+
+/**
+ * Writes value as an unsigned LEB128 varint.
+ *
+ * Params: (FILE* file, uint64_t value)
+ * Return: void
+ */
+static void put_varint(FILE* file, uint64_t value) {
+    while (value >= 0x80) {
+        putc((int) (value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    putc((int) value, file);
+}
+
+/**
+ * Reads an unsigned LEB128 varint.
+ *
+ * Params: (FILE* file, uint64_t* value)
+ * Return: (bool) false on end of file or an overlong varint.
+ */
+static bool get_varint(FILE* file, uint64_t* value) {
+    int c, shift = 0;
+    *value = 0;
+    do {
+        if ((c = getc(file)) == EOF || shift > 63) {
+            return false;
+        }
+        *value |= (uint64_t) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return true;
+}
@@ -0,0 +1,46 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "depot.h"
+
+/*
+ * Capture files start with CAPTURE_MAGIC followed by one record per line
+ * recieved. Each record is three LEB128 varints - nanoseconds since the
+ * previous record, connection ID, line length - then the line's bytes.
+ */
+#define CAPTURE_MAGIC "DCAP1\n"
+
+/**
+ * An open capture being written. Connections record from their own
+ * threads, so writes are serialised by the lock.
+ */
+typedef struct {
+    FILE* file;
+    uint64_t last;
+    pthread_mutex_t lock;
+} Capture;
+
+/**
+ * One line read back from a capture. time is in nanoseconds since the
+ * first record.
+ */
+typedef struct {
+    uint64_t time;
+    unsigned connId;
+    int length;
+    char line[MAX_LINE];
+} CaptureRecord;
+
+uint64_t capture_now();
+Capture* capture_open(const char* path);
+void capture_record(Capture* capture, unsigned connId, const char* line);
+void capture_flush(Capture* capture);
+void capture_close(Capture* capture);
+FILE* capture_reader_open(const char* path);
+bool capture_read(FILE* file, CaptureRecord* record);
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+static bool read_im(Client* client);
+static bool read_answers(Client* client, int* completed);
+static void answer(Client* client, char* line);
+static void grow_ring(Client* client);
+static bool wait_ready(Client* client, short events, int timeoutMs,
+        int* completed);
+static uint64_t now_ns(void);
+
+/**
+ * Connects to the depot listening on portNo on this host and does the
+ * IM exchange, the client's IM giving name and, as its port, the one
+ * its end of the connection has, which no depot can be using. The IM
+ * goes before the depot's is read, in the SYN itself where TCP Fast
+ * Open has a cookie for the depot, so commands sent next follow it in
+ * the same flight.
+ *
+ * Params: (int portNo, const char* name) name must be a valid depot
+ * name (no ':', space or newline).
+ * Return: (Client*) the client, or NULL if the depot could not be
+ * reached or did not IM.
+ */
+Client* client_open(int portNo, const char* name) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int yes = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(portNo);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+#ifdef TCP_FASTOPEN_CONNECT
+    setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &yes, sizeof(yes));
+#endif
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address,
+            sizeof(address)) < 0 || getsockname(fd,
+            (struct sockaddr*) &address, &length) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    Client* client = calloc(1, sizeof(Client));
+    client->fd = fd;
+    client->window = CLIENT_WINDOW;
+    client->nextId = 1;
+    client->oldest = 1;
+    client->ringSize = 64;
+    client->ring = calloc(client->ringSize, sizeof(Pending));
+    client->out = malloc(CLIENT_BATCH);
+    client->outLength = snprintf(client->out, CLIENT_BATCH, "IM:%d:%s\n",
+            ntohs(address.sin_port), name);
+    if (!client_flush(client) || !read_im(client)) {
+        client_close(client);
+        return 0;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return client;
+}
+
+/**
+ * Closes a client's connection and frees it. Requests still
+ * unanswered are dropped without their callbacks being called.
+ *
+ * Params: (Client* client)
+ * Return: void
+ */
+void client_close(Client* client) {
+    close(client->fd);
+    free(client->ring);
+    free(client->out);
+    free(client);
+}
+
+/**
+ * Sets how many requests may be unanswered at once; 1 makes every
+ * command wait for the one before it to be answered.
+ *
+ * Params: (Client* client, int window) at least 1.
+ * Return: void
+ */
+void client_set_window(Client* client, int window) {
+    client->window = window < 1 ? 1 : window;
+}
+
+/**
+ * Queues a command, which is sent with the next batch. Once the window
+ * is full, answers are read (and their callbacks called) until there
+ * is room.
+ *
+ * Params: (Client* client, const char* command, Completion done,
+ * void* context) command is one line, with or without its newline;
+ * done, if not NULL, is called with context once it is answered.
+ * Return: (uint64_t) the request's id, or 0 if the connection is
+ * broken.
+ */
+uint64_t client_send(Client* client, const char* command,
+        Completion done, void* context) {
+    char line[CLIENT_BATCH / 4];
+    while (!client->broken && client->outstanding >= client->window) {
+        if (!client_flush(client) || client_poll(client, -1) < 0) {
+            return 0;
+        }
+    }
+    int length = snprintf(line, sizeof(line), "Req:%" PRIu64 ":%.*s\n",
+            client->nextId, (int) strcspn(command, "\n"), command);
+    if (client->broken || length >= (int) sizeof(line)) {
+        return 0;
+    }
+    if (client->outLength + length > CLIENT_BATCH &&
+            !client_flush(client)) {
+        return 0;
+    }
+    uint64_t id = client->nextId++;
+    if (id - client->oldest >= (uint64_t) client->ringSize) {
+        grow_ring(client);
+    }
+    Pending* pending = &client->ring[id & (client->ringSize - 1)];
+    pending->id = id;
+    pending->done = done;
+    pending->context = context;
+    pending->sentAt = now_ns();
+    client->outstanding++;
+    memcpy(client->out + client->outLength, line, length);
+    client->outLength += length;
+    return id;
+}
+
+/**
+ * Writes out every command queued. Answers arriving while the depot is
+ * not ready for more are read meanwhile.
+ *
+ * Params: (Client* client)
+ * Return: (bool) false if the connection is broken.
+ */
+bool client_flush(Client* client) {
+    int written = 0, completed = 0;
+    while (!client->broken && written < client->outLength) {
+        ssize_t sent = send(client->fd, client->out + written,
+                client->outLength - written, MSG_NOSIGNAL);
+        if (sent > 0) {
+            written += sent;
+        } else if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+            client->broken = true;
+        } else if (sent < 0 && errno == EAGAIN) {
+            wait_ready(client, POLLOUT, -1, &completed);
+        }
+    }
+    client->outLength = 0;
+    return !client->broken;
+}
+
+/**
+ * Reads whatever answers have arrived, waiting up to timeoutMs for the
+ * first, and calls their callbacks.
+ *
+ * Params: (Client* client, int timeoutMs) -1 to wait for as long as
+ * it takes, 0 not to wait.
+ * Return: (int) the number of requests answered, or -1 if the
+ * connection is broken.
+ */
+int client_poll(Client* client, int timeoutMs) {
+    int completed = 0;
+    if (!client->broken) {
+        wait_ready(client, 0, timeoutMs, &completed);
+    }
+    return client->broken ? -1 : completed;
+}
+
+/**
+ * Sends every command queued and waits until all have been answered.
+ *
+ * Params: (Client* client)
+ * Return: (bool) false if the connection broke first.
+ */
+bool client_drain(Client* client) {
+    if (!client_flush(client)) {
+        return false;
+    }
+    while (client->outstanding) {
+        if (client_poll(client, -1) < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gives up on requests which have gone unanswered for timeoutMs since
+ * they were queued, oldest first, calling their callbacks as though
+ * the depot had refused them. An answer coming for one later is
+ * ignored. Whether the depot applied the command is then unknown.
+ *
+ * Params: (Client* client, int timeoutMs)
+ * Return: (int) the number of requests given up on.
+ */
+int client_expire(Client* client, int timeoutMs) {
+    uint64_t now = now_ns();
+    int expired = 0;
+    while (client->oldest < client->nextId) {
+        Pending* pending = &client->ring[client->oldest &
+                (client->ringSize - 1)];
+        if (pending->id == client->oldest) {
+            if (now - pending->sentAt < (uint64_t) timeoutMs * 1000000) {
+                break;
+            }
+            Pending request = *pending;
+            pending->id = 0;
+            client->outstanding--;
+            client->expired++;
+            expired++;
+            if (request.done) {
+                request.done(request.context, request.id, false, false, 0);
+            }
+        }
+        client->oldest++;
+    }
+    return expired;
+}
+
+/**
+ * Reads the depot's IM, which comes before anything else, keeping its
+ * name. Anything after it stays in the input buffer.
+ *
+ * Params: (Client* client) the socket is still blocking.
+ * Return: (bool) false if the depot hung up or sent something else.
+ */
+static bool read_im(Client* client) {
+    char* newline = 0;
+    while (!newline) {
+        ssize_t got = read(client->fd, client->in + client->inLength,
+                sizeof(client->in) - client->inLength - 1);
+        if (got <= 0) {
+            return false;
+        }
+        client->inLength += got;
+        client->in[client->inLength] = '\0';
+        newline = strchr(client->in, '\n');
+    }
+    if (sscanf(client->in, "IM:%*d:%63[^:\n]", client->depotName) != 1) {
+        return false;
+    }
+    int used = newline + 1 - client->in;
+    memmove(client->in, newline + 1, client->inLength - used);
+    client->inLength -= used;
+    return true;
+}
+
+/**
+ * Polls the connection for input and for events, reading any answers
+ * which are in.
+ *
+ * Params: (Client* client, short events, int timeoutMs,
+ * int* completed) events are those waited for besides input;
+ * completed is added to for every request answered.
+ * Return: (bool) true if one of events came, not just input.
+ */
+static bool wait_ready(Client* client, short events, int timeoutMs,
+        int* completed) {
+    struct pollfd poller = {client->fd, POLLIN | events, 0};
+    if (poll(&poller, 1, timeoutMs) <= 0) {
+        return false;
+    }
+    if (poller.revents & (POLLIN | POLLERR | POLLHUP)) {
+        read_answers(client, completed);
+    }
+    return (poller.revents & events) != 0;
+}
+
+/**
+ * Reads what input there is and answers every whole line in it.
+ *
+ * Params: (Client* client, int* completed)
+ * Return: (bool) false if the connection is broken.
+ */
+static bool read_answers(Client* client, int* completed) {
+    ssize_t got = read(client->fd, client->in + client->inLength,
+            sizeof(client->in) - client->inLength - 1);
+    if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+        client->broken = true;
+        return false;
+    }
+    if (got < 0) {
+        return true;
+    }
+    client->inLength += got;
+    client->in[client->inLength] = '\0';
+    char* line = client->in;
+    char* newline;
+    while ((newline = strchr(line, '\n'))) {
+        *newline = '\0';
+        uint64_t before = client->answered;
+        answer(client, line);
+        *completed += client->answered - before;
+        line = newline + 1;
+    }
+    client->inLength -= line - client->in;
+    memmove(client->in, line, client->inLength);
+    if (client->inLength == sizeof(client->in) - 1) {
+        /* A line longer than the depot ever sends: not one of ours. */
+        client->inLength = 0;
+    }
+    return true;
+}
+
+/**
+ * Handles one line from the depot. Res:id:OK[:amount] and Res:id:Error
+ * complete the request with that id; anything else (a Deliver sent to
+ * the client as a neighbour, say) is ignored.
+ *
+ * Params: (Client* client, char* line) without its newline.
+ * Return: void
+ */
+static void answer(Client* client, char* line) {
+    char status[8];
+    int64_t amount = 0;
+    uint64_t id;
+    int fields = sscanf(line, "Res:%" SCNu64 ":%7[^:]:%" SCNd64, &id,
+            status, &amount);
+    if (fields < 2 || id < client->oldest || id >= client->nextId) {
+        return;
+    }
+    Pending* pending = &client->ring[id & (client->ringSize - 1)];
+    if (pending->id != id) {
+        return;
+    }
+    Pending request = *pending;
+    bool ok = strcmp(status, "OK") == 0;
+    pending->id = 0;
+    client->outstanding--;
+    client->answered++;
+    client->failed += !ok;
+    while (client->oldest < client->nextId && client->ring[client->oldest &
+            (client->ringSize - 1)].id != client->oldest) {
+        client->oldest++;
+    }
+    if (request.done) {
+        request.done(request.context, id, ok, fields == 3, amount);
+    }
+}
+
+/**
+ * Doubles the ring of pending requests, moving each to its new slot.
+ *
+ * Params: (Client* client)
+ * Return: void
+ */
+static void grow_ring(Client* client) {
+    int size = client->ringSize * 2;
+    Pending* ring = calloc(size, sizeof(Pending));
+    for (uint64_t id = client->oldest; id < client->nextId; id++) {
+        Pending* pending = &client->ring[id & (client->ringSize - 1)];
+        if (pending->id == id) {
+            ring[id & (size - 1)] = *pending;
+        }
+    }
+    free(client->ring);
+    client->ring = ring;
+    client->ringSize = size;
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (uint64_t) nanoseconds.
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
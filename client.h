@@ -0,0 +1,73 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Bytes of commands gathered before they are written out together. */
+#define CLIENT_BATCH 16384
+/* Requests a client may have unanswered before sending waits. */
+#define CLIENT_WINDOW 4096
+
+/**
+ * Called once the depot has answered a request. amount is only
+ * meaningful if hasAmount, being the free stock of the good the
+ * command touched once it was applied. It must not call back into the
+ * client.
+ */
+typedef void (*Completion)(void* context, uint64_t id, bool ok,
+        bool hasAmount, int64_t amount);
+
+/**
+ * A request awaiting its answer, queued at sentAt (CLOCK_MONOTONIC
+ * nanoseconds). id is 0 in a free slot.
+ */
+typedef struct {
+    uint64_t id;
+    Completion done;
+    void* context;
+    uint64_t sentAt;
+} Pending;
+
+/**
+ * A client's connection to a depot. Every command goes out as
+ * Req:id:command, gathered into out until a batch is full or the
+ * caller flushes, and its answer is matched to the callback by id.
+ * Pending requests sit in a ring indexed by id, which holds every id
+ * from oldest, the smallest unanswered, to nextId. window caps how many
+ * may be unanswered; a send past it reads answers until there is room,
+ * as does any write the depot is not ready for, so neither side can be
+ * left blocked on the other. failed counts requests answered with an
+ * Error, and expired those given up on by client_expire(). Not thread
+ * safe.
+ */
+typedef struct {
+    int fd;
+    int window;
+    uint64_t nextId;
+    uint64_t oldest;
+    int outstanding;
+    int ringSize;
+    Pending* ring;
+    char* out;
+    int outLength;
+    char in[CLIENT_BATCH];
+    int inLength;
+    char depotName[64];
+    uint64_t answered;
+    uint64_t failed;
+    uint64_t expired;
+    bool broken;
+} Client;
+
+Client* client_open(int portNo, const char* name);
+void client_close(Client* client);
+void client_set_window(Client* client, int window);
+uint64_t client_send(Client* client, const char* command,
+        Completion done, void* context);
+bool client_flush(Client* client);
+int client_poll(Client* client, int timeoutMs);
+bool client_drain(Client* client);
+int client_expire(Client* client, int timeoutMs);
+
+#endif
@@ -0,0 +1,2550 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "depot.h"
+#include "latency.h"
+#include "flight.h"
+#include "probes.h"
+#include "replica.h"
+#include "ebr.h"
+#include "rebalance.h"
+
+/* Valid commands, indexed by CommandType. */
+static const char* const messages[] = {"Connect", "IM", "Deliver",
+        "Withdraw", "Transfer", "Defer", "Execute", "Ack", "Ping", "Reserve",
+        "Commit", "Release", "Spread", "Broadcast", "Flood",
+        "Target", "Level", "ConnectMany", "For"};
+
+static Resource* find_resource(Depot* depot, const char* good);
+static Resource* insert_resource(Depot* depot, const char* good);
+static void link_hold(Link link);
+static void link_drop(Link link);
+static Neighbour* find_neighbour(Depot* depot, const char* name);
+static bool from_depot(Session* session);
+static Neighbour* add_neighbour(Depot* depot, const char* name,
+        int portNo);
+static void publish_neighbours(Depot* depot, Neighbour* added,
+        Neighbour* removed);
+static void lose_neighbour(Depot* depot, Neighbour* neighbour);
+static void free_neighbour(void* input);
+static void free_resources(void* input);
+static void abandon_compaction(Depot* depot);
+static void release_hold(Depot* depot, Hold* hold);
+static uint64_t flood_origin(Depot* depot);
+static uint64_t mix_id(uint64_t x);
+static uint64_t* seen_slot(uint64_t* table, uint64_t id);
+static bool flood_seen(FloodSeen* floods, uint64_t id);
+static void forward_flood(Depot* depot, const char* from,
+        const char* message);
+static uint64_t verify_seq(const char* input);
+static bool verify_level(const char* input, int64_t* level);
+static int mesh_find(Mesh* mesh, int portNo);
+static void applied(Command* command, Depot* depot, const char* good);
+static void respond(Command* command, Session* session);
+static void mesh_linked(Depot* depot, int portNo);
+static bool queue_transfer(Depot* depot, Neighbour* neighbour,
+        int64_t amount, const char* good, char* message);
+static bool new_delivery(Neighbour* neighbour, uint64_t epoch,
+        uint64_t seq);
+static void record_delivery(Neighbour* neighbour, uint64_t seq);
+static void renumber_transfers(Neighbour* neighbour);
+static char* deliver_lines(Depot* depot, Neighbour* neighbour,
+        uint64_t from, uint64_t to);
+static void send_lines(Link link, char* lines, int count);
+static int join_lines(char* lines, int count);
+static char* first_flight(Session* session, const char* im);
+
+/**
+ * Allocates a depot with the given name and no resources or neighbours.
+ * The host fills in portNo and the connect hook once it is listening.
+ *
+ * Params: (const char* name) the already validated depot name.
+ * Return: (Depot*) the new depot.
+ */
+Depot* depot_create(const char* name) {
+    Depot* depot = calloc(1, sizeof(Depot));
+    depot->name = strdup(name);
+    depot->resourceCapacity = 64;
+    depot->resources = calloc(depot->resourceCapacity + 1,
+            sizeof(Resource*));
+    depot->neighbours = calloc(1, sizeof(Neighbour*));
+    pthread_mutex_init(&depot->lock, 0);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    depot->epoch = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    depot->window = FLOW_WINDOW;
+    depot->holdTtl = (uint64_t) HOLD_TTL_MS * 1000000;
+    depot->hotGoods = sketch_create();
+    depot->chattyPeers = sketch_create();
+    depot->rebalancer = rebalance_create(depot);
+    return depot;
+}
+
+/**
+ * Frees a depot and everything it owns, once any tables it retired
+ * have been reclaimed. Nothing else may be using the depot by now.
+ * Links held by neighbours belong to the host and are only dropped.
+ *
+ * Params: (Depot* depot) the depot to free.
+ * Return: void
+ */
+void depot_destroy(Depot* depot) {
+    rebalance_destroy(depot->rebalancer);
+    ebr_synchronize();
+    for (int i = 0; i < depot->numResources; i++) {
+        free(depot->resources[i]->resource);
+        free(depot->resources[i]);
+    }
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        link_drop(depot->neighbours[i]->link);
+        free_neighbour(depot->neighbours[i]);
+    }
+    for (int i = 0; i < depot->numLost; i++) {
+        free_neighbour(depot->lost[i]);
+    }
+    abandon_compaction(depot);
+    if (depot->holds) {
+        hold_destroy(depot->holds);
+    }
+    free(depot->floods.current);
+    free(depot->floods.previous);
+    free(depot->mesh.pending);
+    free(depot->resources);
+    free(depot->neighbours);
+    free(depot->lost);
+    free(depot->name);
+    sketch_destroy(depot->hotGoods);
+    sketch_destroy(depot->chattyPeers);
+    pthread_mutex_destroy(&depot->lock);
+    free(depot);
+}
+
+/**
+ * Looks up a good in the resource table, passing over entries
+ * compaction has claimed. Must be called inside a critical section or
+ * with the depot lock held, and the result is only good until it is
+ * left.
+ *
+ * Params: (Depot* depot, const char* good)
+ * Return: (Resource*) the good, or NULL if there is none.
+ */
+static Resource* find_resource(Depot* depot, const char* good) {
+    Resource** resources = __atomic_load_n(&depot->resources,
+            __ATOMIC_ACQUIRE);
+    Resource* resource;
+    for (int i = 0; (resource = __atomic_load_n(&resources[i],
+            __ATOMIC_ACQUIRE)); i++) {
+        if (strcmp(good, resource->resource) == 0 &&
+                __atomic_load_n(&resource->amount, __ATOMIC_RELAXED) !=
+                RESOURCE_DEAD) {
+            return resource;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Appends a good, of which there is none yet, to the resource table.
+ * A full table is copied into one twice the size, the old one being
+ * retired. The depot lock must be held.
+ *
+ * Params: (Depot* depot, const char* good)
+ * Return: (Resource*) the new good.
+ */
+static Resource* insert_resource(Depot* depot, const char* good) {
+    Resource* resource = malloc(sizeof(Resource));
+    resource->resource = strdup(good);
+    resource->amount = 0;
+    resource->reserved = 0;
+    if (depot->numResources == depot->resourceCapacity) {
+        Resource** old = depot->resources;
+        depot->resourceCapacity *= 2;
+        Resource** grown = calloc(depot->resourceCapacity + 1,
+                sizeof(Resource*));
+        memcpy(grown, old, sizeof(Resource*) * depot->numResources);
+        __atomic_store_n(&depot->resources, grown, __ATOMIC_RELEASE);
+        ebr_retire(old, free);
+    }
+    __atomic_store_n(&depot->resources[depot->numResources++], resource,
+            __ATOMIC_RELEASE);
+    return resource;
+}
+
+/**
+ * Adds delta to a good's amount, refusing a result which does not fit,
+ * would read as RESOURCE_DEAD, or would leave the good's stock, held
+ * and free, too large to count. reserved is read after amount, which
+ * a Reserve lowers only once it has raised reserved.
+ *
+ * Params: (Resource* resource, int64_t amount, int64_t delta,
+ * int64_t* result) amount is the value last read, and result is set
+ * to the sum.
+ * Return: (bool) true if the sum is a valid amount.
+ */
+static inline bool checked_add(Resource* resource, int64_t amount,
+        int64_t delta, int64_t* result) {
+    int64_t stock;
+    return !__builtin_add_overflow(amount, delta, result) &&
+            *result != RESOURCE_DEAD &&
+            !__builtin_add_overflow(*result, __atomic_load_n(
+            &resource->reserved, __ATOMIC_RELAXED), &stock);
+}
+
+/**
+ * Adds delta to the named good, appending the good to the resource
+ * table if it is not yet known, and passes the new stock on to any
+ * standby. A good already known is adjusted without the depot lock,
+ * unless there is a standby, whose records must go out in the order
+ * the changes were made, the change takes it into debt, which is
+ * refused while it has holds, or compaction claims it first;
+ * compaction holds the lock, so the locked path need not look out for
+ * it. A change which would overflow is refused too, leaving the good
+ * as it was. The depot lock must not be held.
+ *
+ * Params: (Depot* depot, const char* good, int64_t delta)
+ * Return: (bool) false if the change was refused.
+ */
+static bool adjust_resource(Depot* depot, const char* good,
+        int64_t delta) {
+    int64_t amount, result;
+    ebr_enter();
+    Resource* resource = find_resource(depot, good);
+    if (resource && !__atomic_load_n(&depot->replica, __ATOMIC_SEQ_CST)) {
+        amount = __atomic_load_n(&resource->amount, __ATOMIC_ACQUIRE);
+        while (amount != RESOURCE_DEAD) {
+            if (!checked_add(resource, amount, delta, &result)) {
+                ebr_exit();
+                return false;
+            }
+            if (result < 0 && delta < 0) {
+                break;
+            }
+            if (__atomic_compare_exchange_n(&resource->amount, &amount,
+                    result, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                ebr_exit();
+                return true;
+            }
+        }
+    }
+    ebr_exit();
+    pthread_mutex_lock(&depot->lock);
+    resource = find_resource(depot, good);
+    if (!resource) {
+        resource = insert_resource(depot, good);
+    }
+    /* Lock-free adjusters may still race this, so it too must CAS. */
+    amount = __atomic_load_n(&resource->amount, __ATOMIC_ACQUIRE);
+    do {
+        if (!checked_add(resource, amount, delta, &result) ||
+                (result < 0 && delta < 0 && resource->reserved)) {
+            pthread_mutex_unlock(&depot->lock);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&resource->amount, &amount,
+            result, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    if (depot->replica) {
+        replica_stock(depot->replica, good, result + resource->reserved);
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return true;
+}
+
+/**
+ * Adds an initial stock of a good, as given on the command line.
+ *
+ * Params: (Depot* depot, const char* good, int64_t amount)
+ * Return: (bool) false if the good's total would overflow.
+ */
+bool depot_add_resource(Depot* depot, const char* good, int64_t amount) {
+    return adjust_resource(depot, good, amount);
+}
+
+/**
+ * Reads the free stock of a good, without taking the lock.
+ *
+ * Params: (Depot* depot, const char* good)
+ * Return: (int64_t) the amount not held, or 0 if there is no such good.
+ */
+int64_t depot_stock(Depot* depot, const char* good) {
+    int64_t amount = 0;
+    ebr_enter();
+    Resource* resource = find_resource(depot, good);
+    if (resource) {
+        amount = __atomic_load_n(&resource->amount, __ATOMIC_ACQUIRE);
+    }
+    ebr_exit();
+    return amount == RESOURCE_DEAD ? 0 : amount;
+}
+
+/**
+ * Lists the depot's goods, ':' separated, as many as fit.
+ *
+ * Params: (Depot* depot, char* out, int size) size is out's.
+ * Return: (int) the length of the list.
+ */
+int depot_goods(Depot* depot, char* out, int size) {
+    int length = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < depot->numResources; i++) {
+        Resource* resource = depot->resources[i];
+        int name = strlen(resource->resource);
+        if (__atomic_load_n(&resource->amount, __ATOMIC_RELAXED) ==
+                RESOURCE_DEAD) {
+            continue;
+        }
+        if (length + name + 2 > size) {
+            break;
+        }
+        length += sprintf(out + length, "%s%s", length ? ":" : "",
+                resource->resource);
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return length;
+}
+
+/**
+ * Takes a reference to a link's handle, if the host counts them.
+ *
+ * Params: (Link link)
+ * Return: void
+ */
+static void link_hold(Link link) {
+    if (link.hold) {
+        link.hold(link.handle);
+    }
+}
+
+/**
+ * Gives up a reference taken by link_hold().
+ *
+ * Params: (Link link)
+ * Return: void
+ */
+static void link_drop(Link link) {
+    if (link.drop) {
+        link.drop(link.handle);
+    }
+}
+
+/**
+ * Looks up a neighbour by name. Must be called inside a critical
+ * section or with the depot lock held, and the result is only good
+ * until it is left.
+ *
+ * Params: (Depot* depot, const char* name)
+ * Return: (Neighbour*) the neighbour, or NULL if there is none.
+ */
+static Neighbour* find_neighbour(Depot* depot, const char* name) {
+    Neighbour** neighbours = __atomic_load_n(&depot->neighbours,
+            __ATOMIC_ACQUIRE);
+    for (int i = 0; neighbours[i]; i++) {
+        if (strcmp(name, neighbours[i]->name) == 0) {
+            return neighbours[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * Tells whether a session is the current link of a neighbour depot,
+ * the peers depot_tell() sends to, rather than a client's.
+ *
+ * Params: (Session* session)
+ * Return: (bool) true if it is.
+ */
+static bool from_depot(Session* session) {
+    bool linked = false;
+    if (!session->imRecieved) {
+        return false;
+    }
+    ebr_enter();
+    Neighbour* neighbour = find_neighbour(session->depot, session->peer);
+    if (neighbour) {
+        pthread_mutex_lock(&neighbour->lock);
+        linked = neighbour->window &&
+                neighbour->link.handle == session->link.handle &&
+                neighbour->link.send == session->link.send;
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    ebr_exit();
+    return linked;
+}
+
+/**
+ * Adds a neighbour to the registry, restoring it from the lost
+ * neighbours if it is one, else blank but for its name and port. It
+ * has no link until the caller binds one. The depot lock must be held.
+ *
+ * Params: (Depot* depot, const char* name, int portNo)
+ * Return: (Neighbour*) the neighbour.
+ */
+static Neighbour* add_neighbour(Depot* depot, const char* name,
+        int portNo) {
+    Neighbour* neighbour = 0;
+    for (int i = 0; i < depot->numLost; i++) {
+        if (strcmp(name, depot->lost[i]->name) == 0) {
+            neighbour = depot->lost[i];
+            depot->lost[i] = depot->lost[--depot->numLost];
+            neighbour->dials = 0;
+            break;
+        }
+    }
+    if (!neighbour) {
+        neighbour = calloc(1, sizeof(Neighbour));
+        neighbour->name = strdup(name);
+        pthread_mutex_init(&neighbour->lock, 0);
+        pthread_mutex_init(&neighbour->applying, 0);
+    }
+    neighbour->portNo = portNo;
+    publish_neighbours(depot, neighbour, 0);
+    return neighbour;
+}
+
+/**
+ * Replaces the neighbour table with a copy which has added appended
+ * and removed left out (either may be NULL), retiring the old table.
+ * The depot lock must be held.
+ *
+ * Params: (Depot* depot, Neighbour* added, Neighbour* removed)
+ * Return: void
+ */
+static void publish_neighbours(Depot* depot, Neighbour* added,
+        Neighbour* removed) {
+    Neighbour** old = depot->neighbours;
+    Neighbour** table = malloc(sizeof(Neighbour*) *
+            (depot->numNeighbours + 2));
+    int count = 0;
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        if (old[i] != removed) {
+            table[count++] = old[i];
+        }
+    }
+    if (added) {
+        table[count++] = added;
+    }
+    table[count] = 0;
+    depot->numNeighbours = count;
+    __atomic_store_n(&depot->neighbours, table, __ATOMIC_RELEASE);
+    ebr_retire(old, free);
+}
+
+/**
+ * Removes a neighbour whose connection has died from the registry,
+ * unbinding its link. A depot is kept among the lost, to be redialled
+ * and to have its unacked Transfers sent again should it return; a
+ * client is retired. The depot lock must be held.
+ *
+ * Params: (Depot* depot, Neighbour* neighbour) a registered neighbour.
+ * Return: void
+ */
+static void lose_neighbour(Depot* depot, Neighbour* neighbour) {
+    publish_neighbours(depot, 0, neighbour);
+    pthread_mutex_lock(&neighbour->lock);
+    Link link = neighbour->link;
+    memset(&neighbour->link, 0, sizeof(Link));
+    bool client = !neighbour->window;
+    pthread_mutex_unlock(&neighbour->lock);
+    link_drop(link);
+    if (depot->replica && !client) {
+        replica_lost(depot->replica, neighbour->name, neighbour->portNo);
+    }
+    if (client) {
+        ebr_retire(neighbour, free_neighbour);
+        return;
+    }
+    if (depot->numLost == depot->lostCapacity) {
+        depot->lostCapacity = depot->lostCapacity * 2 + 4;
+        depot->lost = realloc(depot->lost,
+                sizeof(Neighbour*) * depot->lostCapacity);
+    }
+    neighbour->nextDial = 0;
+    neighbour->dials = 0;
+    depot->lost[depot->numLost++] = neighbour;
+}
+
+/**
+ * Frees a neighbour and what it owns.
+ *
+ * Params: (void* input) the Neighbour.
+ * Return: void
+ */
+static void free_neighbour(void* input) {
+    Neighbour* neighbour = (Neighbour*) input;
+    for (int i = 0; i < neighbour->numInFlight; i++) {
+        free(neighbour->inFlight[i].good);
+    }
+    free(neighbour->inFlight);
+    free(neighbour->name);
+    pthread_mutex_destroy(&neighbour->lock);
+    pthread_mutex_destroy(&neighbour->applying);
+    free(neighbour);
+}
+
+/**
+ * Frees a NULL-ended list of resource entries, and the list.
+ *
+ * Params: (void* input) the Resource** list.
+ * Return: void
+ */
+static void free_resources(void* input) {
+    Resource** resources = (Resource**) input;
+    for (int i = 0; resources[i]; i++) {
+        free(resources[i]->resource);
+        free(resources[i]);
+    }
+    free(resources);
+}
+
+/**
+ * Runs one step of compacting the resource table, starting a pass if
+ * none is under way. Goods with no stock, free or held, are claimed
+ * by swapping their amount for RESOURCE_DEAD, which lock-free
+ * adjusters notice, and are left out of the new table; it is also
+ * shrunk while under a quarter full. Each step holds the depot lock
+ * over at most COMPACT_STEP entries, so neither new goods nor
+ * lock-free readers wait on a pass.
+ *
+ * Params: (Depot* depot)
+ * Return: (bool) true if the pass has further steps to run.
+ */
+bool depot_compact(Depot* depot) {
+    Compaction* compaction = &depot->compaction;
+    Resource** old = 0;
+    Resource** dead = 0;
+    pthread_mutex_lock(&depot->lock);
+    if (!compaction->table) {
+        compaction->cursor = 0;
+        compaction->count = 0;
+        compaction->capacity = depot->resourceCapacity;
+        compaction->table = malloc(sizeof(Resource*) *
+                (compaction->capacity + 1));
+        compaction->numRemoved = 0;
+        compaction->removedCapacity = COMPACT_STEP;
+        compaction->removed = malloc(sizeof(Resource*) *
+                (compaction->removedCapacity + 1));
+    }
+    int end = compaction->cursor + COMPACT_STEP;
+    if (end > depot->numResources) {
+        end = depot->numResources;
+    }
+    for (; compaction->cursor < end; compaction->cursor++) {
+        Resource* resource = depot->resources[compaction->cursor];
+        int64_t amount = 0;
+        if ((!resource->reserved && __atomic_compare_exchange_n(
+                &resource->amount, &amount, RESOURCE_DEAD, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ||
+                amount == RESOURCE_DEAD) {
+            if (compaction->numRemoved == compaction->removedCapacity) {
+                compaction->removedCapacity *= 2;
+                compaction->removed = realloc(compaction->removed,
+                        sizeof(Resource*) * (compaction->removedCapacity + 1));
+            }
+            compaction->removed[compaction->numRemoved++] = resource;
+            continue;
+        }
+        if (compaction->count == compaction->capacity) {
+            compaction->capacity *= 2;
+            compaction->table = realloc(compaction->table,
+                    sizeof(Resource*) * (compaction->capacity + 1));
+        }
+        compaction->table[compaction->count++] = resource;
+    }
+    bool more = compaction->cursor < depot->numResources;
+    if (!more) {
+        int capacity = depot->resourceCapacity;
+        while (capacity > 64 && compaction->count * 4 < capacity) {
+            capacity /= 2;
+        }
+        if (compaction->numRemoved || capacity < depot->resourceCapacity) {
+            Resource** table = realloc(compaction->table,
+                    sizeof(Resource*) * (capacity + 1));
+            memset(table + compaction->count, 0, sizeof(Resource*) *
+                    (capacity + 1 - compaction->count));
+            old = depot->resources;
+            depot->numResources = compaction->count;
+            depot->resourceCapacity = capacity;
+            __atomic_store_n(&depot->resources, table, __ATOMIC_RELEASE);
+            compaction->table = 0;
+            dead = compaction->removed;
+            dead[compaction->numRemoved] = 0;
+            compaction->removed = 0;
+            compaction->reclaimed += compaction->numRemoved;
+        }
+        compaction->passes++;
+        abandon_compaction(depot);
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (old) {
+        ebr_retire(old, free);
+        ebr_retire(dead, free_resources);
+    }
+    return more;
+}
+
+/**
+ * Drops a compaction pass's unpublished table. Entries it had claimed
+ * stay in the resource table, dead, for the next pass to remove. The
+ * depot lock must be held.
+ *
+ * Params: (Depot* depot)
+ * Return: void
+ */
+static void abandon_compaction(Depot* depot) {
+    free(depot->compaction.table);
+    free(depot->compaction.removed);
+    depot->compaction.table = 0;
+    depot->compaction.removed = 0;
+    depot->compaction.numRemoved = 0;
+}
+
+/**
+ * Sets a good to an absolute amount, as a standby does when applying
+ * its primary's changes.
+ *
+ * Params: (Depot* depot, const char* good, int64_t amount)
+ * Return: void
+ */
+void depot_set_resource(Depot* depot, const char* good, int64_t amount) {
+    pthread_mutex_lock(&depot->lock);
+    Resource* resource = find_resource(depot, good);
+    if (!resource) {
+        resource = insert_resource(depot, good);
+    }
+    __atomic_store_n(&resource->amount, amount, __ATOMIC_RELAXED);
+    if (depot->replica) {
+        replica_stock(depot->replica, good, amount);
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Prints the depot's goods and neighbours in a lexographically sorted
+ * manner, skipping goods of which there are none. A good's stock
+ * includes what is held by Reserves.
+ *
+ * Params: (Depot* depot, FILE* out) the depot and where to print to.
+ * Return: void
+ */
+void depot_report(Depot* depot, FILE* out) {
+    pthread_mutex_lock(&depot->lock);
+    sort_resources(depot);
+    sort_neigh(depot);
+    fprintf(out, "Goods:\n");
+    for (int i = 0; i < depot->numResources; i++) {
+        int64_t amount = __atomic_load_n(&depot->resources[i]->amount,
+                __ATOMIC_RELAXED);
+        if (amount != RESOURCE_DEAD) {
+            amount += depot->resources[i]->reserved;
+        }
+        if (amount != 0 && amount != RESOURCE_DEAD) {
+            fprintf(out, "%s %" PRId64 "\n", depot->resources[i]->resource,
+                    amount);
+        }
+    }
+    fprintf(out, "Neighbours:\n");
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        fprintf(out, "%s\n", depot->neighbours[i]->name);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Prints the depot's runtime statistics: per command latencies, the
+ * busiest goods and peers, how far behind any standby is, the
+ * transfers neighbours have yet to acknowledge, lost neighbours,
+ * outstanding holds, floods, and how compaction and memory
+ * reclamation are keeping up.
+ *
+ * Params: (Depot* depot, FILE* out) the depot and where to print to.
+ * Return: void
+ */
+void depot_stats(Depot* depot, FILE* out) {
+    fprintf(out, "Stats for %s:\n", depot->name);
+    latency_report(out);
+    sketch_report(depot->hotGoods, "Hot goods", out);
+    sketch_report(depot->chattyPeers, "Chatty peers", out);
+    pthread_mutex_lock(&depot->lock);
+    if (depot->replica) {
+        replica_report(depot->replica, out);
+    }
+    fprintf(out, "Unacked transfers: neighbour unacked queued\n");
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        Neighbour* neighbour = depot->neighbours[i];
+        pthread_mutex_lock(&neighbour->lock);
+        if (neighbour->numInFlight) {
+            fprintf(out, "%s %d %" PRIu64 "\n", neighbour->name,
+                    neighbour->numInFlight,
+                    neighbour->nextSeq - neighbour->sent);
+        }
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    fprintf(out, "Lost neighbours: neighbour unacked redials\n");
+    for (int i = 0; i < depot->numLost; i++) {
+        Neighbour* lost = depot->lost[i];
+        pthread_mutex_lock(&lost->lock);
+        fprintf(out, "%s %d %d\n", lost->name, lost->numInFlight,
+                lost->dials);
+        pthread_mutex_unlock(&lost->lock);
+    }
+    fprintf(out, "Holds: outstanding %d expired %" PRIu64 "\n",
+            depot->holds ? depot->holds->count : 0,
+            depot->holds ? depot->holds->expired : 0);
+    fprintf(out, "Floods: started %" PRIu64 " forwarded %" PRIu64
+            " suppressed %" PRIu64 " relayed %" PRIu64 "\n",
+            depot->floods.started,
+            __atomic_load_n(&depot->floods.forwarded, __ATOMIC_RELAXED),
+            depot->floods.suppressed, depot->floods.relayed);
+    fprintf(out, "Mesh: waiting on %d meshes %" PRIu64 " last %.3f ms\n",
+            depot->mesh.numPending, depot->mesh.meshes,
+            depot->mesh.took / 1e6);
+    fprintf(out, "Compaction: goods %d capacity %d passes %" PRIu64
+            " removed %" PRIu64 "\n", depot->numResources,
+            depot->resourceCapacity, depot->compaction.passes,
+            depot->compaction.reclaimed);
+    pthread_mutex_unlock(&depot->lock);
+    rebalance_report(depot->rebalancer, out);
+    ebr_report(out);
+    fflush(out);
+}
+
+/**
+ * Run by the host every interval. Sends each neighbour depot a
+ * heartbeat, which is any ack owed to it or else a Ping, so that idle
+ * links are heard from, and redials lost neighbours whose backoff
+ * (interval, doubling per attempt) has passed.
+ *
+ * Params: (Depot* depot, uint64_t interval) interval in nanoseconds.
+ * Return: void
+ */
+void depot_heartbeat(Depot* depot, uint64_t interval) {
+    uint64_t now = latency_now();
+    pthread_mutex_lock(&depot->lock);
+    int numBeats = 0, numDials = 0;
+    Link* links = malloc(sizeof(Link) * (depot->numNeighbours + 1));
+    char* beats = malloc(sizeof(char) * MAX_LINE *
+            (depot->numNeighbours + 1));
+    int* ports = malloc(sizeof(int) * (depot->numLost + 1));
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        Neighbour* neighbour = depot->neighbours[i];
+        pthread_mutex_lock(&neighbour->lock);
+        if (neighbour->window && neighbour->link.send) {
+            if (neighbour->delivered > neighbour->ackedTo) {
+                neighbour->ackedTo = neighbour->delivered;
+                snprintf(beats + numBeats * MAX_LINE, MAX_LINE,
+                        "Ack:%" PRIu64 ":%" PRIu64 "\n", neighbour->epoch,
+                        neighbour->delivered);
+            } else {
+                snprintf(beats + numBeats * MAX_LINE, MAX_LINE, "Ping\n");
+            }
+            link_hold(neighbour->link);
+            links[numBeats++] = neighbour->link;
+        }
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    for (int i = 0; i < depot->numLost; i++) {
+        Neighbour* lost = depot->lost[i];
+        if (lost->dials < REDIAL_ATTEMPTS && now >= lost->nextDial) {
+            ports[numDials++] = lost->portNo;
+            lost->dials++;
+            lost->nextDial = now + (interval << lost->dials);
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    for (int i = 0; i < numBeats; i++) {
+        links[i].send(links[i].handle, beats + i * MAX_LINE);
+        link_drop(links[i]);
+    }
+    for (int i = 0; i < numDials && depot->connect; i++) {
+        depot->connect(depot, ports[i]);
+    }
+    free(links);
+    free(beats);
+    free(ports);
+}
+
+/**
+ * Run by the host every so often to return the stock of expired holds
+ * to their goods.
+ *
+ * Params: (Depot* depot)
+ * Return: void
+ */
+void depot_expire(Depot* depot) {
+    pthread_mutex_lock(&depot->lock);
+    Hold* expired = depot->holds ?
+            hold_expire(depot->holds, latency_now()) : 0;
+    while (expired) {
+        Hold* next = expired->next;
+        release_hold(depot, expired);
+        expired = next;
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Gives the name of a command as it appears on the wire.
+ *
+ * Params: (CommandType type)
+ * Return: (const char*) the name, "" for COMMAND_INVALID.
+ */
+const char* command_name(CommandType type) {
+    return type < COMMAND_INVALID ? messages[type] : "";
+}
+
+/**
+ * Defines a comparator for comparing two entries of the resource
+ * table. The names of the resources are compared using strcmp, and the
+ * value is returned.
+ *
+ * Params: (const void* a, const void* b) Resource** entries.
+ * Return: (int) as per strcmp.
+ */
+int lexo_cmp(const void* a, const void* b) {
+    const Resource* resource1 = *(Resource**) a;
+    const Resource* resource2 = *(Resource**) b;
+    return strcmp(resource1->resource, resource2->resource);
+}
+
+/**
+ * Defines a comparator for comparing two entries of the neighbour
+ * table. The names of the neighbours are compared using strcmp, and
+ * the value is returned.
+ *
+ * Params: (const void* a, const void* b) Neighbour** entries.
+ * Return: (int) as per strcmp.
+ */
+int neigh_cmp(const void* a, const void* b) {
+    const Neighbour* neigh1 = *(Neighbour**) a;
+    const Neighbour* neigh2 = *(Neighbour**) b;
+    return strcmp(neigh1->name, neigh2->name);
+}
+
+/**
+ * Sorts the neighbours currently added to the Depot using the
+ * neigh_cmp comparator. Readers may be walking the table, so a sorted
+ * copy replaces it. The depot lock must be held.
+ *
+ * Params: (Depot* depot) pointer to the depot struct.
+ * Return: Void
+ */
+void sort_neigh(Depot* depot) {
+    Neighbour** old = depot->neighbours;
+    Neighbour** sorted = malloc(sizeof(Neighbour*) *
+            (depot->numNeighbours + 1));
+    memcpy(sorted, old, sizeof(Neighbour*) * (depot->numNeighbours + 1));
+    qsort(sorted, depot->numNeighbours, sizeof(Neighbour*), neigh_cmp);
+    __atomic_store_n(&depot->neighbours, sorted, __ATOMIC_RELEASE);
+    ebr_retire(old, free);
+}
+
+/**
+ * Sorts the resources currently added to the Depot using the
+ * lexo_cmp comparator. Readers may be walking the table, so a sorted
+ * copy replaces it, and any compaction pass has to start over. The
+ * depot lock must be held.
+ *
+ * Params: (Depot* depot) pointer to the depot struct.
+ * Return: Void
+ */
+void sort_resources(Depot* depot) {
+    Resource** old = depot->resources;
+    Resource** sorted = calloc(depot->resourceCapacity + 1,
+            sizeof(Resource*));
+    memcpy(sorted, old, sizeof(Resource*) * depot->numResources);
+    qsort(sorted, depot->numResources, sizeof(Resource*), lexo_cmp);
+    __atomic_store_n(&depot->resources, sorted, __ATOMIC_RELEASE);
+    ebr_retire(old, free);
+    abandon_compaction(depot);
+}
+
+/**
+ * Prepares the engine state for a new connection which talks back
+ * over link.
+ *
+ * Params: (Session* session, Depot* depot, Link link)
+ * Return: void
+ */
+void session_init(Session* session, Depot* depot, Link link) {
+    memset(session, 0, sizeof(Session));
+    session->depot = depot;
+    session->link = link;
+    session->deferCapacity = 16;
+    session->deferred = malloc(sizeof(Defer) * session->deferCapacity);
+}
+
+/**
+ * Frees the deferred commands held by a session, as its connection
+ * closes, and loses the neighbour it carried unless that neighbour has
+ * since moved to another connection.
+ *
+ * Params: (Session* session)
+ * Return: void
+ */
+void session_destroy(Session* session) {
+    Depot* depot = session->depot;
+    flight_record(FLIGHT_CLOSE, session->connId, latency_now(), "", 0);
+    if (session->imRecieved) {
+        pthread_mutex_lock(&depot->lock);
+        Neighbour* neighbour = find_neighbour(depot, session->peer);
+        if (neighbour && neighbour->link.handle == session->link.handle &&
+                neighbour->link.send == session->link.send) {
+            lose_neighbour(depot, neighbour);
+        }
+        pthread_mutex_unlock(&depot->lock);
+    }
+    for (int i = 0; i < session->deferCount; i++) {
+        free(session->deferred[i].args);
+    }
+    free(session->deferred);
+    session->deferred = 0;
+    session->deferCount = 0;
+}
+
+/**
+ * Sends this depot's IM to the peer, as done upon every new connection,
+ * along with anything first_flight() has to go with it.
+ *
+ * Params: (Session* session)
+ * Return: void
+ */
+void session_open(Session* session) {
+    char* outputMessage = im_creator(session->depot);
+    char* flight = session->dialled ? first_flight(session, outputMessage) :
+            0;
+    flight_record(FLIGHT_OPEN, session->connId, latency_now(), "", 0);
+    session->link.send(session->link.handle, flight ? flight :
+            outputMessage);
+    free(outputMessage);
+    free(flight);
+    session->imSent = true;
+}
+
+/**
+ * Builds the first flight of a connection dialled to the port of a
+ * lost neighbour with Transfers unacked: the IM, For:name:epoch and
+ * the Transfers' Delivers, sent without waiting a round trip for the
+ * peer's IM. If a different depot has since taken the port, or the
+ * neighbour has restarted and so has a new epoch, the For has it
+ * ignore them.
+ *
+ * Params: (Session* session, const char* im) the IM line.
+ * Return: (char*) the lines to send, or NULL to send just the IM.
+ */
+static char* first_flight(Session* session, const char* im) {
+    Depot* depot = session->depot;
+    char* lines = 0;
+    int count = 0;
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < depot->numLost && !lines; i++) {
+        Neighbour* neighbour = depot->lost[i];
+        if (neighbour->portNo != session->dialled) {
+            continue;
+        }
+        pthread_mutex_lock(&neighbour->lock);
+        if (neighbour->sent > neighbour->acked) {
+            count = neighbour->sent - neighbour->acked;
+            lines = deliver_lines(depot, neighbour, neighbour->acked + 1,
+                    neighbour->sent);
+            session->pipelined = neighbour->sent;
+            session->pipelinedEpoch = neighbour->peerEpoch;
+            snprintf(session->pipelinedTo, MAX_PEER, "%s",
+                    neighbour->name);
+        }
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (!lines) {
+        return 0;
+    }
+    int length = join_lines(lines, count);
+    char* flight = malloc(strlen(im) + MAX_PEER + length + 32);
+    if (session->pipelinedEpoch) {
+        sprintf(flight, "%sFor:%s:%" PRIu64 "\n%s", im, session->pipelinedTo,
+                session->pipelinedEpoch, lines);
+    } else {
+        sprintf(flight, "%sFor:%s\n%s", im, session->pipelinedTo, lines);
+    }
+    free(lines);
+    return flight;
+}
+
+/**
+ * Handles one line recieved on a connection. The IM exchange must have
+ * completed by the third message, otherwise the connection is to be
+ * dropped; commands may follow the IM at once, in the same flight.
+ * Every line goes into the flight recorder. Floods passing through are
+ * relayed without being tokenised. When latency tracing is on, the
+ * time taken to parse and to handle the line is recorded, measured
+ * from session->receivedAt if the host set it.
+ *
+ * Params: (Session* session, const char* input) newline terminated line.
+ * Return: (bool) false if the host should close the connection.
+ */
+bool session_input(Session* session, const char* input) {
+    Command command;
+    if (session->msgCount > 1) {
+        if (!(session->imRecieved && session->imSent)) {
+            return false;
+        }
+    }
+    if (!latencyEnabled) {
+        flight_record(FLIGHT_COMMAND, session->connId, session->receivedAt ?
+                session->receivedAt : latency_now(), input,
+                strcspn(input, "\n"));
+        if (!relay_flood(session, input)) {
+            validate_input(input, session);
+        }
+    } else {
+        if (!session->receivedAt) {
+            session->receivedAt = latency_now();
+        }
+        flight_record(FLIGHT_COMMAND, session->connId, session->receivedAt,
+                input, strcspn(input, "\n"));
+        if (relay_flood(session, input)) {
+            latency_record(COMMAND_FLOOD, STAGE_HANDLER,
+                    latency_now() - session->receivedAt);
+        } else if (parse_command(input, &command)) {
+            uint64_t parsed = latency_now();
+            do_input(&command, session);
+            uint64_t handled = latency_now();
+            latency_record(command.type, STAGE_PARSE,
+                    parsed - session->receivedAt);
+            latency_record(command.type, STAGE_HANDLER,
+                    handled - session->receivedAt);
+        } else {
+            respond(&command, session);
+        }
+        session->receivedAt = 0;
+    }
+    /* Counted once handled, so an IM is put down to the name it gives. */
+    if (!session->peer[0]) {
+        snprintf(session->peer, MAX_PEER, "#%u", session->connId);
+    }
+    sketch_add(session->depot->chattyPeers, session->peer);
+    session->msgCount++;
+    return true;
+}
+
+/**
+ * Tokenises a line, treating ':' as a delimiter, into command. Stops
+ * at the first newline or the end of the string. A leading Req:id is
+ * taken off, into request, before anything else is checked, so that a
+ * request too long, with too many fields or with no command at all
+ * still gets its Res:id:Error.
+ *
+ * Params: (const char* input, Command* command)
+ * Return: (bool) true if the line names a known command.
+ */
+bool parse_command(const char* input, Command* command) {
+    int len = strcspn(input, "\n");
+    bool tooLong = len >= MAX_LINE - 1;
+    if (tooLong) {
+        len = MAX_LINE - 1;
+    }
+    memcpy(command->buffer, input, len);
+    command->buffer[len] = '\0';
+    command->type = COMMAND_INVALID;
+    command->request = 0;
+    command->applied = false;
+    command->hasResult = false;
+    command->numArgs = 1;
+    command->args[0] = command->buffer;
+    bool tooMany = false;
+    for (char* c = command->buffer; *c; c++) {
+        if (*c == ':') {
+            *c = '\0';
+            if (command->numArgs == MAX_ARGS) {
+                tooMany = true;
+                break;
+            }
+            command->args[command->numArgs++] = c + 1;
+        }
+    }
+    if (command->numArgs > 1 && strcmp(command->args[0], "Req") == 0) {
+        command->request = verify_seq(command->args[1]);
+        if (!command->request) {
+            return false;
+        }
+        command->numArgs -= 2;
+        memmove(command->args, command->args + 2,
+                sizeof(char*) * command->numArgs);
+    }
+    if (tooLong || tooMany || !command->numArgs) {
+        return false;
+    }
+    for (int i = 0; i < COMMAND_INVALID; i++) {
+        if (strcmp(command->args[0], messages[i]) == 0) {
+            command->type = (CommandType) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Processes the input stream recieved from the client, running the
+ * command it holds if it is one the depot understands.
+ *
+ * Params: (const char* input, Session* session) newline input recieved
+ * from the client and the session it arrived on.
+ * Return: void
+ */
+void validate_input(const char* input, Session* session) {
+    Command command;
+    if (parse_command(input, &command)) {
+        do_input(&command, session);
+    } else {
+        respond(&command, session);
+    }
+}
+
+/**
+ * Calls the handler for the command's type, whichever client or
+ * neighbour sent it.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void
+ */
+void do_input(Command* command, Session* session) {
+    DEPOT_PROBE2(command__start, (int) command->type, session->connId);
+    switch (command->type) {
+        case COMMAND_CONNECT:
+            connect_message(command, session);
+            break;
+        case COMMAND_IM:
+            im_message(command, session);
+            break;
+        case COMMAND_DELIVER:
+            deliver_message(command, session);
+            break;
+        case COMMAND_WITHDRAW:
+            withdraw_message(command, session);
+            break;
+        case COMMAND_TRANSFER:
+            transfer_message(command, session);
+            break;
+        case COMMAND_DEFER:
+            defer_message(command, session);
+            break;
+        case COMMAND_EXECUTE:
+            execute_message(command, session);
+            break;
+        case COMMAND_ACK:
+            ack_message(command, session);
+            break;
+        case COMMAND_PING:
+            /* Being recieved is all a heartbeat has to do. */
+            command->applied = true;
+            break;
+        case COMMAND_RESERVE:
+            reserve_message(command, session);
+            break;
+        case COMMAND_COMMIT:
+            commit_message(command, session);
+            break;
+        case COMMAND_RELEASE:
+            release_message(command, session);
+            break;
+        case COMMAND_SPREAD:
+            spread_message(command, session);
+            break;
+        case COMMAND_BROADCAST:
+            broadcast_message(command, session);
+            break;
+        case COMMAND_FLOOD:
+            flood_message(command, session);
+            break;
+        case COMMAND_TARGET:
+            target_message(command, session);
+            break;
+        case COMMAND_LEVEL:
+            level_message(command, session);
+            break;
+        case COMMAND_CONNECT_MANY:
+            connect_many_message(command, session);
+            break;
+        case COMMAND_FOR:
+            for_message(command, session);
+            break;
+        default:
+            break;
+    }
+    respond(command, session);
+    DEPOT_PROBE2(command__done, (int) command->type, session->connId);
+}
+
+/**
+ * Marks a command as having taken effect, for its response.
+ *
+ * Params: (Command* command, Depot* depot, const char* good) good, if
+ * not NULL, is the good whose free stock the response is to give.
+ * Return: void
+ */
+static void applied(Command* command, Depot* depot, const char* good) {
+    command->applied = true;
+    if (good && command->request) {
+        command->hasResult = true;
+        command->result = depot_stock(depot, good);
+    }
+}
+
+/**
+ * Answers a command sent with a request id: Res:id:OK, with the good's
+ * free stock after it as a fourth field if it touched one, or
+ * Res:id:Error if it was invalid or refused. Commands are handled in
+ * the order they arrive on a connection, but a client may have many
+ * outstanding and match the answers up by id.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void
+ */
+static void respond(Command* command, Session* session) {
+    char response[MAX_LINE];
+    if (!command->request) {
+        return;
+    }
+    if (!command->applied) {
+        snprintf(response, sizeof(response), "Res:%" PRIu64 ":Error\n",
+                command->request);
+    } else if (command->hasResult) {
+        snprintf(response, sizeof(response), "Res:%" PRIu64 ":OK:%" PRId64
+                "\n", command->request, command->result);
+    } else {
+        snprintf(response, sizeof(response), "Res:%" PRIu64 ":OK\n",
+                command->request);
+    }
+    session->link.send(session->link.handle, response);
+}
+
+/**
+ * Converts a positive quantity or port. Does not exit() upon failure,
+ * instead returning 0.
+ *
+ * Params: (const char* input) string to be converted to int.
+ * Return: (int) the converted int.
+ */
+int verify_num(const char* input) {
+    char* ptr;
+    long output = strtol(input, &ptr, 10);
+    if (strlen(input) != 0 && strlen(ptr) == 0 && output > 0
+            && output <= INT_MAX) {
+        return (int) output;
+    }
+    return 0;
+}
+
+/**
+ * Converts a positive quantity of a good, which may be anything up to
+ * INT64_MAX. Does not exit() upon failure, instead returning 0.
+ *
+ * Params: (const char* input) string to be converted.
+ * Return: (int64_t) the converted quantity.
+ */
+int64_t verify_amount(const char* input) {
+    char* ptr;
+    errno = 0;
+    long long output = strtoll(input, &ptr, 10);
+    if (strlen(input) != 0 && strlen(ptr) == 0 && output > 0 &&
+            errno != ERANGE) {
+        return (int64_t) output;
+    }
+    return 0;
+}
+
+/**
+ * Checks a good or depot name. Does not exit() upon failure,
+ * instead returning an empty string.
+ *
+ * Params: (const char* input) the name to check.
+ * Return: (const char*) the input string if verified, "" otherwise.
+ */
+const char* verify_name(const char* input) {
+    if (strlen(input) == 0 || strpbrk(input, " \n\r:")) {
+        return "";
+    }
+    return input;
+}
+
+/**
+ * Deals with the connect message, asking the host to open a connection
+ * to the given port once this connection has completed its IM.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void connect_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 2) {
+        return;
+    }
+    int portNum = verify_num(command->args[1]);
+    if (portNum != 0 && session->imRecieved && depot->connect) {
+        depot->connect(depot, portNum);
+        applied(command, depot, 0);
+    }
+}
+
+/**
+ * Processes a ConnectMany command, ConnectMany:port,port,..., asking
+ * the host to link with every port listed at once. Ports already
+ * linked, or already being waited on, are left out, and the time until
+ * the rest have all IM'd is reported in the stats. The whole command
+ * is ignored if any port is invalid.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void connect_many_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    int ports[MAX_LINE / 2];
+    int count = 0;
+    if (command->numArgs != 2 || !session->imRecieved || !depot->connect) {
+        return;
+    }
+    char* list = command->args[1];
+    char* port;
+    while ((port = strsep(&list, ","))) {
+        ports[count] = verify_num(port);
+        if (ports[count++] == 0) {
+            return;
+        }
+    }
+    count = depot_expect(depot, ports, count);
+    applied(command, depot, 0);
+    if (depot->connectMany) {
+        depot->connectMany(depot, ports, count);
+    } else {
+        for (int i = 0; i < count; i++) {
+            depot->connect(depot, ports[i]);
+        }
+    }
+}
+
+/**
+ * Notes ports the host is about to link with, so the time until every
+ * one of them has IM'd can be reported. Leaves out this depot's own
+ * port, those of neighbours, those already waited on, and repeats.
+ *
+ * Params: (Depot* depot, int* ports, int count)
+ * Return: (int) how many ports are left at the front of ports: those
+ * newly waited on, which are the ones still to dial.
+ */
+int depot_expect(Depot* depot, int* ports, int count) {
+    Mesh* mesh = &depot->mesh;
+    int kept = 0;
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < count; i++) {
+        bool skip = ports[i] == depot->portNo ||
+                mesh_find(mesh, ports[i]) >= 0;
+        for (int j = 0; j < depot->numNeighbours && !skip; j++) {
+            skip = depot->neighbours[j]->portNo == ports[i];
+        }
+        if (skip) {
+            continue;
+        }
+        if (mesh->numPending == mesh->pendingCapacity) {
+            mesh->pendingCapacity = mesh->pendingCapacity * 2 + 8;
+            mesh->pending = realloc(mesh->pending,
+                    sizeof(int) * mesh->pendingCapacity);
+        }
+        if (!mesh->numPending) {
+            mesh->started = latency_now();
+        }
+        mesh->pending[mesh->numPending++] = ports[i];
+        ports[kept++] = ports[i];
+    }
+    pthread_mutex_unlock(&depot->lock);
+    return kept;
+}
+
+/**
+ * Finds a port among those being waited on.
+ *
+ * Params: (Mesh* mesh, int portNo)
+ * Return: (int) its index in pending, or -1.
+ */
+static int mesh_find(Mesh* mesh, int portNo) {
+    for (int i = 0; i < mesh->numPending; i++) {
+        if (mesh->pending[i] == portNo) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Stops waiting on a port now that its depot has IM'd, timing the
+ * mesh if it was the last. The depot lock must be held.
+ *
+ * Params: (Depot* depot, int portNo)
+ * Return: void
+ */
+static void mesh_linked(Depot* depot, int portNo) {
+    Mesh* mesh = &depot->mesh;
+    int i = mesh_find(mesh, portNo);
+    if (i < 0) {
+        return;
+    }
+    mesh->pending[i] = mesh->pending[--mesh->numPending];
+    if (!mesh->numPending) {
+        mesh->took = latency_now() - mesh->started;
+        mesh->meshes++;
+    }
+}
+
+/**
+ * Deals with the IM requests recieved. Adds the information of the
+ * client who sent the IM to the neighbours list of the depot if
+ * not already a neighbour. Ignores IM requests from invalid ports and
+ * client names. A neighbour reconnecting under the same name and port,
+ * or a lost one returning, is moved onto the new link and its unacked
+ * Transfers are sent again. An optional fourth field is the window of
+ * credits the sender grants, given only by depots.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void im_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs < 3 || command->numArgs > 5 ||
+            session->imRecieved) {
+        return;
+    }
+    int portNum = verify_num(command->args[1]);
+    const char* depotName = verify_name(command->args[2]);
+    int window = command->numArgs > 3 ? verify_num(command->args[3]) : 0;
+    uint64_t epoch = command->numArgs > 4 ? verify_seq(command->args[4]) :
+            0;
+    if (portNum == 0 || strcmp(depotName, "") == 0 ||
+            (command->numArgs > 3 && window == 0) ||
+            (command->numArgs > 4 && epoch == 0)) {
+        return;
+    }
+    bool neighbourFound = false;
+    int numResend = 0;
+    char* resend = 0;
+    if (session->pipelinedTo[0] &&
+            (strcmp(session->pipelinedTo, depotName) != 0 ||
+            (epoch && epoch != session->pipelinedEpoch))) {
+        /* The first flight went to a depot which is not this one, or to
+         * a run of it which has since ended. */
+        char retract[MAX_LINE];
+        if (epoch) {
+            snprintf(retract, sizeof(retract), "For:%s:%" PRIu64 "\n",
+                    depotName, epoch);
+        } else {
+            snprintf(retract, sizeof(retract), "For:%s\n", depotName);
+        }
+        session->link.send(session->link.handle, retract);
+        session->pipelined = 0;
+    }
+    pthread_mutex_lock(&depot->lock);
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        if (strcmp(depotName, depot->neighbours[i]->name) == 0 ||
+                portNum == depot->neighbours[i]->portNo) {
+            neighbourFound = true;
+        }
+    }
+    Neighbour* neighbour = find_neighbour(depot, depotName);
+    if (neighbour && neighbour->portNo != portNum) {
+        neighbour = 0;
+    } else if (!neighbourFound) {
+        neighbour = add_neighbour(depot, depotName, portNum);
+        if (depot->replica && window) {
+            replica_neighbour(depot->replica, depotName, portNum);
+        }
+    }
+    if (neighbour) {
+        mesh_linked(depot, portNum);
+        pthread_mutex_lock(&neighbour->lock);
+        Link old = neighbour->link;
+        neighbour->link = session->link;
+        link_hold(neighbour->link);
+        neighbour->window = window;
+        if (epoch && neighbour->peerEpoch && epoch != neighbour->peerEpoch) {
+            renumber_transfers(neighbour);
+        }
+        if (epoch) {
+            neighbour->peerEpoch = epoch;
+        }
+        /* Those sent in the first flight need not go again. */
+        uint64_t from = neighbour->acked > session->pipelined ?
+                neighbour->acked : session->pipelined;
+        numResend = neighbour->sent > from ? neighbour->sent - from : 0;
+        resend = deliver_lines(depot, neighbour, from + 1, neighbour->sent);
+        pthread_mutex_unlock(&neighbour->lock);
+        link_drop(old);
+        session->imRecieved = true;
+        session->heartbeats = window > 0;
+        snprintf(session->peer, MAX_PEER, "%s", depotName);
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (resend) {
+        send_lines(session->link, resend, numResend);
+    }
+    if (session->imRecieved) {
+        applied(command, depot, 0);
+        DEPOT_PROBE3(im, session->connId, depotName, portNum);
+        flight_record(FLIGHT_IM, session->connId, latency_now(), depotName,
+                strlen(depotName));
+    }
+}
+
+/**
+ * Delivers the specified amount of the specified good to the depot's
+ * resources. Processes the input as usual. A Deliver carrying an epoch
+ * and sequence number comes from a neighbour's Transfer: it is applied
+ * only the first time it arrives. Acks, which return credit, go out
+ * once a quarter of the window has been applied since the last, or at
+ * once for a repeat so a reconnected sender can catch up. A Deliver
+ * which would overflow the good's amount is ignored, and a sequenced
+ * one is neither recorded nor acked, so its stock stays with the
+ * sender. So is a sequenced one from a session with no neighbour to
+ * record it against, before the IM or once the link is lost, as the
+ * sender will send it again.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void deliver_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 3 && command->numArgs != 5) {
+        return;
+    }
+    int64_t amount = verify_amount(command->args[1]);
+    const char* good = verify_name(command->args[2]);
+    uint64_t epoch = 0, seq = 0;
+    if (command->numArgs == 5) {
+        epoch = verify_seq(command->args[3]);
+        seq = verify_seq(command->args[4]);
+        if (!epoch || !seq) {
+            return;
+        }
+    }
+    if (amount > 0 && strcmp(good, "") != 0) {
+        char ack[MAX_LINE];
+        ack[0] = '\0';
+        bool apply = true;
+        if (seq && session->misdirected) {
+            return;
+        }
+        Neighbour* neighbour = 0;
+        if (seq) {
+            if (!session->imRecieved) {
+                return;
+            }
+            ebr_enter();
+            neighbour = find_neighbour(depot, session->peer);
+            if (!neighbour) {
+                ebr_exit();
+                return;
+            }
+        }
+        if (neighbour) {
+            /* Only recorded, and so acked, once the stock has gone in;
+             * one refused is sent again when the link is next made. */
+            pthread_mutex_lock(&neighbour->applying);
+            pthread_mutex_lock(&neighbour->lock);
+            bool fresh = new_delivery(neighbour, epoch, seq);
+            pthread_mutex_unlock(&neighbour->lock);
+            apply = fresh && adjust_resource(depot, good, amount);
+            pthread_mutex_lock(&neighbour->lock);
+            if (apply) {
+                record_delivery(neighbour, seq);
+            }
+            if (!fresh || (apply && (neighbour->delivered -
+                    neighbour->ackedTo) * 4 >= depot->window)) {
+                neighbour->ackedTo = neighbour->delivered;
+                snprintf(ack, sizeof(ack), "Ack:%" PRIu64 ":%" PRIu64
+                        "\n", epoch, neighbour->delivered);
+            }
+            pthread_mutex_unlock(&neighbour->lock);
+            pthread_mutex_unlock(&neighbour->applying);
+        } else {
+            apply = adjust_resource(depot, good, amount);
+        }
+        if (neighbour) {
+            ebr_exit();
+        }
+        if (ack[0]) {
+            session->link.send(session->link.handle, ack);
+        }
+        if (apply) {
+            sketch_add(depot->hotGoods, good);
+            applied(command, depot, good);
+        }
+    }
+}
+
+/**
+ * Withdraws the specified amount of the specified good from the depot's
+ * resources. Processes the input as usual. Debt may run as deep as an
+ * int64_t allows; a Withdraw going further is ignored.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void withdraw_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 3) {
+        return;
+    }
+    int64_t amount = verify_amount(command->args[1]);
+    const char* good = verify_name(command->args[2]);
+    if (amount > 0 && strcmp(good, "") != 0 &&
+            adjust_resource(depot, good, -amount)) {
+        sketch_add(depot->hotGoods, good);
+        applied(command, depot, good);
+    }
+}
+
+/**
+ * Withdraws the specified amount of the specified good from the depot's
+ * resources if the destination's name is in the depot's neighbours,
+ * and the withdrawal does not overflow the good's amount.
+ * Sends a deliver message to the destination. A depot's is sequenced,
+ * the transfer being kept until the destination acknowledges it, and
+ * beyond the destination's window is queued until acks come back.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void transfer_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 4) {
+        return;
+    }
+    int64_t amount = verify_amount(command->args[1]);
+    const char* good = verify_name(command->args[2]);
+    if (amount == 0 || strcmp(good, "") == 0) {
+        return;
+    }
+    char message[MAX_LINE];
+    bool linked = false;
+    ebr_enter();
+    Neighbour* neighbour = find_neighbour(depot, command->args[3]);
+    if (neighbour) {
+        pthread_mutex_lock(&neighbour->lock);
+        linked = neighbour->link.send != 0;
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    /* Withdrawn once there is somewhere to send it, so that a Transfer
+     * refused leaves the stock as it was. */
+    if (!linked || !adjust_resource(depot, good, -amount)) {
+        ebr_exit();
+        return;
+    }
+    /* Should the link have died since, a depot's Transfer waits with
+     * its others to be sent again; a client's goes with its connection,
+     * as it would had the client hung up a moment later. */
+    pthread_mutex_lock(&neighbour->lock);
+    Link to = neighbour->link;
+    link_hold(to);
+    bool send = queue_transfer(depot, neighbour, amount, good, message) &&
+            to.send;
+    pthread_mutex_unlock(&neighbour->lock);
+    ebr_exit();
+    sketch_add(depot->hotGoods, good);
+    applied(command, depot, good);
+    if (send) {
+        DEPOT_PROBE3(transfer__send, amount, good, command->args[3]);
+        to.send(to.handle, message);
+        if (session->receivedAt) {
+            latency_record(COMMAND_TRANSFER, STAGE_FLUSH,
+                    latency_now() - session->receivedAt);
+        }
+    }
+    link_drop(to);
+}
+
+/**
+ * Queues a Transfer of amount of good to a neighbour and writes the
+ * Deliver carrying it into message. A depot's is sequenced and kept
+ * until acked, and waits for credit if its window is used up; anyone
+ * else gets a plain Deliver at once. The neighbour's lock must be held.
+ *
+ * Params: (Depot* depot, Neighbour* neighbour, int64_t amount,
+ * const char* good, char* message) message holds MAX_LINE bytes.
+ * Return: (bool) true if message is to be sent now.
+ */
+static bool queue_transfer(Depot* depot, Neighbour* neighbour,
+        int64_t amount, const char* good, char* message) {
+    if (!neighbour->window) {
+        snprintf(message, MAX_LINE, "Deliver:%" PRId64 ":%s\n", amount,
+                good);
+        return true;
+    }
+    if (neighbour->numInFlight == neighbour->inFlightCapacity) {
+        neighbour->inFlightCapacity = neighbour->inFlightCapacity * 2 + 8;
+        neighbour->inFlight = realloc(neighbour->inFlight,
+                sizeof(InFlight) * neighbour->inFlightCapacity);
+    }
+    uint64_t seq = ++neighbour->nextSeq;
+    InFlight* transfer = &neighbour->inFlight[neighbour->numInFlight++];
+    transfer->seq = seq;
+    transfer->amount = amount;
+    transfer->good = strdup(good);
+    snprintf(message, MAX_LINE, "Deliver:%" PRId64 ":%s:%" PRIu64 ":%"
+            PRIu64 "\n", amount, good, depot->epoch, seq);
+    if (neighbour->sent == seq - 1 &&
+            seq - neighbour->acked <= neighbour->window) {
+        neighbour->sent = seq;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Parses a sequence number or epoch.
+ *
+ * Params: (const char* input)
+ * Return: (uint64_t) the number, 0 if input is not a positive integer.
+ */
+static uint64_t verify_seq(const char* input) {
+    char* ptr;
+    if (*input < '0' || *input > '9') {
+        return 0;
+    }
+    uint64_t output = strtoull(input, &ptr, 10);
+    return *ptr ? 0 : output;
+}
+
+/**
+ * Checks a sequenced Deliver from a neighbour against those already
+ * applied. A new epoch means the neighbour has restarted and numbers
+ * afresh. Numbers too far ahead of the cumulative ack to track are
+ * refused, to be sent again later. The neighbour's applying and lock
+ * must be held.
+ *
+ * Params: (Neighbour* neighbour, uint64_t epoch, uint64_t seq)
+ * Return: (bool) true if the Deliver should be applied.
+ */
+static bool new_delivery(Neighbour* neighbour, uint64_t epoch,
+        uint64_t seq) {
+    if (epoch != neighbour->epoch) {
+        neighbour->epoch = epoch;
+        neighbour->delivered = 0;
+        neighbour->seen = 0;
+        neighbour->ackedTo = 0;
+    }
+    return seq > neighbour->delivered &&
+            seq - neighbour->delivered <= DEDUP_WINDOW &&
+            !(neighbour->seen & (uint64_t) 1 <<
+            (seq - neighbour->delivered - 1));
+}
+
+/**
+ * Records a sequenced Deliver which new_delivery() passed as applied,
+ * moving the cumulative ack up past any run it completes. The
+ * neighbour's applying and lock must be held.
+ *
+ * Params: (Neighbour* neighbour, uint64_t seq)
+ * Return: void
+ */
+static void record_delivery(Neighbour* neighbour, uint64_t seq) {
+    neighbour->seen |= (uint64_t) 1 << (seq - neighbour->delivered - 1);
+    while (neighbour->seen & 1) {
+        neighbour->seen >>= 1;
+        neighbour->delivered++;
+    }
+}
+
+/**
+ * Numbers a neighbour's unacked Transfers afresh from 1, once its IM
+ * shows it has restarted, or a standby has taken its place, and so has
+ * no record of which of them it applied. Those already sent still
+ * count against the window, and go again behind the IM. The
+ * neighbour's lock must be held.
+ *
+ * Params: (Neighbour* neighbour)
+ * Return: void
+ */
+static void renumber_transfers(Neighbour* neighbour) {
+    for (int i = 0; i < neighbour->numInFlight; i++) {
+        neighbour->inFlight[i].seq = i + 1;
+    }
+    neighbour->sent -= neighbour->acked;
+    neighbour->nextSeq = neighbour->numInFlight;
+    neighbour->acked = 0;
+}
+
+/**
+ * Processes a neighbour's cumulative ack of this depot's Transfers,
+ * forgetting those it covers and sending on any queued Transfers the
+ * returned credit allows. Acks for a previous run are ignored, as are
+ * those arriving on a connection the neighbour has since left, which
+ * may number Transfers since renumbered.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void ack_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 3 || !session->imRecieved) {
+        return;
+    }
+    uint64_t epoch = verify_seq(command->args[1]);
+    uint64_t acked = verify_seq(command->args[2]);
+    int numRelease = 0;
+    char* release = 0;
+    Link to;
+    ebr_enter();
+    Neighbour* neighbour = find_neighbour(depot, session->peer);
+    if (neighbour) {
+        pthread_mutex_lock(&neighbour->lock);
+    }
+    if (neighbour && epoch == depot->epoch && acked > neighbour->acked &&
+            acked <= neighbour->sent &&
+            neighbour->link.handle == session->link.handle &&
+            neighbour->link.send == session->link.send) {
+        int done = 0;
+        while (done < neighbour->numInFlight &&
+                neighbour->inFlight[done].seq <= acked) {
+            free(neighbour->inFlight[done].good);
+            done++;
+        }
+        neighbour->numInFlight -= done;
+        memmove(neighbour->inFlight, neighbour->inFlight + done,
+                sizeof(InFlight) * neighbour->numInFlight);
+        neighbour->acked = acked;
+        uint64_t last = neighbour->nextSeq;
+        if (neighbour->window && acked + neighbour->window < last) {
+            last = acked + neighbour->window;
+        }
+        if (last > neighbour->sent) {
+            numRelease = last - neighbour->sent;
+            release = deliver_lines(depot, neighbour, neighbour->sent + 1,
+                    last);
+            neighbour->sent = last;
+            to = neighbour->link;
+            link_hold(to);
+        }
+    }
+    if (neighbour) {
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    ebr_exit();
+    if (numRelease) {
+        send_lines(to, release, numRelease);
+        link_drop(to);
+    }
+}
+
+/**
+ * Formats the Delivers for a neighbour's unacked Transfers numbered
+ * from to to, one per MAX_LINE slot. The neighbour's lock must be
+ * held.
+ *
+ * Params: (Depot* depot, Neighbour* neighbour, uint64_t from,
+ * uint64_t to)
+ * Return: (char*) the lines, for send_lines() to send and free.
+ */
+static char* deliver_lines(Depot* depot, Neighbour* neighbour,
+        uint64_t from, uint64_t to) {
+    char* lines = malloc(sizeof(char) * MAX_LINE * (to - from + 1));
+    int first = neighbour->numInFlight ?
+            (int) (from - neighbour->inFlight[0].seq) : 0;
+    for (uint64_t seq = from; seq <= to; seq++) {
+        InFlight* transfer = &neighbour->inFlight[first + seq - from];
+        snprintf(lines + (seq - from) * MAX_LINE, MAX_LINE,
+                "Deliver:%" PRId64 ":%s:%" PRIu64 ":%" PRIu64 "\n",
+                transfer->amount, transfer->good, depot->epoch,
+                transfer->seq);
+    }
+    return lines;
+}
+
+/**
+ * Sends lines formatted by deliver_lines() over a link as one message,
+ * so the host can write (and compress) them as a single frame, then
+ * frees them.
+ *
+ * Params: (Link link, char* lines, int count)
+ * Return: void
+ */
+static void send_lines(Link link, char* lines, int count) {
+    if (count) {
+        join_lines(lines, count);
+        link.send(link.handle, lines);
+    }
+    free(lines);
+}
+
+/**
+ * Packs lines formatted by deliver_lines() together into one string.
+ *
+ * Params: (char* lines, int count) at least 1.
+ * Return: (int) the string's length.
+ */
+static int join_lines(char* lines, int count) {
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        int line = strlen(lines + i * MAX_LINE);
+        memmove(lines + length, lines + i * MAX_LINE, line);
+        length += line;
+    }
+    lines[length] = '\0';
+    return length;
+}
+
+/**
+ * Reserves the specified amount of the specified good under the given
+ * id, moving it out of the good's free stock so that Withdraws and
+ * Transfers cannot take it. Refused if the id is taken or the good has
+ * less free. The hold lasts the depot's holdTtl unless committed or
+ * released first.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void reserve_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 4) {
+        return;
+    }
+    uint64_t id = verify_seq(command->args[1]);
+    int64_t amount = verify_amount(command->args[2]);
+    const char* good = verify_name(command->args[3]);
+    if (!id || !amount || strcmp(good, "") == 0) {
+        return;
+    }
+    pthread_mutex_lock(&depot->lock);
+    Resource* resource = find_resource(depot, good);
+    if (!depot->holds) {
+        depot->holds = hold_create(depot->holdTtl);
+    }
+    if (resource && hold_add(depot->holds, id, resource, amount,
+            latency_now())) {
+        /* Raised first, so lock-free Delivers never undercount. */
+        __atomic_add_fetch(&resource->reserved, amount, __ATOMIC_RELAXED);
+        int64_t available = __atomic_load_n(&resource->amount,
+                __ATOMIC_RELAXED);
+        while (available >= amount && !__atomic_compare_exchange_n(
+                &resource->amount, &available, available - amount, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        if (available < amount) {
+            __atomic_sub_fetch(&resource->reserved, amount,
+                    __ATOMIC_RELAXED);
+            free(hold_take(depot->holds, id));
+        } else {
+            sketch_add(depot->hotGoods, good);
+            command->applied = true;
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (command->applied) {
+        applied(command, depot, good);
+    }
+}
+
+/**
+ * Commits the hold with the given id, its stock leaving the depot as
+ * if withdrawn.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void commit_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 2) {
+        return;
+    }
+    uint64_t id = verify_seq(command->args[1]);
+    pthread_mutex_lock(&depot->lock);
+    Hold* hold = id && depot->holds ? hold_take(depot->holds, id) : 0;
+    if (hold) {
+        Resource* resource = (Resource*) hold->good;
+        int64_t reserved = __atomic_sub_fetch(&resource->reserved,
+                hold->amount, __ATOMIC_RELAXED);
+        if (depot->replica) {
+            replica_stock(depot->replica, resource->resource, reserved +
+                    __atomic_load_n(&resource->amount, __ATOMIC_RELAXED));
+        }
+        free(hold);
+        applied(command, depot, 0);
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Releases the hold with the given id, its stock going back to the
+ * good's free stock.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void release_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 2) {
+        return;
+    }
+    uint64_t id = verify_seq(command->args[1]);
+    pthread_mutex_lock(&depot->lock);
+    Hold* hold = id && depot->holds ? hold_take(depot->holds, id) : 0;
+    if (hold) {
+        release_hold(depot, hold);
+        applied(command, depot, 0);
+    }
+    pthread_mutex_unlock(&depot->lock);
+}
+
+/**
+ * Returns a hold's stock to its good and frees it. The good's stock,
+ * free and held, already fits, so this cannot overflow; it is made
+ * free before it stops being held, so lock-free Delivers never
+ * undercount. The depot lock must be held.
+ *
+ * Params: (Depot* depot, Hold* hold) a hold taken out of the table.
+ * Return: void
+ */
+static void release_hold(Depot* depot, Hold* hold) {
+    Resource* resource = (Resource*) hold->good;
+    __atomic_add_fetch(&resource->amount, hold->amount, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&resource->reserved, hold->amount, __ATOMIC_RELAXED);
+    free(hold);
+}
+
+/**
+ * Transfers the specified amount of the specified good to every
+ * neighbour, or every one whose name starts with the optional prefix,
+ * in one pass. The total is withdrawn once, up front, and refused as
+ * a whole if it overflows; a neighbour lost before its Deliver is
+ * queued has its share put back. Each Deliver is queued as a Transfer
+ * would be, and all go out once every lock is let go.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void spread_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 3 && command->numArgs != 4) {
+        return;
+    }
+    int64_t amount = verify_amount(command->args[1]);
+    const char* good = verify_name(command->args[2]);
+    const char* prefix = command->numArgs == 4 ? command->args[3] : "";
+    if (amount == 0 || strcmp(good, "") == 0) {
+        return;
+    }
+    size_t prefixLength = strlen(prefix);
+    ebr_enter();
+    Neighbour** neighbours = __atomic_load_n(&depot->neighbours,
+            __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (neighbours[count]) {
+        count++;
+    }
+    Neighbour** targets = malloc(sizeof(Neighbour*) * (count + 1));
+    int numTargets = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(neighbours[i]->name, prefix, prefixLength) == 0) {
+            targets[numTargets++] = neighbours[i];
+        }
+    }
+    int64_t total;
+    if (!numTargets || __builtin_mul_overflow(amount, numTargets, &total) ||
+            !adjust_resource(depot, good, -total)) {
+        ebr_exit();
+        free(targets);
+        return;
+    }
+    Link* links = malloc(sizeof(Link) * numTargets);
+    char* lines = malloc(sizeof(char) * MAX_LINE * numTargets);
+    int numSends = 0, numLost = 0;
+    for (int i = 0; i < numTargets; i++) {
+        Neighbour* neighbour = targets[i];
+        pthread_mutex_lock(&neighbour->lock);
+        if (!neighbour->link.send) {
+            numLost++;
+        } else if (queue_transfer(depot, neighbour, amount, good,
+                lines + numSends * MAX_LINE)) {
+            link_hold(neighbour->link);
+            links[numSends++] = neighbour->link;
+        }
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    ebr_exit();
+    if (numLost) {
+        adjust_resource(depot, good, amount * numLost);
+    }
+    if (numLost < numTargets) {
+        sketch_add(depot->hotGoods, good);
+        applied(command, depot, good);
+    }
+    for (int i = 0; i < numSends; i++) {
+        links[i].send(links[i].handle, lines + i * MAX_LINE);
+        link_drop(links[i]);
+    }
+    if (numSends && session->receivedAt) {
+        latency_record(COMMAND_SPREAD, STAGE_FLUSH,
+                latency_now() - session->receivedAt);
+    }
+    free(targets);
+    free(links);
+    free(lines);
+}
+
+/**
+ * Starts a flood delivering the specified amount of the specified good
+ * to every depot in the mesh, this one included, once each. The flood
+ * is given an id, remembered here so it is not taken twice should it
+ * come back round, and sent to every neighbour depot as
+ * Flood:id:amount:good. A Broadcast this depot cannot take itself, as
+ * it would overflow the good's amount, goes no further. Floods are not
+ * sequenced, so one crossing a link as it dies is lost beyond it.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void broadcast_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 3) {
+        return;
+    }
+    int64_t amount = verify_amount(command->args[1]);
+    const char* good = verify_name(command->args[2]);
+    if (amount == 0 || strcmp(good, "") == 0) {
+        return;
+    }
+    if (!adjust_resource(depot, good, amount)) {
+        return;
+    }
+    sketch_add(depot->hotGoods, good);
+    applied(command, depot, good);
+    pthread_mutex_lock(&depot->lock);
+    if (!depot->floods.origin) {
+        depot->floods.origin = flood_origin(depot);
+    }
+    uint64_t id = depot->floods.origin | (++depot->floods.started &
+            (((uint64_t) 1 << FLOOD_COUNT_BITS) - 1));
+    flood_seen(&depot->floods, id);
+    pthread_mutex_unlock(&depot->lock);
+    char message[MAX_LINE];
+    snprintf(message, sizeof(message), "Flood:%" PRIu64 ":%" PRId64 ":%s\n",
+            id, amount, good);
+    forward_flood(depot, 0, message);
+}
+
+/**
+ * Takes delivery of a flood from a neighbour depot and passes it on to
+ * the rest, unless it has been seen before, in which case it has come
+ * round a cycle and goes no further. Only depots may flood; a client
+ * starts one with Broadcast, and a Flood it sends is ignored.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void flood_message(Command* command, Session* session) {
+    Depot* depot = session->depot;
+    if (command->numArgs != 4 || !from_depot(session)) {
+        return;
+    }
+    uint64_t id = verify_seq(command->args[1]);
+    int64_t amount = verify_amount(command->args[2]);
+    const char* good = verify_name(command->args[3]);
+    if (!id || amount == 0 || strcmp(good, "") == 0) {
+        return;
+    }
+    pthread_mutex_lock(&depot->lock);
+    bool seen = flood_seen(&depot->floods, id);
+    if (seen) {
+        depot->floods.suppressed++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (seen) {
+        return;
+    }
+    if (adjust_resource(depot, good, amount)) {
+        sketch_add(depot->hotGoods, good);
+    }
+    char message[MAX_LINE];
+    snprintf(message, sizeof(message), "Flood:%" PRIu64 ":%" PRId64 ":%s\n",
+            id, amount, good);
+    forward_flood(depot, session->peer, message);
+}
+
+/**
+ * Fast path for a flood passing through: a line which is exactly
+ * Flood:id:amount:good and newline is checked field by field in place
+ * rather than tokenised. A repeat is dropped once its id has been
+ * read; a new flood is taken and the line as recieved, not one built
+ * again from its fields, goes on to the other neighbours. Floods from
+ * anyone but a neighbour depot are left to flood_message to ignore.
+ *
+ * Params: (Session* session, const char* input) newline terminated line.
+ * Return: (bool) true if the line was a flood and has been dealt with,
+ * false if it is to be parsed as usual.
+ */
+bool relay_flood(Session* session, const char* input) {
+    Depot* depot = session->depot;
+    char good[MAX_LINE];
+    char* end;
+    if (strncmp(input, "Flood:", 6) != 0 || input[6] < '0' ||
+            input[6] > '9' || !from_depot(session)) {
+        return false;
+    }
+    uint64_t id = strtoull(input + 6, &end, 10);
+    if (!id || *end != ':' || end[1] < '1' || end[1] > '9') {
+        return false;
+    }
+    errno = 0;
+    int64_t amount = strtoll(end + 1, &end, 10);
+    int length = *end == ':' ? strcspn(end + 1, " \r\n:") : 0;
+    if (errno == ERANGE || !length || end[length + 1] != '\n' ||
+            end[length + 2]) {
+        return false;
+    }
+    memcpy(good, end + 1, length);
+    good[length] = '\0';
+    pthread_mutex_lock(&depot->lock);
+    bool seen = flood_seen(&depot->floods, id);
+    if (seen) {
+        depot->floods.suppressed++;
+    } else {
+        depot->floods.relayed++;
+    }
+    pthread_mutex_unlock(&depot->lock);
+    if (seen) {
+        return true;
+    }
+    if (adjust_resource(depot, good, amount)) {
+        sketch_add(depot->hotGoods, good);
+    }
+    forward_flood(depot, session->peer, input);
+    return true;
+}
+
+/**
+ * Processes For:name[:epoch], which heads Delivers a depot sends in
+ * the first flight of a connection before it knows who answered.
+ * Sequenced Delivers are ignored while the latest For names another
+ * depot, or another run of this one.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void for_message(Command* command, Session* session) {
+    if (command->numArgs != 2 && command->numArgs != 3) {
+        return;
+    }
+    uint64_t epoch = command->numArgs == 3 ?
+            verify_seq(command->args[2]) : 0;
+    session->misdirected = strcmp(command->args[1],
+            session->depot->name) != 0 ||
+            (command->numArgs == 3 && epoch != session->depot->epoch);
+}
+
+/**
+ * Works out the high bits of the ids of Broadcasts begun at a depot by
+ * hashing its name, port and epoch. Two depots' ids can only be alike
+ * if these are, whatever their counts of floods begun; a depot's own
+ * ids repeat only after 2^FLOOD_COUNT_BITS floods, long after the seen
+ * ids have forgotten them. Never 0, so neither is an id.
+ *
+ * Params: (Depot* depot) with its port set.
+ * Return: (uint64_t) the bits above FLOOD_COUNT_BITS.
+ */
+static uint64_t flood_origin(Depot* depot) {
+    uint64_t hash = mix_id(depot->epoch) ^ (uint64_t) depot->portNo;
+    for (const char* c = depot->name; *c; c++) {
+        hash = mix_id(hash ^ (unsigned char) *c);
+    }
+    hash = mix_id(hash) << FLOOD_COUNT_BITS;
+    return hash ? hash : (uint64_t) 1 << FLOOD_COUNT_BITS;
+}
+
+/**
+ * Scrambles a number, evenly over all 64 bits (the splitmix64
+ * finaliser).
+ *
+ * Params: (uint64_t x)
+ * Return: (uint64_t) the scrambled number.
+ */
+static uint64_t mix_id(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Finds where an id is, or would go, in one generation of seen ids.
+ *
+ * Params: (uint64_t* table, uint64_t id)
+ * Return: (uint64_t*) the slot, holding id or 0.
+ */
+static uint64_t* seen_slot(uint64_t* table, uint64_t id) {
+    uint64_t i = (id * 0x9e3779b97f4a7c15ULL) >> 32;
+    while (table[i % (FLOOD_SEEN * 2)] &&
+            table[i % (FLOOD_SEEN * 2)] != id) {
+        i++;
+    }
+    return &table[i % (FLOOD_SEEN * 2)];
+}
+
+/**
+ * Records a Broadcast id as seen. The depot lock must be held.
+ *
+ * Params: (FloodSeen* floods, uint64_t id) id is never 0.
+ * Return: (bool) true if it had been seen already.
+ */
+static bool flood_seen(FloodSeen* floods, uint64_t id) {
+    if (!floods->current) {
+        floods->current = calloc(FLOOD_SEEN * 2, sizeof(uint64_t));
+        floods->previous = calloc(FLOOD_SEEN * 2, sizeof(uint64_t));
+    }
+    if (*seen_slot(floods->previous, id) == id) {
+        return true;
+    }
+    uint64_t* slot = seen_slot(floods->current, id);
+    if (*slot == id) {
+        return true;
+    }
+    if (floods->count == FLOOD_SEEN) {
+        uint64_t* emptied = floods->previous;
+        memset(emptied, 0, sizeof(uint64_t) * FLOOD_SEEN * 2);
+        floods->previous = floods->current;
+        floods->current = emptied;
+        floods->count = 0;
+        slot = seen_slot(floods->current, id);
+    }
+    *slot = id;
+    floods->count++;
+    return false;
+}
+
+/**
+ * Sends a Flood line to every neighbour depot but the one it came
+ * from, counting it forwarded.
+ *
+ * Params: (Depot* depot, const char* from, const char* message) from
+ * is the sender's name, or NULL if the flood started here.
+ * Return: void
+ */
+static void forward_flood(Depot* depot, const char* from,
+        const char* message) {
+    __atomic_add_fetch(&depot->floods.forwarded,
+            depot_tell(depot, from, message), __ATOMIC_RELAXED);
+}
+
+/**
+ * Sends a line to every neighbour depot with room in its window but
+ * the one named, gathering their links in one pass and sending once
+ * every lock is let go.
+ *
+ * Params: (Depot* depot, const char* except, const char* message)
+ * except is a neighbour's name, or NULL to leave none out.
+ * Return: (int) the number of neighbours sent the line.
+ */
+int depot_tell(Depot* depot, const char* except, const char* message) {
+    ebr_enter();
+    Neighbour** neighbours = __atomic_load_n(&depot->neighbours,
+            __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (neighbours[count]) {
+        count++;
+    }
+    /* Most depots have few neighbours; only many need the heap. */
+    Link nearby[16];
+    Link* links = count <= 16 ? nearby : malloc(sizeof(Link) * count);
+    int numLinks = 0;
+    for (int i = 0; i < count; i++) {
+        Neighbour* neighbour = neighbours[i];
+        if (except && strcmp(neighbour->name, except) == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&neighbour->lock);
+        if (neighbour->window && neighbour->link.send) {
+            link_hold(neighbour->link);
+            links[numLinks++] = neighbour->link;
+        }
+        pthread_mutex_unlock(&neighbour->lock);
+    }
+    ebr_exit();
+    for (int i = 0; i < numLinks; i++) {
+        links[i].send(links[i].handle, message);
+        link_drop(links[i]);
+    }
+    if (links != nearby) {
+        free(links);
+    }
+    return numLinks;
+}
+
+/**
+ * Processes a target command, Target:good:level, setting the level
+ * this depot keeps the good at with its neighbours, or with a level of
+ * 0 no longer levelling it.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void target_message(Command* command, Session* session) {
+    int64_t level;
+    if (command->numArgs != 3) {
+        return;
+    }
+    const char* good = verify_name(command->args[1]);
+    if (strcmp(good, "") == 0 || !verify_level(command->args[2], &level) ||
+            level < 0) {
+        return;
+    }
+    rebalance_target(session->depot->rebalancer, good, level);
+    applied(command, session->depot, 0);
+}
+
+/**
+ * Takes in a neighbour depot's summary of a good it levels,
+ * Level:good:amount:target, its free amount being signed.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void level_message(Command* command, Session* session) {
+    int64_t amount, target;
+    if (command->numArgs != 4 || !session->imRecieved) {
+        return;
+    }
+    const char* good = verify_name(command->args[1]);
+    if (strcmp(good, "") == 0 || !verify_level(command->args[2], &amount) ||
+            !verify_level(command->args[3], &target) || target < 0) {
+        return;
+    }
+    rebalance_observe(session->depot->rebalancer, session->peer, good,
+            amount, target);
+}
+
+/**
+ * Converts a signed level of stock.
+ *
+ * Params: (const char* input, int64_t* level) where to put it.
+ * Return: (bool) false if input is not a number in range.
+ */
+static bool verify_level(const char* input, int64_t* level) {
+    char* ptr;
+    errno = 0;
+    long long output = strtoll(input, &ptr, 10);
+    if (ptr == input || *ptr != '\0' || errno == ERANGE ||
+            output == RESOURCE_DEAD) {
+        return false;
+    }
+    *level = output;
+    return true;
+}
+
+/**
+ * Processes a defer command, adding the defer request to the list of
+ * Defers held by the session.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void defer_message(Command* command, Session* session) {
+    char* ptr;
+    if (command->numArgs < 2) {
+        return;
+    }
+    long key = strtol(command->args[1], &ptr, 10);
+    if (strlen(ptr) != 0 || key <= 0) {
+        return;
+    }
+    char* defArgs = defer_creator(command);
+    if (!defArgs) {
+        return;
+    }
+    if (session->deferCount == session->deferCapacity) {
+        session->deferCapacity *= 2;
+        session->deferred = realloc(session->deferred,
+                sizeof(Defer) * session->deferCapacity);
+    }
+    Defer* defer = &session->deferred[session->deferCount++];
+    defer->args = defArgs;
+    defer->key = key;
+    defer->complete = false;
+    applied(command, session->depot, 0);
+}
+
+/**
+ * Processes an execute command. Looks for the input key in the list of
+ * defers held by the session, executing every command which
+ * has the same key. Marks the defer request as completed upon execution.
+ *
+ * Params: (Command* command, Session* session)
+ * Return: void.
+ */
+void execute_message(Command* command, Session* session) {
+    int numToExec = 0;
+    char* ptr;
+    if (command->numArgs != 2) {
+        return;
+    }
+    long key = strtol(command->args[1], &ptr, 10);
+    if (strlen(ptr) == 0 && key > 0) {
+        char** toExec = malloc(sizeof(char*) * (session->deferCount + 1));
+        for (int i = 0; i < session->deferCount; i++) {
+            if (key == session->deferred[i].key &&
+                    session->deferred[i].complete == false) {
+                toExec[numToExec++] = session->deferred[i].args;
+                session->deferred[i].complete = true;
+            }
+        }
+        DEPOT_PROBE2(execute__start, key, numToExec);
+        for (int i = 0; i < numToExec; i++) {
+            validate_input(toExec[i], session);
+        }
+        DEPOT_PROBE2(execute__done, key, numToExec);
+        free(toExec);
+        applied(command, session->depot, 0);
+    }
+}
+
+/**
+ * Formats the IM message sent by the server upon a successful connection,
+ * granting the peer this depot's window of credits and giving its
+ * epoch, by which the peer can tell it has restarted.
+ *
+ * Params: (Depot* depot) the depot.
+ * Return: (char*) the IM string, to be freed by the caller.
+ */
+char* im_creator(Depot* depot) {
+    char* output = malloc(sizeof(char) * MAX_LINE);
+    snprintf(output, MAX_LINE, "IM:%d:%s:%d:%" PRIu64 "\n", depot->portNo,
+            depot->name, depot->window, depot->epoch);
+    return output;
+}
+
+/**
+ * Creates the formatted command string for the list of defer
+ * requests. Joins the fields of the deferred command (everything
+ * after the key) back into a single line, adding back in ':' as
+ * required. Only Deliver/Withdraw style (3 field) and Transfer style
+ * (4 field) commands with no empty fields may be deferred.
+ *
+ * Params: (Command* command) the tokenised Defer command.
+ * Return: (char*) formatted line, or NULL if it cannot be deferred.
+ */
+char* defer_creator(Command* command) {
+    int numArgs = command->numArgs - 2;
+    if (numArgs != 3 && numArgs != 4) {
+        return 0;
+    }
+    char* output = malloc(sizeof(char) * MAX_LINE);
+    output[0] = '\0';
+    for (int i = 2; i < command->numArgs; i++) {
+        if (strlen(command->args[i]) == 0) {
+            free(output);
+            return 0;
+        }
+        strcat(output, command->args[i]);
+        strcat(output, i == command->numArgs - 1 ? "\n" : ":");
+    }
+    return output;
+}
@@ -0,0 +1,372 @@
+#ifndef DEPOT_H
+#define DEPOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "sketch.h"
+#include "hold.h"
+
+/* Longest line accepted from a connection, including the newline. */
+#define MAX_LINE 256
+/* Most ':' separated fields a single command may contain. */
+#define MAX_ARGS 16
+/* Bytes of a peer's name kept by its session for diagnostics. */
+#define MAX_PEER 32
+/* Sequence numbers past a neighbour's cumulative ack that can arrive
+ * out of order and still be told apart from repeats. */
+#define DEDUP_WINDOW 64
+/* Unacked Transfers a depot lets each neighbour have outstanding to it,
+ * unless told otherwise; announced in its IM. */
+#define FLOW_WINDOW 256
+/* Times a lost neighbour is redialled, backing off, before giving up. */
+#define REDIAL_ATTEMPTS 8
+/* Resource table entries a step of compaction looks at. */
+#define COMPACT_STEP 256
+/* Broadcasts a depot remembers having seen, so that a flood going
+ * round a cycle in the mesh is not passed on again. */
+#define FLOOD_SEEN 1024
+/* Low bits of a Broadcast id, counting the floods begun at a depot;
+ * the bits above them identify the depot. */
+#define FLOOD_COUNT_BITS 24
+/* Milliseconds a Reserve holds stock for, unless told otherwise. */
+#define HOLD_TTL_MS 30000
+/* The amount of a good compaction has removed; never a real stock, as
+ * checked arithmetic refuses to reach it. */
+#define RESOURCE_DEAD INT64_MIN
+
+/**
+ * Struct which holds the information describing a resource,
+ * the resource name and the amount of that resource at the depot.
+ * The amount is only changed atomically, as goods already in the
+ * table are adjusted without the depot lock, and is RESOURCE_DEAD once
+ * compaction has claimed the entry; it is then skipped by lookups.
+ * Stock held by Reserves is moved out of amount into reserved, which
+ * only changes with the depot lock held, so amount is what is free to
+ * withdraw. A good with holds on it never goes into debt.
+ */
+typedef struct {
+    char* resource;
+    int64_t amount;
+    int64_t reserved;
+} Resource;
+
+/**
+ * Means of sending lines to whatever sits on the other end of a
+ * connection. The engine never touches sockets directly; the host
+ * supplies send() and an opaque handle (a FILE*, a virtual pipe, ...).
+ * A message is one or more newline terminated lines.
+ * A host which frees handles once a connection ends supplies hold()
+ * and drop() as well: the engine holds a reference for the neighbour
+ * registry and for every send made outside the depot lock.
+ */
+typedef struct {
+    void (*send)(void* handle, const char* message);
+    void* handle;
+    void (*hold)(void* handle);
+    void (*drop)(void* handle);
+} Link;
+
+/**
+ * A Transfer sent to a neighbour which it has not yet acknowledged.
+ * Kept so that it can be sent again when the neighbour reconnects.
+ */
+typedef struct {
+    uint64_t seq;
+    int64_t amount;
+    char* good;
+} InFlight;
+
+/**
+ * Contains the information for a neighbouring depot. Provides means
+ * of communication by holding the Link of the connection it came from.
+ * Transfers to it are numbered by nextSeq and held in inFlight until
+ * acked. Only those up to sent have gone out: the neighbour's IM
+ * grants a window of credits, no more than which may be unacked, the
+ * rest queueing. A window of 0 (a client or older depot) means plain
+ * Delivers, neither numbered nor kept. peerEpoch is the epoch given in
+ * its latest IM; should a later IM give another, it has restarted and
+ * the unacked Transfers are numbered afresh. Of the sequenced
+ * Delivers from it (under its epoch), all up to delivered have been
+ * applied, as has delivered + 1 + i for each bit i set in seen; ackedTo
+ * is the last of these acked back. applying is held while one is
+ * checked, applied and recorded, and is taken before the depot lock.
+ * Once lost, nextDial and dials pace the redialling. lock guards
+ * everything but name and portNo, which never change while it is
+ * registered; link is also only set with the depot lock held, and is
+ * cleared once the neighbour is lost.
+ */
+typedef struct {
+    char* name;
+    int portNo;
+    Link link;
+    uint64_t nextSeq;
+    uint64_t sent;
+    uint64_t acked;
+    int window;
+    uint64_t peerEpoch;
+    int numInFlight;
+    int inFlightCapacity;
+    InFlight* inFlight;
+    uint64_t epoch;
+    uint64_t delivered;
+    uint64_t seen;
+    uint64_t ackedTo;
+    uint64_t nextDial;
+    int dials;
+    pthread_mutex_t lock;
+    pthread_mutex_t applying;
+} Neighbour;
+
+/**
+ * Progress of a pass compacting the resource table. Each step takes
+ * the next COMPACT_STEP entries from cursor, marking those with no
+ * stock dead and copying the rest into table, which the last step
+ * publishes in place of the old one if anything died or the table had
+ * grown too sparse. The dead are kept in removed until then.
+ */
+typedef struct {
+    int cursor;
+    int count;
+    int capacity;
+    int numRemoved;
+    int removedCapacity;
+    Resource** table;
+    Resource** removed;
+    uint64_t passes;
+    uint64_t reclaimed;
+} Compaction;
+
+/**
+ * The ids of Broadcasts a depot has seen, in two generations of open
+ * addressed tables of 2 * FLOOD_SEEN slots (0 marking an empty one).
+ * New ids go into current; once it holds FLOOD_SEEN it becomes
+ * previous and the old previous is emptied for reuse, so an id is
+ * remembered for between FLOOD_SEEN and twice that many Broadcasts.
+ * started, forwarded and suppressed count floods begun here, sent on,
+ * and dropped as repeats; relayed counts those taken on the fast path.
+ * origin, set by the first flood begun here, holds the high bits of
+ * the ids of those begun here.
+ */
+typedef struct {
+    uint64_t* current;
+    uint64_t* previous;
+    int count;
+    uint64_t origin;
+    uint64_t started;
+    uint64_t forwarded;
+    uint64_t suppressed;
+    uint64_t relayed;
+} FloodSeen;
+
+/**
+ * Progress towards links with a set of ports, asked for by ConnectMany
+ * or a bootstrap file. pending holds the ports not yet linked, which
+ * started waiting at started; once the last of them links, took is how
+ * long that was and meshes counts it.
+ */
+typedef struct {
+    int numPending;
+    int pendingCapacity;
+    int* pending;
+    uint64_t started;
+    uint64_t took;
+    uint64_t meshes;
+} Mesh;
+
+/**
+ * Represents the depot. Holds this depot's network info, neighbours,
+ * and resources. resources and neighbours are tables of pointers,
+ * ended by a NULL, which are read without locks inside an ebr_enter()
+ * critical section; the lock serialises changes to them. A changed
+ * table, or a removed entry, is only reclaimed once readers have moved
+ * on. Goods are appended in place, while neighbour changes and sorts
+ * publish a new table. hotGoods
+ * counts Deliver and Withdraw by good, chattyPeers lines by sender.
+ * replica, when set, streams every change to a standby depot. epoch
+ * tells this run's sequenced Delivers apart from a previous run's, and
+ * window is the credit this depot grants each neighbour. Depots whose
+ * connection has died wait in lost, unacked Transfers and all, to be
+ * redialled and restored when they IM again. compaction tracks the
+ * background removal of goods of which there are none. holds, created
+ * by the first Reserve, tracks those outstanding, each lasting holdTtl
+ * nanoseconds unless committed or released first. floods remembers
+ * the Broadcasts which have passed through; it and holds are guarded
+ * by lock, bar the forwarded count, which is bumped atomically.
+ * rebalancer levels the goods given a Target with the neighbours'.
+ * mesh, guarded by lock, times links asked for together.
+ */
+typedef struct Depot {
+    int numResources;
+    int resourceCapacity;
+    int portNo;
+    int numNeighbours;
+    int numLost;
+    int lostCapacity;
+    char* name;
+    uint64_t epoch;
+    int window;
+    Resource** resources;
+    Neighbour** neighbours;
+    Neighbour** lost;
+    Compaction compaction;
+    HoldTable* holds;
+    uint64_t holdTtl;
+    FloodSeen floods;
+    Mesh mesh;
+    pthread_mutex_t lock;
+    Sketch* hotGoods;
+    Sketch* chattyPeers;
+    struct Replica* replica;
+    struct Rebalancer* rebalancer;
+    /* Asks the host to open a connection to portNo (Connect:). */
+    void (*connect)(struct Depot* depot, int portNo);
+    /* Asks the host to open connections to count ports at once
+     * (ConnectMany:); without it, connect is called for each. */
+    void (*connectMany)(struct Depot* depot, const int* ports, int count);
+    void* host;
+} Depot;
+
+/**
+ * Holds the information for a defer command. The key, the arguments
+ * to execute, and whether the command has been executed or not.
+ */
+typedef struct {
+    long key;
+    char* args;
+    bool complete;
+} Defer;
+
+/**
+ * The commands understood by the depot, in the order do_input()
+ * dispatches them.
+ */
+typedef enum {
+    COMMAND_CONNECT,
+    COMMAND_IM,
+    COMMAND_DELIVER,
+    COMMAND_WITHDRAW,
+    COMMAND_TRANSFER,
+    COMMAND_DEFER,
+    COMMAND_EXECUTE,
+    COMMAND_ACK,
+    COMMAND_PING,
+    COMMAND_RESERVE,
+    COMMAND_COMMIT,
+    COMMAND_RELEASE,
+    COMMAND_SPREAD,
+    COMMAND_BROADCAST,
+    COMMAND_FLOOD,
+    COMMAND_TARGET,
+    COMMAND_LEVEL,
+    COMMAND_CONNECT_MANY,
+    COMMAND_FOR,
+    COMMAND_INVALID
+} CommandType;
+
+/**
+ * A tokenised command. args point into buffer, args[0] being the
+ * command name, and numArgs counts every ':' separated field. request
+ * is the id of a command sent as Req:id:command, which gets a Res line
+ * back, or 0. Handlers set applied once the command takes effect, and
+ * result, if hasResult, to the free stock of the good it touched.
+ */
+typedef struct {
+    CommandType type;
+    int numArgs;
+    char* args[MAX_ARGS];
+    char buffer[MAX_LINE];
+    uint64_t request;
+    bool applied;
+    bool hasResult;
+    int64_t result;
+} Command;
+
+/**
+ * Per connection state of the engine: the link back to the peer, the
+ * IM handshake progress and the store of deferred commands. receivedAt
+ * is the latency_now() at which the line being handled arrived, or 0.
+ * connId is the host's number for the connection, used in diagnostics,
+ * and peer is the name it gave in its IM (or "#connId" until then).
+ * heartbeats is set once the peer is known to send them, so that the
+ * host may time the connection out when it goes quiet. dialled is the
+ * port the host dialled for the connection (0 if it was accepted); if
+ * a lost neighbour had that port, its unacked Transfers up to
+ * pipelined went out behind the IM, headed For:pipelinedTo, naming
+ * pipelinedEpoch too if the neighbour had given one.
+ * misdirected is set while the peer's latest For names another depot.
+ */
+typedef struct {
+    Depot* depot;
+    Link link;
+    unsigned connId;
+    uint64_t receivedAt;
+    char peer[MAX_PEER];
+    int msgCount;
+    int deferCount;
+    int deferCapacity;
+    Defer* deferred;
+    bool imSent;
+    bool imRecieved;
+    bool heartbeats;
+    int dialled;
+    uint64_t pipelined;
+    char pipelinedTo[MAX_PEER];
+    uint64_t pipelinedEpoch;
+    bool misdirected;
+} Session;
+
+Depot* depot_create(const char* name);
+void depot_destroy(Depot* depot);
+bool depot_add_resource(Depot* depot, const char* good, int64_t amount);
+void depot_set_resource(Depot* depot, const char* good, int64_t amount);
+void depot_report(Depot* depot, FILE* out);
+void depot_stats(Depot* depot, FILE* out);
+void depot_heartbeat(Depot* depot, uint64_t interval);
+bool depot_compact(Depot* depot);
+void depot_expire(Depot* depot);
+int64_t depot_stock(Depot* depot, const char* good);
+int depot_goods(Depot* depot, char* out, int size);
+int depot_tell(Depot* depot, const char* except, const char* message);
+int depot_expect(Depot* depot, int* ports, int count);
+const char* command_name(CommandType type);
+int lexo_cmp(const void* a, const void* b);
+int neigh_cmp(const void* a, const void* b);
+void sort_resources(Depot* depot);
+void sort_neigh(Depot* depot);
+
+void session_init(Session* session, Depot* depot, Link link);
+void session_destroy(Session* session);
+void session_open(Session* session);
+bool session_input(Session* session, const char* input);
+
+bool parse_command(const char* input, Command* command);
+void validate_input(const char* input, Session* session);
+void do_input(Command* command, Session* session);
+int verify_num(const char* input);
+int64_t verify_amount(const char* input);
+const char* verify_name(const char* input);
+void connect_message(Command* command, Session* session);
+void im_message(Command* command, Session* session);
+void deliver_message(Command* command, Session* session);
+void withdraw_message(Command* command, Session* session);
+void transfer_message(Command* command, Session* session);
+void defer_message(Command* command, Session* session);
+void execute_message(Command* command, Session* session);
+void ack_message(Command* command, Session* session);
+void reserve_message(Command* command, Session* session);
+void commit_message(Command* command, Session* session);
+void release_message(Command* command, Session* session);
+void spread_message(Command* command, Session* session);
+void broadcast_message(Command* command, Session* session);
+void flood_message(Command* command, Session* session);
+void for_message(Command* command, Session* session);
+bool relay_flood(Session* session, const char* input);
+void target_message(Command* command, Session* session);
+void level_message(Command* command, Session* session);
+void connect_many_message(Command* command, Session* session);
+char* im_creator(Depot* depot);
+char* defer_creator(Command* command);
+
+#endif
@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "depot.h"
+#include "latency.h"
+#include "replica.h"
+
+/**
+ * A standby depot fed by a follower thread.
+ */
+typedef struct {
+    Depot* depot;
+    int fd;
+    Standby standby;
+} Follower;
+
+/**
+ * In-process throughput benchmark for the depot engine. Feeds a mix of
+ * Deliver, Withdraw, Transfer, Defer and Execute lines straight into a
+ * session, with no sockets involved, so that command processing can be
+ * measured apart from network I/O. The session phases go through
+ * session_input() as a connection would, with and without latency
+ * tracing, to show its overhead, and with a standby replicating over
+ * a local socket.
+ *
+ * Usage: depotbench [-n ops] [-g goods] [-p neighbours]
+ */
+
+void discard_send(void* handle, const char* message);
+double now_seconds();
+char** build_workload(int ops, int goods, int neighbours);
+void report(const char* phase, int ops, double elapsed);
+void bench_session(const char* phase, Depot* depot, Link sink, char** lines,
+        int ops);
+void* follow(void* input);
+void bench_replicated(Depot* depot, Link sink, char** lines, int ops);
+
+int main(int argc, char** argv) {
+    int ops = 1000000, goods = 64, neighbours = 8, opt;
+    while ((opt = getopt(argc, argv, "n:g:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 'g':
+                goods = atoi(optarg);
+                break;
+            case 'p':
+                neighbours = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: depotbench [-n ops] [-g goods] "
+                        "[-p neighbours]\n");
+                exit(1);
+        }
+    }
+    if (ops <= 0 || goods <= 0 || neighbours <= 0) {
+        fprintf(stderr, "Invalid benchmark size\n");
+        exit(1);
+    }
+    Link sink = {discard_send, 0};
+    Depot* depot = depot_create("bench");
+    depot->portNo = 1;
+    Session* peers = malloc(sizeof(Session) * neighbours);
+    for (int i = 0; i < neighbours; i++) {
+        char im[MAX_LINE];
+        snprintf(im, sizeof(im), "IM:%d:peer%d\n", i + 2, i);
+        session_init(&peers[i], depot, sink);
+        session_open(&peers[i]);
+        session_input(&peers[i], im);
+    }
+    char** lines = build_workload(ops, goods, neighbours);
+
+    Session session;
+    session_init(&session, depot, sink);
+    double start = now_seconds();
+    for (int i = 0; i < ops; i++) {
+        validate_input(lines[i], &session);
+    }
+    report("parse+dispatch", ops, now_seconds() - start);
+    session_destroy(&session);
+
+    Command* commands = malloc(sizeof(Command) * ops);
+    for (int i = 0; i < ops; i++) {
+        parse_command(lines[i], &commands[i]);
+    }
+    session_init(&session, depot, sink);
+    start = now_seconds();
+    for (int i = 0; i < ops; i++) {
+        do_input(&commands[i], &session);
+    }
+    report("dispatch", ops, now_seconds() - start);
+    session_destroy(&session);
+
+    latencyEnabled = false;
+    bench_session("session", depot, sink, lines, ops);
+    latencyEnabled = true;
+    bench_session("session traced", depot, sink, lines, ops);
+    latencyEnabled = false;
+    bench_replicated(depot, sink, lines, ops);
+
+    for (int i = 0; i < neighbours; i++) {
+        session_destroy(&peers[i]);
+    }
+    for (int i = 0; i < ops; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(commands);
+    free(peers);
+    depot_destroy(depot);
+    return 0;
+}
+
+/**
+ * Link send function which throws the message away.
+ *
+ * Params: (void* handle, const char* message) both unused.
+ * Return: void
+ */
+void discard_send(void* handle, const char* message) {
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (double) seconds since an arbitrary point.
+ */
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Generates the command lines fed to the engine. Every eighth pair of
+ * commands is a Defer followed later by its Execute; the remainder are
+ * split between Deliver, Withdraw and Transfer over the given number
+ * of goods and neighbours.
+ *
+ * Params: (int ops, int goods, int neighbours)
+ * Return: (char**) ops newline terminated lines.
+ */
+char** build_workload(int ops, int goods, int neighbours) {
+    char** lines = malloc(sizeof(char*) * ops);
+    srand(2310);
+    for (int i = 0; i < ops; i++) {
+        int good = rand() % goods;
+        int amount = rand() % 100 + 1;
+        lines[i] = malloc(sizeof(char) * MAX_LINE);
+        switch (i % 16) {
+            case 14:
+                snprintf(lines[i], MAX_LINE, "Defer:%d:Deliver:%d:good%d\n",
+                        i / 16 + 1, amount, good);
+                break;
+            case 15:
+                snprintf(lines[i], MAX_LINE, "Execute:%d\n", i / 16 + 1);
+                break;
+            default:
+                if (i % 3 == 0) {
+                    snprintf(lines[i], MAX_LINE, "Deliver:%d:good%d\n",
+                            amount, good);
+                } else if (i % 3 == 1) {
+                    snprintf(lines[i], MAX_LINE, "Withdraw:%d:good%d\n",
+                            amount, good);
+                } else {
+                    snprintf(lines[i], MAX_LINE, "Transfer:%d:good%d:peer%d\n",
+                            amount, good, rand() % neighbours);
+                }
+                break;
+        }
+    }
+    return lines;
+}
+
+/**
+ * Times the workload fed line by line through session_input() on a
+ * session which has completed its IM exchange.
+ *
+ * Params: (const char* phase, Depot* depot, Link sink, char** lines,
+ * int ops)
+ * Return: void
+ */
+void bench_session(const char* phase, Depot* depot, Link sink, char** lines,
+        int ops) {
+    static int clients = 0;
+    char im[MAX_LINE];
+    Session session;
+    snprintf(im, sizeof(im), "IM:%d:client%d\n", 60000 + clients, clients);
+    clients++;
+    session_init(&session, depot, sink);
+    session_open(&session);
+    session_input(&session, im);
+    double start = now_seconds();
+    for (int i = 0; i < ops; i++) {
+        session_input(&session, lines[i]);
+    }
+    report(phase, ops, now_seconds() - start);
+    session_destroy(&session);
+}
+
+/**
+ * Follower thread, applying the stream to the standby until it ends.
+ *
+ * Params: (void* input) the Follower.
+ * Return: NULL
+ */
+void* follow(void* input) {
+    Follower* follower = (Follower*) input;
+    replica_follow(follower->depot, follower->fd, &follower->standby);
+    close(follower->fd);
+    return 0;
+}
+
+/**
+ * Times the session workload while every change is streamed to a
+ * standby over a socketpair, then how long the standby takes to catch
+ * up, and checks that it ended up with the same stock.
+ *
+ * Params: (Depot* depot, Link sink, char** lines, int ops)
+ * Return: void
+ */
+void bench_replicated(Depot* depot, Link sink, char** lines, int ops) {
+    int fds[2];
+    pthread_t tid;
+    Follower follower;
+    memset(&follower, 0, sizeof(Follower));
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    follower.depot = depot_create("standby");
+    follower.fd = fds[1];
+    pthread_create(&tid, 0, follow, &follower);
+    Replica* replica = replica_attach(depot, fds[0]);
+    bench_session("replicated", depot, sink, lines, ops);
+    replica_report(replica, stdout);
+    double start = now_seconds();
+    replica_detach(depot);
+    pthread_join(tid, 0);
+    printf("standby caught up in %.3f s, ", now_seconds() - start);
+
+    int mismatched = 0;
+    Depot* standby = follower.depot;
+    for (int i = 0; i < depot->numResources; i++) {
+        int64_t amount = 0;
+        for (int j = 0; j < standby->numResources; j++) {
+            if (strcmp(depot->resources[i]->resource,
+                    standby->resources[j]->resource) == 0) {
+                amount = standby->resources[j]->amount;
+            }
+        }
+        mismatched += amount != depot->resources[i]->amount;
+    }
+    printf("%d of %d goods differ\n", mismatched, depot->numResources);
+    free(follower.standby.peerPorts);
+    depot_destroy(standby);
+}
+
+/**
+ * Prints the throughput of a benchmark phase.
+ *
+ * Params: (const char* phase, int ops, double elapsed)
+ * Return: void
+ */
+void report(const char* phase, int ops, double elapsed) {
+    printf("%-16s %10d ops %8.3f s %12.0f ops/s %8.1f ns/op\n", phase, ops,
+            elapsed, ops / elapsed, elapsed * 1e9 / ops);
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "client.h"
+
+/**
+ * Client throughput benchmark. Drives a running depot through the
+ * client library with Deliver and Withdraw pairs which leave its stock
+ * as it was, first one request at a time and then with ever more of
+ * them outstanding, reporting requests answered per second and how
+ * many were refused.
+ *
+ * Usage: depotload -p port [-n ops] [-g goods]
+ */
+
+/* Windows the benchmark is run with, stop-and-wait first. */
+static const int windows[] = {1, 16, 256, 4096};
+
+void count_ok(void* context, uint64_t id, bool ok, bool hasAmount,
+        int64_t amount);
+double now_seconds();
+
+int main(int argc, char** argv) {
+    int portNo = 0, ops = 100000, goods = 16, opt;
+    while ((opt = getopt(argc, argv, "p:n:g:")) != -1) {
+        switch (opt) {
+            case 'p':
+                portNo = atoi(optarg);
+                break;
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 'g':
+                goods = atoi(optarg);
+                break;
+            default:
+                portNo = 0;
+                break;
+        }
+    }
+    if (portNo <= 0 || ops <= 0 || goods <= 0) {
+        fprintf(stderr, "Usage: depotload -p port [-n ops] [-g goods]\n");
+        exit(1);
+    }
+    printf("window          ops      ops/s    refused\n");
+    for (size_t i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+        Client* client = client_open(portNo, "depotload");
+        if (!client) {
+            fprintf(stderr, "Cannot reach depot\n");
+            exit(2);
+        }
+        client_set_window(client, windows[i]);
+        long confirmed = 0;
+        char line[64];
+        double start = now_seconds();
+        for (int j = 0; j < ops; j++) {
+            snprintf(line, sizeof(line), "%s:1:load%d",
+                    j % 2 ? "Withdraw" : "Deliver", (j / 2) % goods);
+            if (!client_send(client, line, count_ok, &confirmed)) {
+                break;
+            }
+        }
+        bool drained = client_drain(client);
+        double elapsed = now_seconds() - start;
+        printf("%6d %12" PRIu64 " %10.0f %10" PRIu64 "%s\n", windows[i],
+                client->answered, client->answered / elapsed,
+                client->failed, drained ? "" : " (connection lost)");
+        if (confirmed != (long) (client->answered - client->failed)) {
+            fprintf(stderr, "Callbacks missed\n");
+        }
+        client_close(client);
+    }
+    return 0;
+}
+
+/**
+ * Completion counting the requests which were applied.
+ *
+ * Params: (void* context, uint64_t id, bool ok, bool hasAmount,
+ * int64_t amount) context is a long* count.
+ * Return: void
+ */
+void count_ok(void* context, uint64_t id, bool ok, bool hasAmount,
+        int64_t amount) {
+    if (ok) {
+        (*(long*) context)++;
+    }
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (double) seconds since an arbitrary point.
+ */
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "depot.h"
+#include "flight.h"
+
+/**
+ * Per-handler microbenchmarks for the depot engine. Each benchmark times
+ * a single handler over pre-parsed commands at a range of table sizes
+ * and reports ns/op and heap allocations/op. Allocations are counted by
+ * wrapping malloc, calloc, realloc and strdup at link time (see the
+ * depotmicro rule in the makefile).
+ *
+ * Usage: depotmicro [-t seconds] [filter]
+ */
+
+/**
+ * State a benchmark runs against: a depot, the session commands arrive
+ * on, the neighbour sessions registered with the depot and the
+ * commands to feed in.
+ */
+typedef struct {
+    Depot* depot;
+    Session session;
+    Session* peers;
+    int numPeers;
+    int size;
+    int backlog;
+    int numCommands;
+    char** lines;
+    Command* commands;
+} Fixture;
+
+/* Runs operation i of a batch. */
+typedef void (*BenchStep)(Fixture* fixture, int i);
+/* Restores the fixture between batches, outside the timed region. */
+typedef void (*BenchReset)(Fixture* fixture);
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+
+static long allocations;
+
+void discard_send(void* handle, const char* message);
+double now_seconds();
+void fixture_init(Fixture* fixture, int size, int numPeers);
+void fixture_commands(Fixture* fixture, int count, const char* format,
+        int range);
+void fixture_destroy(Fixture* fixture);
+void run_bench(const char* name, Fixture* fixture, int batch,
+        BenchStep step, BenchReset reset);
+void parse_step(Fixture* fixture, int i);
+void deliver_step(Fixture* fixture, int i);
+void withdraw_step(Fixture* fixture, int i);
+void transfer_step(Fixture* fixture, int i);
+void transfer_reset(Fixture* fixture);
+void defer_step(Fixture* fixture, int i);
+void defer_reset(Fixture* fixture);
+void execute_step(Fixture* fixture, int i);
+void execute_reset(Fixture* fixture);
+void stock_reset(Fixture* fixture);
+void input_step(Fixture* fixture, int i);
+void flight_step(Fixture* fixture, int i);
+void sketch_step(Fixture* fixture, int i);
+void bench_parse();
+void bench_flight();
+void bench_sketch();
+void bench_stock(const char* name, int size, BenchStep step,
+        const char* amount);
+void bench_transfer(int neighbours);
+void bench_defer(int backlog);
+void bench_execute(int backlog);
+void bench_holds(int backlog);
+void bench_spread(int neighbours);
+void flood_step(Fixture* fixture, int i);
+void relay_step(Fixture* fixture, int i);
+void bench_flood(int neighbours, bool repeat);
+
+static double minTime = 0.2;
+static const char* filter = "";
+/* Id of the next flood a benchmark sends; ids are never reused. */
+static uint64_t nextFlood = 1;
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char* s) {
+    allocations++;
+    return __real_strdup(s);
+}
+
+int main(int argc, char** argv) {
+    int sizes[] = {16, 256, 4096};
+    int peers[] = {1, 16, 256};
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            minTime = atof(optarg);
+        } else {
+            fprintf(stderr, "Usage: depotmicro [-t seconds] [filter]\n");
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        filter = argv[optind];
+    }
+    printf("%-24s %8s %12s %10s %10s\n", "benchmark", "size", "ops",
+            "ns/op", "allocs/op");
+    bench_parse();
+    bench_flight();
+    bench_sketch();
+    for (int i = 0; i < 3; i++) {
+        bench_stock("deliver_message", sizes[i], deliver_step, "1");
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_stock("withdraw_message", sizes[i], withdraw_step, "1");
+    }
+    /* Amounts past 2^32, and ones soon refused as overflowing. */
+    bench_stock("deliver_wide", 16, deliver_step, "4294967296");
+    bench_stock("withdraw_wide", 16, withdraw_step, "4294967296");
+    bench_stock("deliver_overflow", 16, deliver_step, "4611686018427387904");
+    bench_stock("withdraw_overflow", 16, withdraw_step,
+            "4611686018427387904");
+    for (int i = 0; i < 3; i++) {
+        bench_transfer(peers[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_defer(sizes[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_execute(sizes[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_holds(sizes[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_spread(peers[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        bench_flood(peers[i], false);
+    }
+    bench_flood(16, true);
+    return 0;
+}
+
+/**
+ * Link send function which throws the message away.
+ *
+ * Params: (void* handle, const char* message) both unused.
+ * Return: void
+ */
+void discard_send(void* handle, const char* message) {
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (double) seconds since an arbitrary point.
+ */
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Creates a depot stocked with size goods (good0 ... goodN) and
+ * numPeers registered neighbours (peer0 ... peerN).
+ *
+ * Params: (Fixture* fixture, int size, int numPeers)
+ * Return: void
+ */
+void fixture_init(Fixture* fixture, int size, int numPeers) {
+    Link sink = {discard_send, 0};
+    memset(fixture, 0, sizeof(Fixture));
+    fixture->depot = depot_create("micro");
+    fixture->depot->portNo = 1;
+    fixture->size = size;
+    for (int i = 0; i < size; i++) {
+        char good[32];
+        snprintf(good, sizeof(good), "good%d", i);
+        depot_add_resource(fixture->depot, good, 1000000);
+    }
+    fixture->numPeers = numPeers;
+    fixture->peers = malloc(sizeof(Session) * (numPeers + 1));
+    for (int i = 0; i < numPeers; i++) {
+        char im[MAX_LINE];
+        /* Peers are depots, so Transfers to them take the sequenced
+         * path, with a window wide enough that none are queued. */
+        snprintf(im, sizeof(im), "IM:%d:peer%d:1000000\n", i + 2, i);
+        session_init(&fixture->peers[i], fixture->depot, sink);
+        session_input(&fixture->peers[i], im);
+    }
+    session_init(&fixture->session, fixture->depot, sink);
+}
+
+/**
+ * Fills in count command lines from format, which takes a random
+ * number below range, and their pre-parsed Commands.
+ *
+ * Params: (Fixture* fixture, int count, const char* format, int range)
+ * Return: void
+ */
+void fixture_commands(Fixture* fixture, int count, const char* format,
+        int range) {
+    srand(2310);
+    fixture->numCommands = count;
+    fixture->lines = malloc(sizeof(char*) * count);
+    fixture->commands = malloc(sizeof(Command) * count);
+    for (int i = 0; i < count; i++) {
+        fixture->lines[i] = malloc(sizeof(char) * MAX_LINE);
+        snprintf(fixture->lines[i], MAX_LINE, format, rand() % range);
+        parse_command(fixture->lines[i], &fixture->commands[i]);
+    }
+}
+
+/**
+ * Frees everything held by a fixture.
+ *
+ * Params: (Fixture* fixture)
+ * Return: void
+ */
+void fixture_destroy(Fixture* fixture) {
+    for (int i = 0; i < fixture->numCommands; i++) {
+        free(fixture->lines[i]);
+    }
+    free(fixture->lines);
+    free(fixture->commands);
+    for (int i = 0; i < fixture->numPeers; i++) {
+        session_destroy(&fixture->peers[i]);
+    }
+    free(fixture->peers);
+    session_destroy(&fixture->session);
+    depot_destroy(fixture->depot);
+}
+
+/**
+ * Times step in batches until minTime has elapsed, calling reset (if
+ * any) before each batch outside of the timed region, and prints the
+ * mean cost and allocation count per operation.
+ *
+ * Params: (const char* name, Fixture* fixture, int batch, BenchStep step,
+ * BenchReset reset)
+ * Return: void
+ */
+void run_bench(const char* name, Fixture* fixture, int batch,
+        BenchStep step, BenchReset reset) {
+    double elapsed = 0;
+    long ops = 0, allocs = 0;
+    if (!strstr(name, filter)) {
+        return;
+    }
+    while (elapsed < minTime) {
+        if (reset) {
+            reset(fixture);
+        }
+        long before = allocations;
+        double start = now_seconds();
+        for (int i = 0; i < batch; i++) {
+            step(fixture, i);
+        }
+        elapsed += now_seconds() - start;
+        allocs += allocations - before;
+        ops += batch;
+    }
+    printf("%-24s %8d %12ld %10.1f %10.2f\n", name, fixture->size, ops,
+            elapsed * 1e9 / ops, (double) allocs / ops);
+}
+
+void parse_step(Fixture* fixture, int i) {
+    Command command;
+    parse_command(fixture->lines[i % fixture->numCommands], &command);
+}
+
+void flight_step(Fixture* fixture, int i) {
+    flight_record(FLIGHT_COMMAND, 0, i,
+            fixture->lines[i % fixture->numCommands], 24);
+}
+
+void sketch_step(Fixture* fixture, int i) {
+    sketch_add(fixture->depot->hotGoods,
+            fixture->lines[i % fixture->numCommands]);
+}
+
+void deliver_step(Fixture* fixture, int i) {
+    deliver_message(&fixture->commands[i % fixture->numCommands],
+            &fixture->session);
+}
+
+void withdraw_step(Fixture* fixture, int i) {
+    withdraw_message(&fixture->commands[i % fixture->numCommands],
+            &fixture->session);
+}
+
+void transfer_step(Fixture* fixture, int i) {
+    transfer_message(&fixture->commands[i % fixture->numCommands],
+            &fixture->session);
+}
+
+/**
+ * Has every neighbour acknowledge the Transfers sent to it, as they
+ * would in steady state, so the unacked lists stay short.
+ *
+ * Params: (Fixture* fixture)
+ * Return: void
+ */
+void transfer_reset(Fixture* fixture) {
+    Depot* depot = fixture->depot;
+    for (int i = 0; i < fixture->numPeers; i++) {
+        char ack[MAX_LINE];
+        Command command;
+        snprintf(ack, sizeof(ack), "Ack:%" PRIu64 ":%" PRIu64 "\n",
+                depot->epoch, depot->neighbours[i]->nextSeq);
+        parse_command(ack, &command);
+        ack_message(&command, &fixture->peers[i]);
+    }
+}
+
+void defer_step(Fixture* fixture, int i) {
+    defer_message(&fixture->commands[i % fixture->numCommands],
+            &fixture->session);
+}
+
+/**
+ * Trims the defer store back to the backlog size, so every batch of
+ * defers starts from the same number of outstanding entries.
+ *
+ * Params: (Fixture* fixture)
+ * Return: void
+ */
+void defer_reset(Fixture* fixture) {
+    Session* session = &fixture->session;
+    for (int i = fixture->backlog; i < session->deferCount; i++) {
+        free(session->deferred[i].args);
+    }
+    session->deferCount = fixture->backlog;
+}
+
+void execute_step(Fixture* fixture, int i) {
+    execute_message(&fixture->commands[i], &fixture->session);
+}
+
+/**
+ * Marks every deferred command as pending again so the next batch of
+ * Executes finds the full backlog.
+ *
+ * Params: (Fixture* fixture)
+ * Return: void
+ */
+void execute_reset(Fixture* fixture) {
+    for (int i = 0; i < fixture->session.deferCount; i++) {
+        fixture->session.deferred[i].complete = false;
+    }
+}
+
+/**
+ * Restocks every good, so that a run of Withdraws never finds one
+ * short.
+ *
+ * Params: (Fixture* fixture)
+ * Return: void
+ */
+void stock_reset(Fixture* fixture) {
+    for (int i = 0; i < fixture->depot->numResources; i++) {
+        fixture->depot->resources[i]->amount = 1000000;
+    }
+}
+
+void input_step(Fixture* fixture, int i) {
+    do_input(&fixture->commands[i % fixture->numCommands],
+            &fixture->session);
+}
+
+/**
+ * Benchmarks tokenising a mix of command lines.
+ *
+ * Params: void
+ * Return: void
+ */
+void bench_parse() {
+    Fixture fixture;
+    fixture_init(&fixture, 0, 0);
+    fixture_commands(&fixture, 1024, "Transfer:%d:good1:peer1\n", 1000);
+    run_bench("parse_command", &fixture, 1024, parse_step, 0);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks recording a command in the flight recorder.
+ *
+ * Params: void
+ * Return: void
+ */
+void bench_flight() {
+    Fixture fixture;
+    fixture_init(&fixture, 0, 0);
+    fixture_commands(&fixture, 1024, "Transfer:%d:good1:peer1\n", 1000);
+    run_bench("flight_record", &fixture, 1024, flight_step, 0);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks counting a good in the hot goods sketch, with a few goods
+ * taking most of the updates.
+ *
+ * Params: void
+ * Return: void
+ */
+void bench_sketch() {
+    Fixture fixture;
+    fixture_init(&fixture, 0, 0);
+    fixture_commands(&fixture, 1024, "good%d", 1000);
+    for (int i = 0; i < fixture.numCommands; i += 2) {
+        snprintf(fixture.lines[i], MAX_LINE, "good%d", i % 8);
+    }
+    run_bench("sketch_add", &fixture, 1024, sketch_step, 0);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks a Deliver or Withdraw handler against a catalogue of
+ * size goods, each message moving the given amount.
+ *
+ * Params: (const char* name, int size, BenchStep step,
+ * const char* amount) name labels the results.
+ * Return: void
+ */
+void bench_stock(const char* name, int size, BenchStep step,
+        const char* amount) {
+    Fixture fixture;
+    char format[MAX_LINE];
+    snprintf(format, sizeof(format), "%s:%s:good%%d\n",
+            step == deliver_step ? "Deliver" : "Withdraw", amount);
+    fixture_init(&fixture, size, 0);
+    fixture_commands(&fixture, 1024, format, size);
+    run_bench(name, &fixture, 1024, step, 0);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks Transfer to a random one of the given number of
+ * neighbours.
+ *
+ * Params: (int neighbours)
+ * Return: void
+ */
+void bench_transfer(int neighbours) {
+    Fixture fixture;
+    fixture_init(&fixture, neighbours, neighbours);
+    fixture_commands(&fixture, 1024, "Transfer:1:good0:peer%d\n", neighbours);
+    run_bench("transfer_message", &fixture, 1024, transfer_step,
+            transfer_reset);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks adding Defers to a store already holding backlog entries.
+ *
+ * Params: (int backlog)
+ * Return: void
+ */
+void bench_defer(int backlog) {
+    Fixture fixture;
+    fixture_init(&fixture, backlog, 0);
+    fixture_commands(&fixture, backlog, "Defer:%d:Deliver:1:good0\n",
+            backlog);
+    /* Keys of 0 are rejected, so the store may hold a few less. */
+    for (int i = 0; i < backlog; i++) {
+        defer_message(&fixture.commands[i], &fixture.session);
+    }
+    fixture.backlog = fixture.session.deferCount;
+    run_bench("defer_message", &fixture, 1024, defer_step, defer_reset);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks Executing each key of a store holding backlog entries,
+ * one per key, in a random order.
+ *
+ * Params: (int backlog)
+ * Return: void
+ */
+void bench_execute(int backlog) {
+    Fixture fixture;
+    char line[MAX_LINE];
+    fixture_init(&fixture, backlog, 0);
+    fixture_commands(&fixture, backlog, "Execute:%d\n", backlog);
+    for (int i = 0; i < backlog; i++) {
+        Command defer;
+        snprintf(line, sizeof(line), "Defer:%d:Deliver:1:good0\n", i + 1);
+        parse_command(line, &defer);
+        defer_message(&defer, &fixture.session);
+        snprintf(fixture.lines[i], MAX_LINE, "Execute:%d\n", i + 1);
+    }
+    for (int i = backlog - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        char* swap = fixture.lines[i];
+        fixture.lines[i] = fixture.lines[j];
+        fixture.lines[j] = swap;
+    }
+    for (int i = 0; i < backlog; i++) {
+        parse_command(fixture.lines[i], &fixture.commands[i]);
+    }
+    run_bench("execute_message", &fixture, backlog, execute_step,
+            execute_reset);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks Withdraw, which must leave held stock be, and a Reserve
+ * then Release of one more hold, against 16 goods with backlog holds
+ * already outstanding on them.
+ *
+ * Params: (int backlog)
+ * Return: void
+ */
+void bench_holds(int backlog) {
+    Fixture fixture;
+    char line[MAX_LINE];
+    fixture_init(&fixture, 16, 0);
+    for (int i = 0; i < backlog; i++) {
+        Command reserve;
+        snprintf(line, sizeof(line), "Reserve:%d:1:good%d\n", i + 1, i % 16);
+        parse_command(line, &reserve);
+        reserve_message(&reserve, &fixture.session);
+    }
+    fixture.size = backlog;
+    fixture_commands(&fixture, 1024, "Withdraw:1:good%d\n", 16);
+    run_bench("withdraw_held", &fixture, 1024, withdraw_step, stock_reset);
+    for (int i = 0; i < fixture.numCommands; i++) {
+        if (i % 2) {
+            snprintf(fixture.lines[i], MAX_LINE, "Release:%d\n",
+                    backlog + 1 + i / 2);
+        } else {
+            snprintf(fixture.lines[i], MAX_LINE, "Reserve:%d:1:good%d\n",
+                    backlog + 1 + i / 2, i / 2 % 16);
+        }
+        parse_command(fixture.lines[i], &fixture.commands[i]);
+    }
+    run_bench("reserve_release", &fixture, 1024, input_step, 0);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Benchmarks Spread to every one of the given number of neighbours,
+ * each Spread costing what that many Transfers would.
+ *
+ * Params: (int neighbours)
+ * Return: void
+ */
+void bench_spread(int neighbours) {
+    Fixture fixture;
+    fixture_init(&fixture, 1, neighbours);
+    fixture.size = neighbours;
+    fixture_commands(&fixture, 64, "Spread:1:good0\n", 1);
+    run_bench("spread_message", &fixture, 64, input_step, transfer_reset);
+    fixture_destroy(&fixture);
+}
+
+/**
+ * Takes a flood from the first neighbour the tokenising way, with a new
+ * id unless the fixture's backlog asks for repeats.
+ */
+void flood_step(Fixture* fixture, int i) {
+    snprintf(fixture->lines[0], MAX_LINE, "Flood:%" PRIu64 ":1:good0\n",
+            fixture->backlog ? 1 : nextFlood++);
+    validate_input(fixture->lines[0], &fixture->peers[0]);
+}
+
+/* As flood_step, on the relay fast path. */
+void relay_step(Fixture* fixture, int i) {
+    snprintf(fixture->lines[0], MAX_LINE, "Flood:%" PRIu64 ":1:good0\n",
+            fixture->backlog ? 1 : nextFlood++);
+    relay_flood(&fixture->peers[0], fixture->lines[0]);
+}
+
+/**
+ * Benchmarks a flood coming in from one neighbour and going on to the
+ * rest, parsed and rebuilt by flood_message and then passed on as it is
+ * by relay_flood. With repeat, every flood has been seen before.
+ *
+ * Params: (int neighbours, bool repeat)
+ * Return: void
+ */
+void bench_flood(int neighbours, bool repeat) {
+    Fixture fixture;
+    fixture_init(&fixture, 1, neighbours);
+    fixture.size = neighbours;
+    fixture.backlog = repeat;
+    fixture_commands(&fixture, 1, "Flood:%d:1:good0\n", 1);
+    run_bench(repeat ? "flood_repeat" : "flood_message", &fixture, 64,
+            flood_step, 0);
+    run_bench(repeat ? "relay_repeat" : "flood_relay", &fixture, 64,
+            relay_step, 0);
+    fixture_destroy(&fixture);
+}
@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "client.h"
+
+/**
+ * Connection multiplexing proxy. Accepts any number of client
+ * connections and carries their commands to one depot over a fixed
+ * number of links, opened with the client library, so the depot sees
+ * the same few connections however many clients come and go. Each
+ * client is pinned to one link, so its commands reach the depot in
+ * order and its Defers and Executes meet in the same session, their
+ * keys being renumbered so clients cannot run each other's. Clients
+ * are served in turn, PROXY_QUANTUM lines at a time, each with at most
+ * PROXY_WINDOW commands unanswered, so a busy client cannot starve the
+ * rest. A client's Req:id: commands are answered with its own ids,
+ * matched up by the ids the link sent them with, and with an Error if
+ * the depot has not answered within the timeout. One thread polls
+ * everything. The listening port is printed on stdout, and SIGHUP
+ * prints statistics to stderr.
+ *
+ * Usage: depotproxy [-l port] [-k links] [-t timeout_ms] depotport
+ */
+
+/* Links to the depot, unless -k says otherwise. */
+#define PROXY_LINKS 4
+/* Lines a client may have forwarded per turn. */
+#define PROXY_QUANTUM 8
+/* Commands a client may have awaiting the depot's answer. */
+#define PROXY_WINDOW 64
+/* Bytes of a client's input held before it is read no further. */
+#define PROXY_BUFFER 4096
+/* Longest line the depot reads. */
+#define PROXY_LINE 256
+/* Milliseconds a command may await its answer, unless -t says
+ * otherwise. */
+#define PROXY_TIMEOUT_MS 10000
+
+/**
+ * A client's Defer key and the key it goes to the depot as.
+ */
+typedef struct {
+    long key;
+    long global;
+} DeferKey;
+
+/**
+ * A client connection, with count of its commands awaiting the depot.
+ * A client which has finished sending (eof) still has its last lines
+ * forwarded and answered; one which is dropped (closed) gets no more
+ * answers. Either is kept until all it sent has been answered or timed
+ * out, as their routes point at it.
+ */
+typedef struct {
+    int fd;
+    int link;
+    bool imRecieved;
+    bool eof;
+    bool closed;
+    char in[PROXY_BUFFER];
+    int inLength;
+    char* out;
+    int outLength;
+    int outCapacity;
+    int count;
+    int numKeys;
+    int keyCapacity;
+    DeferKey* keys;
+} ProxyClient;
+
+/**
+ * Where the depot's answer to a forwarded command goes: the client and
+ * the id it is to be answered with (0 for none). A route is the link
+ * callback's context, so the link, matching the answer by the id it
+ * sent the command with, hands back the right one. Finished routes are
+ * kept on the proxy's spare list.
+ */
+typedef struct Route {
+    struct Route* next;
+    struct Proxy* proxy;
+    ProxyClient* client;
+    uint64_t request;
+} Route;
+
+/**
+ * The proxy: its listening socket, the links to the depot with the
+ * number of clients pinned to each, the clients, and spare routes.
+ */
+typedef struct Proxy {
+    int listener;
+    int portNo;
+    int numLinks;
+    Client** links;
+    int* linkClients;
+    int numClients;
+    int clientCapacity;
+    ProxyClient** clients;
+    int turn;
+    long nextKey;
+    int timeoutMs;
+    Route* spareRoutes;
+    uint64_t accepted;
+    uint64_t forwarded;
+    uint64_t refused;
+} Proxy;
+
+void open_listener(Proxy* proxy, int portNo);
+void run(Proxy* proxy);
+void accept_clients(Proxy* proxy);
+void read_client(ProxyClient* client);
+void write_client(ProxyClient* client);
+void forward_lines(Proxy* proxy, ProxyClient* client);
+bool forward_line(Proxy* proxy, ProxyClient* client, char* line);
+long global_key(Proxy* proxy, ProxyClient* client, long key);
+void answered(void* context, uint64_t id, bool ok, bool hasAmount,
+        int64_t amount);
+void client_answer(ProxyClient* client, uint64_t request, bool ok,
+        bool hasAmount, int64_t amount);
+void client_write(ProxyClient* client, const char* line);
+void reap_clients(Proxy* proxy);
+void report(Proxy* proxy);
+void on_hup(int signal);
+
+/* Set by SIGHUP, for the loop to print statistics. */
+static volatile sig_atomic_t statsWanted;
+
+int main(int argc, char** argv) {
+    int portNo = 0, numLinks = PROXY_LINKS, opt;
+    Proxy proxy;
+    memset(&proxy, 0, sizeof(Proxy));
+    proxy.timeoutMs = PROXY_TIMEOUT_MS;
+    while ((opt = getopt(argc, argv, "l:k:t:")) != -1) {
+        switch (opt) {
+            case 'l':
+                portNo = atoi(optarg);
+                break;
+            case 'k':
+                numLinks = atoi(optarg);
+                break;
+            case 't':
+                proxy.timeoutMs = atoi(optarg);
+                break;
+            default:
+                numLinks = 0;
+                break;
+        }
+    }
+    if (optind != argc - 1 || numLinks < 1 || portNo < 0 ||
+            proxy.timeoutMs <= 0 || atoi(argv[optind]) <= 0) {
+        fprintf(stderr, "Usage: depotproxy [-l port] [-k links] "
+                "[-t timeout_ms] depotport\n");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_hup;
+    sigaction(SIGHUP, &sa, 0);
+    open_listener(&proxy, portNo);
+    proxy.numLinks = numLinks;
+    proxy.links = malloc(sizeof(Client*) * numLinks);
+    proxy.linkClients = calloc(numLinks, sizeof(int));
+    for (int i = 0; i < numLinks; i++) {
+        char name[32];
+        /* Named after the proxy's port, so proxies never clash. */
+        snprintf(name, sizeof(name), "proxy%d-%d", proxy.portNo, i);
+        proxy.links[i] = client_open(atoi(argv[optind]), name);
+        if (!proxy.links[i]) {
+            fprintf(stderr, "Cannot reach depot\n");
+            exit(2);
+        }
+    }
+    proxy.nextKey = 1;
+    printf("%d\n", proxy.portNo);
+    fflush(stdout);
+    run(&proxy);
+    return 0;
+}
+
+/**
+ * Starts listening, on portNo or any free port if it is 0, without
+ * blocking in accept().
+ *
+ * Params: (Proxy* proxy, int portNo)
+ * Return: void
+ */
+void open_listener(Proxy* proxy, int portNo) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int reuse = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(portNo);
+    proxy->listener = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(proxy->listener, SOL_SOCKET, SO_REUSEADDR, &reuse,
+            sizeof(reuse));
+    if (bind(proxy->listener, (struct sockaddr*) &address,
+            sizeof(address)) < 0 || listen(proxy->listener, SOMAXCONN) < 0) {
+        fprintf(stderr, "Cannot listen\n");
+        exit(3);
+    }
+    getsockname(proxy->listener, (struct sockaddr*) &address, &length);
+    proxy->portNo = ntohs(address.sin_port);
+    fcntl(proxy->listener, F_SETFL, O_NONBLOCK);
+}
+
+/**
+ * The proxy's loop. Waits on the listener, the links and every client,
+ * reads and writes whatever is ready, times out commands the depot has
+ * sat on, then gives each client its turn to forward, starting one
+ * further along each time round, and sends the links' batches. The
+ * wait is cut short often enough for a timeout to be at most half as
+ * late again. Exits if the depot goes away.
+ *
+ * Params: (Proxy* proxy)
+ * Return: void
+ */
+void run(Proxy* proxy) {
+    int capacity = 0;
+    struct pollfd* polls = 0;
+    while (true) {
+        int count = 1 + proxy->numLinks + proxy->numClients;
+        if (count > capacity) {
+            capacity = count * 2;
+            polls = realloc(polls, sizeof(struct pollfd) * capacity);
+        }
+        polls[0] = (struct pollfd) {proxy->listener, POLLIN, 0};
+        for (int i = 0; i < proxy->numLinks; i++) {
+            polls[1 + i] = (struct pollfd) {proxy->links[i]->fd, POLLIN, 0};
+        }
+        for (int i = 0; i < proxy->numClients; i++) {
+            ProxyClient* client = proxy->clients[i];
+            short events = client->outLength ? POLLOUT : 0;
+            if (!client->eof && client->inLength < PROXY_BUFFER - 1) {
+                events |= POLLIN;
+            }
+            polls[1 + proxy->numLinks + i] = (struct pollfd) {client->fd,
+                    events, 0};
+        }
+        if (poll(polls, count, proxy->timeoutMs / 2 + 1) < 0 &&
+                errno != EINTR) {
+            perror("poll");
+            exit(4);
+        }
+        if (statsWanted) {
+            statsWanted = 0;
+            report(proxy);
+        }
+        for (int i = 0; i < proxy->numLinks; i++) {
+            if (polls[1 + i].revents &&
+                    client_poll(proxy->links[i], 0) < 0) {
+                fprintf(stderr, "Depot went away\n");
+                exit(2);
+            }
+            client_expire(proxy->links[i], proxy->timeoutMs);
+        }
+        /* Clients accepted now were not polled, so come after. */
+        for (int i = 0; i < count - 1 - proxy->numLinks; i++) {
+            short revents = polls[1 + proxy->numLinks + i].revents;
+            if (revents & POLLOUT) {
+                write_client(proxy->clients[i]);
+            }
+            if (revents & (POLLIN | POLLERR | POLLHUP)) {
+                read_client(proxy->clients[i]);
+            }
+        }
+        if (polls[0].revents) {
+            accept_clients(proxy);
+        }
+        for (int i = 0; i < proxy->numClients; i++) {
+            forward_lines(proxy, proxy->clients[(proxy->turn + i) %
+                    proxy->numClients]);
+        }
+        proxy->turn++;
+        for (int i = 0; i < proxy->numLinks; i++) {
+            if (!client_flush(proxy->links[i])) {
+                fprintf(stderr, "Depot went away\n");
+                exit(2);
+            }
+        }
+        reap_clients(proxy);
+    }
+}
+
+/**
+ * Accepts every client waiting, pinning each to the link with fewest
+ * clients and sending it the depot's IM.
+ *
+ * Params: (Proxy* proxy)
+ * Return: void
+ */
+void accept_clients(Proxy* proxy) {
+    int fd;
+    while ((fd = accept(proxy->listener, 0, 0)) >= 0) {
+        ProxyClient* client = calloc(1, sizeof(ProxyClient));
+        client->fd = fd;
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        for (int i = 1; i < proxy->numLinks; i++) {
+            if (proxy->linkClients[i] < proxy->linkClients[client->link]) {
+                client->link = i;
+            }
+        }
+        proxy->linkClients[client->link]++;
+        if (proxy->numClients == proxy->clientCapacity) {
+            proxy->clientCapacity = proxy->clientCapacity * 2 + 16;
+            proxy->clients = realloc(proxy->clients,
+                    sizeof(ProxyClient*) * proxy->clientCapacity);
+        }
+        proxy->clients[proxy->numClients++] = client;
+        proxy->accepted++;
+        char im[PROXY_LINE];
+        snprintf(im, sizeof(im), "IM:%d:%s\n", proxy->portNo,
+                proxy->links[client->link]->depotName);
+        client_write(client, im);
+    }
+}
+
+/**
+ * Reads what a client has sent, as far as its buffer has room, noting
+ * when it has sent all it will.
+ *
+ * Params: (ProxyClient* client)
+ * Return: void
+ */
+void read_client(ProxyClient* client) {
+    ssize_t got = read(client->fd, client->in + client->inLength,
+            PROXY_BUFFER - 1 - client->inLength);
+    if (got == 0) {
+        client->eof = true;
+    } else if (got < 0 && errno != EAGAIN && errno != EINTR) {
+        client->closed = true;
+    } else if (got > 0) {
+        client->inLength += got;
+    }
+}
+
+/**
+ * Writes as much of a client's pending output as it will take.
+ *
+ * Params: (ProxyClient* client)
+ * Return: void
+ */
+void write_client(ProxyClient* client) {
+    ssize_t sent = send(client->fd, client->out, client->outLength,
+            MSG_NOSIGNAL);
+    if (sent > 0) {
+        client->outLength -= sent;
+        memmove(client->out, client->out + sent, client->outLength);
+    } else if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+        client->closed = true;
+    }
+}
+
+/**
+ * Gives a client its turn: forwards up to PROXY_QUANTUM of its whole
+ * lines, while it and its link have room for more unanswered.
+ *
+ * Params: (Proxy* proxy, ProxyClient* client)
+ * Return: void
+ */
+void forward_lines(Proxy* proxy, ProxyClient* client) {
+    Client* link = proxy->links[client->link];
+    char* line = client->in;
+    char* newline;
+    for (int sent = 0; !client->closed && sent < PROXY_QUANTUM &&
+            client->count < PROXY_WINDOW &&
+            link->outstanding < link->window &&
+            (newline = memchr(line, '\n',
+            client->inLength - (line - client->in))); sent++) {
+        *newline = '\0';
+        if (!forward_line(proxy, client, line)) {
+            client->closed = true;
+        }
+        line = newline + 1;
+    }
+    client->inLength -= line - client->in;
+    memmove(client->in, line, client->inLength);
+    if (client->inLength == PROXY_BUFFER - 1 &&
+            !memchr(client->in, '\n', client->inLength)) {
+        /* No line the depot would take is this long. */
+        client->closed = true;
+    }
+}
+
+/**
+ * Forwards one line from a client. Its first must be its IM, which the
+ * proxy keeps to itself. A leading Req:id: is taken off, to be put
+ * back on the answer, and Defer and Execute keys are renumbered. A
+ * command which is empty, or too long for the depot once the link has
+ * put its own Req on it, is not forwarded, as it could only arrive cut
+ * short; the client is answered with an Error straight away.
+ *
+ * Params: (Proxy* proxy, ProxyClient* client, char* line) without its
+ * newline.
+ * Return: (bool) false if the client is to be dropped.
+ */
+bool forward_line(Proxy* proxy, ProxyClient* client, char* line) {
+    Client* link = proxy->links[client->link];
+    char command[PROXY_BUFFER];
+    uint64_t request = 0;
+    int skip = 0, length;
+    long key;
+    if (!client->imRecieved) {
+        client->imRecieved = strncmp(line, "IM:", 3) == 0;
+        return client->imRecieved;
+    }
+    if (sscanf(line, "Req:%" SCNu64 "%n", &request, &skip) == 1 &&
+            request && (line[skip] == ':' || !line[skip])) {
+        line += skip + (line[skip] == ':');
+    } else {
+        request = 0;
+    }
+    skip = 0;
+    if (sscanf(line, "Defer:%ld:%n", &key, &skip) == 1 && skip) {
+        length = snprintf(command, sizeof(command), "Defer:%ld:%s",
+                global_key(proxy, client, key), line + skip);
+    } else if (sscanf(line, "Execute:%ld%n", &key, &skip) == 1 &&
+            !line[skip]) {
+        length = snprintf(command, sizeof(command), "Execute:%ld",
+                global_key(proxy, client, key));
+    } else {
+        length = snprintf(command, sizeof(command), "%s", line);
+    }
+    /* The depot reads at most PROXY_LINE - 2 characters and a newline. */
+    if (!length || length + snprintf(0, 0, "Req:%" PRIu64 ":",
+            link->nextId) > PROXY_LINE - 2) {
+        client_answer(client, request, false, false, 0);
+        proxy->refused++;
+        return true;
+    }
+    Route* route = proxy->spareRoutes;
+    if (route) {
+        proxy->spareRoutes = route->next;
+    } else {
+        route = malloc(sizeof(Route));
+    }
+    *route = (Route) {0, proxy, client, request};
+    if (!client_send(link, command, answered, route)) {
+        fprintf(stderr, "Depot went away\n");
+        exit(2);
+    }
+    client->count++;
+    proxy->forwarded++;
+    return true;
+}
+
+/**
+ * Finds the key a client's Defer key goes to the depot as, giving it
+ * a new one the first time. Keys which are not positive are passed on
+ * as they are, for the depot to refuse.
+ *
+ * Params: (Proxy* proxy, ProxyClient* client, long key)
+ * Return: (long) the depot's key.
+ */
+long global_key(Proxy* proxy, ProxyClient* client, long key) {
+    if (key <= 0) {
+        return key;
+    }
+    for (int i = 0; i < client->numKeys; i++) {
+        if (client->keys[i].key == key) {
+            return client->keys[i].global;
+        }
+    }
+    if (client->numKeys == client->keyCapacity) {
+        client->keyCapacity = client->keyCapacity * 2 + 4;
+        client->keys = realloc(client->keys,
+                sizeof(DeferKey) * client->keyCapacity);
+    }
+    DeferKey* entry = &client->keys[client->numKeys++];
+    entry->key = key;
+    entry->global = proxy->nextKey++;
+    return entry->global;
+}
+
+/**
+ * Link completion: the depot has answered a command, or it has timed
+ * out, which is answered in turn if the client sent it with an id.
+ *
+ * Params: (void* context, uint64_t id, bool ok, bool hasAmount,
+ * int64_t amount) context is the command's Route*.
+ * Return: void
+ */
+void answered(void* context, uint64_t id, bool ok, bool hasAmount,
+        int64_t amount) {
+    Route* route = (Route*) context;
+    Proxy* proxy = route->proxy;
+    route->client->count--;
+    client_answer(route->client, route->request, ok, hasAmount, amount);
+    route->next = proxy->spareRoutes;
+    proxy->spareRoutes = route;
+}
+
+/**
+ * Answers a client's command, if it sent it with an id and is still
+ * there to hear.
+ *
+ * Params: (ProxyClient* client, uint64_t request, bool ok,
+ * bool hasAmount, int64_t amount) request is the client's id, or 0.
+ * Return: void
+ */
+void client_answer(ProxyClient* client, uint64_t request, bool ok,
+        bool hasAmount, int64_t amount) {
+    char line[PROXY_LINE];
+    if (!request || client->closed) {
+        return;
+    }
+    if (!ok) {
+        snprintf(line, sizeof(line), "Res:%" PRIu64 ":Error\n", request);
+    } else if (hasAmount) {
+        snprintf(line, sizeof(line), "Res:%" PRIu64 ":OK:%" PRId64 "\n",
+                request, amount);
+    } else {
+        snprintf(line, sizeof(line), "Res:%" PRIu64 ":OK\n", request);
+    }
+    client_write(client, line);
+}
+
+/**
+ * Adds a line to a client's pending output.
+ *
+ * Params: (ProxyClient* client, const char* line)
+ * Return: void
+ */
+void client_write(ProxyClient* client, const char* line) {
+    int length = strlen(line);
+    if (client->outLength + length > client->outCapacity) {
+        client->outCapacity = (client->outLength + length) * 2;
+        client->out = realloc(client->out, client->outCapacity);
+    }
+    memcpy(client->out + client->outLength, line, length);
+    client->outLength += length;
+}
+
+/**
+ * Drops clients which have finished, once all they sent has been
+ * forwarded and answered, and frees dropped ones once nothing they
+ * sent is still awaiting the depot.
+ *
+ * Params: (Proxy* proxy)
+ * Return: void
+ */
+void reap_clients(Proxy* proxy) {
+    for (int i = 0; i < proxy->numClients; i++) {
+        ProxyClient* client = proxy->clients[i];
+        if (client->eof && !client->count && !client->outLength &&
+                !memchr(client->in, '\n', client->inLength)) {
+            client->closed = true;
+        }
+        if (client->closed && client->fd >= 0) {
+            close(client->fd);
+            client->fd = -1;
+            client->inLength = 0;
+            client->outLength = 0;
+        }
+        if (client->closed && !client->count) {
+            proxy->linkClients[client->link]--;
+            free(client->out);
+            free(client->keys);
+            free(client);
+            proxy->clients[i--] = proxy->clients[--proxy->numClients];
+        }
+    }
+}
+
+/**
+ * Prints the proxy's statistics.
+ *
+ * Params: (Proxy* proxy)
+ * Return: void
+ */
+void report(Proxy* proxy) {
+    fprintf(stderr, "Proxy: clients %d accepted %" PRIu64 " forwarded %"
+            PRIu64 " refused %" PRIu64 "\n", proxy->numClients,
+            proxy->accepted, proxy->forwarded, proxy->refused);
+    fprintf(stderr, "Links: link clients unanswered answered expired\n");
+    for (int i = 0; i < proxy->numLinks; i++) {
+        fprintf(stderr, "%d %d %d %" PRIu64 " %" PRIu64 "\n", i,
+                proxy->linkClients[i], proxy->links[i]->outstanding,
+                proxy->links[i]->answered, proxy->links[i]->expired);
+    }
+    fflush(stderr);
+}
+
+/**
+ * SIGHUP handler, asking the loop for statistics.
+ *
+ * Params: (int signal) unused.
+ * Return: void
+ */
+void on_hup(int signal) {
+    statsWanted = 1;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "depot.h"
+#include "capture.h"
+
+/**
+ * Replays a capture written by 2310depot (see DEPOT_CAPTURE) into a
+ * depot. Each captured connection gets its own connection on replay,
+ * either a loopback socket to a running depot (-p port) or a session on
+ * a depot engine created in this process (the default), stocked with
+ * the given goods. Lines are sent at their original pacing unless -f
+ * is given.
+ *
+ * Usage: depotreplay [-f] [-p port] [-n name] capture {goods qty}
+ */
+
+/**
+ * The replay's connections, indexed by captured connection ID. Socket
+ * replays use sockets, in-process replays use sessions.
+ */
+typedef struct {
+    int port;
+    Depot* depot;
+    int numConns;
+    int* sockets;
+    Session** sessions;
+} Replay;
+
+void discard_send(void* handle, const char* message);
+void replay_grow(Replay* replay, unsigned connId);
+void replay_send(Replay* replay, CaptureRecord* record);
+void drain(int socket);
+void replay_finish(Replay* replay);
+
+int main(int argc, char** argv) {
+    bool fast = false;
+    const char* name = "replay";
+    int opt;
+    Replay replay;
+    memset(&replay, 0, sizeof(Replay));
+    while ((opt = getopt(argc, argv, "fp:n:")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = true;
+                break;
+            case 'p':
+                replay.port = atoi(optarg);
+                break;
+            case 'n':
+                name = optarg;
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind >= argc || (argc - optind) % 2 == 0) {
+        fprintf(stderr, "Usage: depotreplay [-f] [-p port] [-n name] "
+                "capture {goods qty}\n");
+        exit(1);
+    }
+    FILE* file = capture_reader_open(argv[optind]);
+    if (!file) {
+        fprintf(stderr, "Invalid capture file\n");
+        exit(2);
+    }
+    if (!replay.port) {
+        replay.depot = depot_create(name);
+        replay.depot->portNo = 1;
+        for (int i = optind + 1; i < argc; i += 2) {
+            depot_add_resource(replay.depot, argv[i],
+                    verify_amount(argv[i + 1]));
+        }
+    }
+
+    CaptureRecord record;
+    memset(&record, 0, sizeof(CaptureRecord));
+    long count = 0;
+    uint64_t maxLate = 0, start = capture_now();
+    while (capture_read(file, &record)) {
+        if (!fast) {
+            uint64_t due = start + record.time, now = capture_now();
+            if (now < due) {
+                struct timespec ts = {due / 1000000000, due % 1000000000};
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+            } else if (now - due > maxLate) {
+                maxLate = now - due;
+            }
+        }
+        replay_send(&replay, &record);
+        count++;
+    }
+    double elapsed = (capture_now() - start) / 1e9;
+    fclose(file);
+    fprintf(stderr, "%ld lines over %d connections in %.3f s (%.0f lines/s)",
+            count, replay.numConns, elapsed, count / elapsed);
+    if (!fast) {
+        fprintf(stderr, ", max %.3f ms behind schedule", maxLate / 1e6);
+    }
+    fprintf(stderr, "\n");
+    if (replay.depot) {
+        depot_report(replay.depot, stdout);
+    }
+    replay_finish(&replay);
+    return 0;
+}
+
+/**
+ * Link send function for in-process sessions; the depot's replies and
+ * forwarded Delivers are thrown away.
+ *
+ * Params: (void* handle, const char* message) both unused.
+ * Return: void
+ */
+void discard_send(void* handle, const char* message) {
+}
+
+/**
+ * Makes room for connection connId, opening it (and any skipped IDs
+ * before it) on first use.
+ *
+ * Params: (Replay* replay, unsigned connId)
+ * Return: void
+ */
+void replay_grow(Replay* replay, unsigned connId) {
+    int needed = (int) connId + 1;
+    if (needed <= replay->numConns) {
+        return;
+    }
+    replay->sockets = realloc(replay->sockets, sizeof(int) * needed);
+    replay->sessions = realloc(replay->sessions, sizeof(Session*) * needed);
+    for (int i = replay->numConns; i < needed; i++) {
+        replay->sockets[i] = -1;
+        replay->sessions[i] = 0;
+    }
+    replay->numConns = needed;
+}
+
+/**
+ * Sends a captured line down the connection it arrived on.
+ *
+ * Params: (Replay* replay, CaptureRecord* record)
+ * Return: void
+ */
+void replay_send(Replay* replay, CaptureRecord* record) {
+    replay_grow(replay, record->connId);
+    if (replay->depot) {
+        Session** session = &replay->sessions[record->connId];
+        if (!*session) {
+            Link sink = {discard_send, 0};
+            *session = malloc(sizeof(Session));
+            session_init(*session, replay->depot, sink);
+            session_open(*session);
+        }
+        session_input(*session, record->line);
+        return;
+    }
+    int* sock = &replay->sockets[record->connId];
+    if (*sock < 0) {
+        struct sockaddr_in addressInfo;
+        memset(&addressInfo, 0, sizeof(addressInfo));
+        addressInfo.sin_family = AF_INET;
+        addressInfo.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addressInfo.sin_port = htons(replay->port);
+        *sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(*sock, (struct sockaddr*) &addressInfo,
+                sizeof(addressInfo)) < 0) {
+            perror("connect");
+            exit(3);
+        }
+    }
+    send(*sock, record->line, record->length, MSG_NOSIGNAL);
+    drain(*sock);
+}
+
+/**
+ * Reads and discards whatever the depot has sent on a socket, without
+ * blocking, so its replies never back up.
+ *
+ * Params: (int socket)
+ * Return: void
+ */
+void drain(int socket) {
+    char buffer[4096];
+    while (recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+    }
+}
+
+/**
+ * Closes every replay connection and frees the in-process depot.
+ *
+ * Params: (Replay* replay)
+ * Return: void
+ */
+void replay_finish(Replay* replay) {
+    for (int i = 0; i < replay->numConns; i++) {
+        if (replay->sockets[i] >= 0) {
+            drain(replay->sockets[i]);
+            close(replay->sockets[i]);
+        }
+        if (replay->sessions[i]) {
+            session_destroy(replay->sessions[i]);
+            free(replay->sessions[i]);
+        }
+    }
+    free(replay->sockets);
+    free(replay->sessions);
+    if (replay->depot) {
+        depot_destroy(replay->depot);
+    }
+}
@@ -0,0 +1,656 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <malloc.h>
+#include "depot.h"
+#include "rebalance.h"
+#include "zip.h"
+
+/**
+ * Mesh simulator. Runs many depot engines in one process, joined by a
+ * virtual transport which delivers lines after a configurable latency
+ * and at a configurable per-link bandwidth, in virtual time. Builds the
+ * topology with Connect (and so the IM exchange) on every depot, then
+ * runs a Transfer workload over the mesh and reports convergence time,
+ * message counts and memory per depot. With -r, then lands a surge of
+ * stock on one depot, gives every depot a target and runs up to that
+ * many rebalancing rounds, each followed by the mesh going quiet,
+ * reporting how many it took for the mesh to stop moving stock and how
+ * level it was left. With -z, messages of ZIP_THRESHOLD bytes or more
+ * (batches of Delivers) are deflated at that zlib level, as
+ * 2310depot's DEPOT_COMPRESS does, and take the link's bandwidth for
+ * their compressed size; the CPU time spent compressing and inflating
+ * them is reported against the bytes saved.
+ *
+ * Usage: depotsim [-n depots] [-t ring|random|full] [-k degree]
+ *         [-l latency_us] [-b bytes_per_s] [-x transfers] [-w window]
+ *         [-r rounds] [-z level]
+ */
+
+/* Stock of "good" each depot starts with. */
+#define INITIAL_STOCK 1000000
+
+struct Sim;
+
+/**
+ * One end of a virtual connection. Holds the engine session for that
+ * end; lines sent through it arrive at the peer's session.
+ */
+typedef struct Endpoint {
+    struct Sim* sim;
+    struct Endpoint* peer;
+    Session session;
+    uint64_t busyUntil;
+    bool closed;
+    Zip* deflater;
+    Zip* inflater;
+} Endpoint;
+
+typedef enum {
+    EVENT_LINE,
+    EVENT_CONNECT
+} EventKind;
+
+/**
+ * Something due to happen at a point in virtual time: a line arriving
+ * at an endpoint, or a connection from one depot to a port completing.
+ */
+typedef struct {
+    uint64_t time;
+    uint64_t seq;
+    EventKind kind;
+    Endpoint* to;
+    Depot* from;
+    int portNo;
+    char* line;
+} Event;
+
+/**
+ * The simulation: every depot (depot i listens on virtual port i + 1),
+ * the pending events as a binary heap ordered by time, and counters.
+ */
+typedef struct Sim {
+    int numDepots;
+    Depot** depots;
+    Session* control;
+    uint64_t now;
+    uint64_t seq;
+    uint64_t latency;
+    uint64_t bandwidth;
+    int numEvents;
+    int eventCapacity;
+    Event* events;
+    int numEndpoints;
+    int endpointCapacity;
+    Endpoint** endpoints;
+    long imMessages;
+    long deliverMessages;
+    long levelMessages;
+    long otherMessages;
+    long bytes;
+    int zipLevel;
+    double zipSeconds;
+} Sim;
+
+void discard_send(void* handle, const char* message);
+void virtual_send(void* handle, const char* message);
+void virtual_connect(Depot* depot, int portNo);
+void push_event(Sim* sim, Event event);
+Event pop_event(Sim* sim);
+bool event_before(Event* a, Event* b);
+Endpoint* new_endpoint(Sim* sim);
+void run(Sim* sim);
+void connect_topology(Sim* sim, const char* topology, int degree);
+void control(Sim* sim, int depot, const char* line);
+long expected_links(Sim* sim, const char* topology, int degree);
+long count_links(Sim* sim);
+long total_stock(Sim* sim);
+void rebalance(Sim* sim, int rounds);
+const char* next_line(const char* line);
+void zip_link(Endpoint* from, Endpoint* to, int level);
+int zip_send(Endpoint* endpoint, const char* message, int length);
+void zip_report(Sim* sim);
+double wall_seconds();
+size_t heap_in_use();
+
+int main(int argc, char** argv) {
+    int numDepots = 1000, degree = 4, transfers = 100000, window = 0;
+    int rounds = 0, opt;
+    const char* topology = "random";
+    Sim sim;
+    memset(&sim, 0, sizeof(Sim));
+    sim.latency = 100000;
+    while ((opt = getopt(argc, argv, "n:t:k:l:b:x:w:r:z:")) != -1) {
+        switch (opt) {
+            case 'n':
+                numDepots = atoi(optarg);
+                break;
+            case 't':
+                topology = optarg;
+                break;
+            case 'k':
+                degree = atoi(optarg);
+                break;
+            case 'l':
+                sim.latency = strtoull(optarg, 0, 10) * 1000;
+                break;
+            case 'b':
+                sim.bandwidth = strtoull(optarg, 0, 10);
+                break;
+            case 'x':
+                transfers = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'z':
+                sim.zipLevel = atoi(optarg);
+                break;
+            default:
+                numDepots = 0;
+                break;
+        }
+    }
+    if (numDepots < 2 || degree < 1 || transfers < 0 || window < 0 ||
+            rounds < 0 || sim.zipLevel < 0 || sim.zipLevel > 9 ||
+            (strcmp(topology, "ring") && strcmp(topology, "random") &&
+            strcmp(topology, "full"))) {
+        fprintf(stderr, "Usage: depotsim [-n depots] [-t ring|random|full] "
+                "[-k degree] [-l latency_us] [-b bytes_per_s] "
+                "[-x transfers] [-w window] [-r rounds] [-z level]\n");
+        exit(1);
+    }
+
+    size_t heapBefore = heap_in_use();
+    Link sink = {discard_send, 0};
+    sim.numDepots = numDepots;
+    sim.depots = malloc(sizeof(Depot*) * numDepots);
+    sim.control = malloc(sizeof(Session) * numDepots);
+    for (int i = 0; i < numDepots; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "d%d", i);
+        sim.depots[i] = depot_create(name);
+        sim.depots[i]->portNo = i + 1;
+        sim.depots[i]->connect = virtual_connect;
+        sim.depots[i]->host = &sim;
+        if (window) {
+            sim.depots[i]->window = window;
+        }
+        depot_add_resource(sim.depots[i], "good", INITIAL_STOCK);
+        /* The operator's connection, taken as having already IM'd. */
+        session_init(&sim.control[i], sim.depots[i], sink);
+        sim.control[i].imRecieved = true;
+    }
+
+    double wall = wall_seconds();
+    connect_topology(&sim, topology, degree);
+    run(&sim);
+    long links = count_links(&sim);
+    printf("depots %d, topology %s, latency %.3f ms, bandwidth %s\n",
+            numDepots, topology, sim.latency / 1e6,
+            sim.bandwidth ? "limited" : "unlimited");
+    printf("setup: %ld/%ld links, converged at %.3f ms virtual, "
+            "%ld IM messages, %.3f s wall\n", links,
+            expected_links(&sim, topology, degree), sim.now / 1e6,
+            sim.imMessages, wall_seconds() - wall);
+    size_t heapAfter = heap_in_use();
+
+    uint64_t start = sim.now;
+    long stock = total_stock(&sim);
+    wall = wall_seconds();
+    srand(2310);
+    for (int i = 0; i < transfers; i++) {
+        int from = rand() % numDepots;
+        Depot* depot = sim.depots[from];
+        if (depot->numNeighbours == 0) {
+            continue;
+        }
+        char line[MAX_LINE];
+        snprintf(line, sizeof(line), "Transfer:%d:good:%s\n",
+                rand() % 100 + 1,
+                depot->neighbours[rand() % depot->numNeighbours]->name);
+        control(&sim, from, line);
+    }
+    run(&sim);
+    double elapsed = wall_seconds() - wall;
+    printf("workload: %d transfers, %ld Deliver messages, done at %.3f ms "
+            "virtual, %.3f s wall (%.0f transfers/s), stock %s\n",
+            transfers, sim.deliverMessages, (sim.now - start) / 1e6, elapsed,
+            transfers / elapsed,
+            total_stock(&sim) == stock ? "conserved" : "NOT conserved");
+    printf("traffic: %ld messages, %ld bytes\n", sim.imMessages +
+            sim.deliverMessages + sim.otherMessages, sim.bytes);
+    if (sim.zipLevel) {
+        zip_report(&sim);
+    }
+    printf("memory: %.0f bytes per depot (%d connections)\n",
+            (double) (heapAfter - heapBefore) / numDepots,
+            sim.numEndpoints / 2);
+    if (rounds) {
+        rebalance(&sim, rounds);
+    }
+    return 0;
+}
+
+/**
+ * Link send function for the operator sessions, whose replies are
+ * thrown away.
+ *
+ * Params: (void* handle, const char* message) both unused.
+ * Return: void
+ */
+void discard_send(void* handle, const char* message) {
+}
+
+/**
+ * Link send function for virtual connections. Schedules the line to
+ * arrive at the peer after the link latency, queued behind anything
+ * still being transmitted on the link.
+ *
+ * Params: (void* handle, const char* message) handle is the sending
+ * Endpoint.
+ * Return: void
+ */
+void virtual_send(void* handle, const char* message) {
+    Endpoint* endpoint = (Endpoint*) handle;
+    Sim* sim = endpoint->sim;
+    size_t length = strlen(message);
+    if (endpoint->deflater && length >= ZIP_THRESHOLD) {
+        length = zip_send(endpoint, message, length);
+    }
+    uint64_t start = sim->now > endpoint->busyUntil ?
+            sim->now : endpoint->busyUntil;
+    if (sim->bandwidth) {
+        start += length * 1000000000 / sim->bandwidth;
+    }
+    endpoint->busyUntil = start;
+    for (const char* line = message; *line; line = next_line(line)) {
+        if (strncmp(line, "IM:", 3) == 0) {
+            sim->imMessages++;
+        } else if (strncmp(line, "Deliver:", 8) == 0) {
+            sim->deliverMessages++;
+        } else if (strncmp(line, "Level:", 6) == 0) {
+            sim->levelMessages++;
+        } else {
+            sim->otherMessages++;
+        }
+    }
+    sim->bytes += length;
+    Event event = {start + sim->latency, 0, EVENT_LINE, endpoint->peer,
+            0, 0, strdup(message)};
+    push_event(sim, event);
+}
+
+/**
+ * Connect hook for simulated depots. The connection comes up one
+ * latency later.
+ *
+ * Params: (Depot* depot, int portNo)
+ * Return: void
+ */
+void virtual_connect(Depot* depot, int portNo) {
+    Sim* sim = (Sim*) depot->host;
+    Event event = {sim->now + sim->latency, 0, EVENT_CONNECT, 0, depot,
+            portNo, 0};
+    push_event(sim, event);
+}
+
+/**
+ * Adds an event to the queue. Events due at the same time run in the
+ * order they were added.
+ *
+ * Params: (Sim* sim, Event event)
+ * Return: void
+ */
+void push_event(Sim* sim, Event event) {
+    if (sim->numEvents == sim->eventCapacity) {
+        sim->eventCapacity = sim->eventCapacity ? sim->eventCapacity * 2 : 1024;
+        sim->events = realloc(sim->events, sizeof(Event) * sim->eventCapacity);
+    }
+    event.seq = sim->seq++;
+    int i = sim->numEvents++;
+    while (i > 0 && event_before(&event, &sim->events[(i - 1) / 2])) {
+        sim->events[i] = sim->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim->events[i] = event;
+}
+
+/**
+ * Removes the earliest event from the queue, which must not be empty.
+ *
+ * Params: (Sim* sim)
+ * Return: (Event) the earliest event.
+ */
+Event pop_event(Sim* sim) {
+    Event top = sim->events[0];
+    Event last = sim->events[--sim->numEvents];
+    int i = 0;
+    while (2 * i + 1 < sim->numEvents) {
+        int child = 2 * i + 1;
+        if (child + 1 < sim->numEvents &&
+                event_before(&sim->events[child + 1], &sim->events[child])) {
+            child++;
+        }
+        if (!event_before(&sim->events[child], &last)) {
+            break;
+        }
+        sim->events[i] = sim->events[child];
+        i = child;
+    }
+    sim->events[i] = last;
+    return top;
+}
+
+bool event_before(Event* a, Event* b) {
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+/**
+ * Allocates an endpoint and remembers it for the memory count.
+ *
+ * Params: (Sim* sim)
+ * Return: (Endpoint*) the zeroed endpoint.
+ */
+Endpoint* new_endpoint(Sim* sim) {
+    Endpoint* endpoint = calloc(1, sizeof(Endpoint));
+    endpoint->sim = sim;
+    if (sim->numEndpoints == sim->endpointCapacity) {
+        sim->endpointCapacity = sim->endpointCapacity ?
+                sim->endpointCapacity * 2 : 1024;
+        sim->endpoints = realloc(sim->endpoints,
+                sizeof(Endpoint*) * sim->endpointCapacity);
+    }
+    sim->endpoints[sim->numEndpoints++] = endpoint;
+    return endpoint;
+}
+
+/**
+ * Runs events until none are left, advancing virtual time. A completed
+ * connection exchanges IMs from both ends, as on a real socket; each
+ * line of a message arriving is handed to the endpoint's session, and
+ * a session which asks to be closed stops recieving.
+ *
+ * Params: (Sim* sim)
+ * Return: void
+ */
+void run(Sim* sim) {
+    while (sim->numEvents) {
+        Event event = pop_event(sim);
+        sim->now = event.time;
+        if (event.kind == EVENT_CONNECT) {
+            if (event.portNo > sim->numDepots) {
+                continue;
+            }
+            Endpoint* dialer = new_endpoint(sim);
+            Endpoint* listener = new_endpoint(sim);
+            Link toListener = {virtual_send, dialer};
+            Link toDialer = {virtual_send, listener};
+            dialer->peer = listener;
+            listener->peer = dialer;
+            session_init(&dialer->session, event.from, toListener);
+            session_init(&listener->session, sim->depots[event.portNo - 1],
+                    toDialer);
+            dialer->session.dialled = event.portNo;
+            session_open(&listener->session);
+            session_open(&dialer->session);
+            if (sim->zipLevel) {
+                zip_link(dialer, listener, sim->zipLevel);
+                zip_link(listener, dialer, sim->zipLevel);
+            }
+        } else {
+            for (const char* line = event.line; *line && !event.to->closed;
+                    line = next_line(line)) {
+                if (!session_input(&event.to->session, line)) {
+                    event.to->closed = true;
+                }
+            }
+            free(event.line);
+        }
+    }
+}
+
+/**
+ * Issues the Connects which build the topology. ring joins each depot
+ * to the next, random joins each depot to degree others at random and
+ * full joins every pair.
+ *
+ * Params: (Sim* sim, const char* topology, int degree)
+ * Return: void
+ */
+void connect_topology(Sim* sim, const char* topology, int degree) {
+    char line[MAX_LINE];
+    srand(2310);
+    for (int i = 0; i < sim->numDepots; i++) {
+        if (strcmp(topology, "ring") == 0) {
+            snprintf(line, sizeof(line), "Connect:%d\n",
+                    (i + 1) % sim->numDepots + 1);
+            control(sim, i, line);
+        } else if (strcmp(topology, "full") == 0) {
+            for (int j = i + 1; j < sim->numDepots; j++) {
+                snprintf(line, sizeof(line), "Connect:%d\n", j + 1);
+                control(sim, i, line);
+            }
+        } else {
+            for (int j = 0; j < degree; j++) {
+                int to = rand() % sim->numDepots;
+                if (to != i) {
+                    snprintf(line, sizeof(line), "Connect:%d\n", to + 1);
+                    control(sim, i, line);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Sends a line to a depot from the operator's connection.
+ *
+ * Params: (Sim* sim, int depot, const char* line)
+ * Return: void
+ */
+void control(Sim* sim, int depot, const char* line) {
+    validate_input(line, &sim->control[depot]);
+}
+
+/**
+ * Counts the links the topology should end up with. Random topologies
+ * may ask for the same pair twice, so the count there is an upper
+ * bound.
+ *
+ * Params: (Sim* sim, const char* topology, int degree)
+ * Return: (long) expected number of undirected links.
+ */
+long expected_links(Sim* sim, const char* topology, int degree) {
+    long n = sim->numDepots;
+    if (strcmp(topology, "ring") == 0) {
+        return n == 2 ? 1 : n;
+    } else if (strcmp(topology, "full") == 0) {
+        return n * (n - 1) / 2;
+    }
+    return n * degree;
+}
+
+/**
+ * Counts links established, by halving the neighbour entries across
+ * every depot.
+ *
+ * Params: (Sim* sim)
+ * Return: (long) number of undirected links.
+ */
+long count_links(Sim* sim) {
+    long entries = 0;
+    for (int i = 0; i < sim->numDepots; i++) {
+        entries += sim->depots[i]->numNeighbours;
+    }
+    return entries / 2;
+}
+
+/**
+ * Sums the stock of "good" across the mesh.
+ *
+ * Params: (Sim* sim)
+ * Return: (long) total stock.
+ */
+long total_stock(Sim* sim) {
+    long total = 0;
+    for (int i = 0; i < sim->numDepots; i++) {
+        Depot* depot = sim->depots[i];
+        for (int j = 0; j < depot->numResources; j++) {
+            total += depot->resources[j]->amount;
+        }
+    }
+    return total;
+}
+
+/**
+ * Lands a surge of a quarter of the mesh's stock on depot 0, targets
+ * INITIAL_STOCK of "good" on every depot and runs rebalancing rounds
+ * until one issues no Transfer anywhere, or rounds have run.
+ *
+ * Params: (Sim* sim, int rounds)
+ * Return: void
+ */
+void rebalance(Sim* sim, int rounds) {
+    char line[MAX_LINE];
+    snprintf(line, sizeof(line), "Deliver:%ld:good\n",
+            (long) INITIAL_STOCK * sim->numDepots / 4);
+    control(sim, 0, line);
+    snprintf(line, sizeof(line), "Target:good:%d\n", INITIAL_STOCK);
+    for (int i = 0; i < sim->numDepots; i++) {
+        control(sim, i, line);
+    }
+    long stock = total_stock(sim);
+    long deliversBefore = sim->deliverMessages;
+    uint64_t start = sim->now;
+    double wall = wall_seconds();
+    int round = 0;
+    bool moving = true;
+    /* The first round only summarises; nothing is heard of until it. */
+    while ((moving || round < 2) && round < rounds) {
+        moving = false;
+        for (int i = 0; i < sim->numDepots; i++) {
+            moving = rebalance_round(sim->depots[i]->rebalancer) || moving;
+        }
+        run(sim);
+        round++;
+    }
+    long mean = stock / sim->numDepots, widest = 0;
+    for (int i = 0; i < sim->numDepots; i++) {
+        long amount = depot_stock(sim->depots[i], "good") - mean;
+        widest = labs(amount) > widest ? labs(amount) : widest;
+    }
+    printf("rebalance: %s after %d rounds, %.3f ms virtual, %.3f s wall, "
+            "%ld Level and %ld Deliver messages, widest %.2f%% off level, "
+            "stock %s\n", moving ? "still moving" : "quiet", round,
+            (sim->now - start) / 1e6, wall_seconds() - wall,
+            sim->levelMessages, sim->deliverMessages - deliversBefore,
+            100.0 * widest / mean,
+            total_stock(sim) == stock ? "conserved" : "NOT conserved");
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (double) seconds since an arbitrary point.
+ */
+double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Reports how much of the heap is currently allocated.
+ *
+ * Params: void
+ * Return: (size_t) bytes in use.
+ */
+size_t heap_in_use() {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/**
+ * Finds the line after this one in a message.
+ *
+ * Params: (const char* line)
+ * Return: (const char*) the next line, or the message's end.
+ */
+const char* next_line(const char* line) {
+    const char* newline = strchr(line, '\n');
+    return newline ? newline + 1 : line + strlen(line);
+}
+
+/**
+ * Compresses one direction of a virtual connection, as though the IMs
+ * had been followed by compression offers, the sender's naming its
+ * goods.
+ *
+ * Params: (Endpoint* from, Endpoint* to, int level)
+ * Return: void
+ */
+void zip_link(Endpoint* from, Endpoint* to, int level) {
+    char goods[MAX_LINE];
+    depot_goods(from->session.depot, goods, sizeof(goods));
+    from->deflater = zip_deflater(level, goods);
+    to->inflater = zip_inflater(goods);
+}
+
+/**
+ * Compresses a message and inflates it again at the peer, timing both
+ * and checking the text survives.
+ *
+ * Params: (Endpoint* endpoint, const char* message, int length)
+ * Return: (int) the bytes the message takes on the link, header and
+ * all.
+ */
+int zip_send(Endpoint* endpoint, const char* message, int length) {
+    char* packed;
+    char* text;
+    double start = wall_seconds();
+    int size = zip_frame(endpoint->deflater, message, length, &packed);
+    int unpacked = zip_unframe(endpoint->peer->inflater, packed, size,
+            &text);
+    endpoint->sim->zipSeconds += wall_seconds() - start;
+    if (unpacked != length || memcmp(text, message, length)) {
+        fprintf(stderr, "Compressed frame did not survive\n");
+        exit(3);
+    }
+    free(packed);
+    free(text);
+    return size + snprintf(0, 0, "Compressed:%d\n", size);
+}
+
+/**
+ * Prints how much compression saved and what it cost, summed over
+ * every link.
+ *
+ * Params: (Sim* sim)
+ * Return: void
+ */
+void zip_report(Sim* sim) {
+    uint64_t frames = 0, text = 0, packed = 0;
+    for (int i = 0; i < sim->numEndpoints; i++) {
+        Zip* zip = sim->endpoints[i]->deflater;
+        if (zip) {
+            frames += zip->frames;
+            text += zip->text;
+            packed += zip->packed;
+        }
+    }
+    printf("compression: level %d, %" PRIu64 " frames, %" PRIu64 " -> %"
+            PRIu64 " bytes (%.1f%%), %.3f s CPU (%.0f ns per byte saved)\n",
+            sim->zipLevel, frames, text, packed,
+            text ? 100.0 * packed / text : 0.0, sim->zipSeconds,
+            text > packed ? sim->zipSeconds * 1e9 / (text - packed) : 0.0);
+}
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "depot.h"
+#include "ebr.h"
+
+/**
+ * Stress test for the depot's shared tables and their reclamation.
+ * Reader threads drive Deliver, Withdraw and Transfer through sessions
+ * of their own while writer threads churn the neighbour registry (a
+ * client IMs, then hangs up), grow the resource table with new goods,
+ * compact it as goods run out and have both tables sorted by
+ * depot_report(). One writer also acks
+ * the stable neighbours, contending for their locks. Links count their
+ * references and are marked dead on the last drop, so a send through
+ * a released link aborts. Finally the stock is checked against what was
+ * delivered, withdrawn and sent on.
+ *
+ * Usage: depotstress [-r readers] [-w writers] [-n ops_per_reader]
+ *         [-g goods]
+ */
+
+/* Neighbour depots registered throughout, acked by the first writer. */
+#define STABLE_PEERS 4
+/* Names churning clients take, so Transfers name them at random. */
+#define CHURN_NAMES 16
+/* Churns between each writer's sorts of the tables. */
+#define SORT_EVERY 64
+/* Goods which readers deliver and at once withdraw, so that they keep
+ * running out for compaction to remove. */
+#define FLEETING_GOODS 256
+
+/**
+ * A link's handle. refs counts the session and any engine holds; once
+ * it reaches 0 the sink is dead and sending through it is a bug. sent
+ * totals the amounts of Delivers sent through it. Sinks are only freed
+ * at the end, so a late send is caught rather than undefined.
+ */
+typedef struct Sink {
+    int refs;
+    bool dead;
+    long sent;
+    struct Sink* next;
+} Sink;
+
+/**
+ * What the threads share: the depot, the stable neighbours' sessions,
+ * how far the run has got and the tallies checked at the end.
+ */
+typedef struct {
+    Depot* depot;
+    Session stable[STABLE_PEERS];
+    int ops;
+    int goods;
+    int readersLeft;
+    long delivered;
+    long withdrawn;
+    long churns;
+    long sorts;
+    long compactions;
+    long acks;
+    Sink* sinks;
+    pthread_mutex_t sinksLock;
+} Stress;
+
+/**
+ * One thread's arguments.
+ */
+typedef struct {
+    Stress* stress;
+    int id;
+} Worker;
+
+Sink* sink_create(Stress* stress);
+void sink_send(void* handle, const char* message);
+void sink_hold(void* handle);
+void sink_drop(void* handle);
+Link sink_link(Sink* sink);
+void* reader(void* input);
+void* writer(void* input);
+void ack_stable(Stress* stress);
+long total_stock(Depot* depot);
+double wall_seconds();
+
+int main(int argc, char** argv) {
+    int readers = 4, writers = 2, opt;
+    Stress stress;
+    memset(&stress, 0, sizeof(Stress));
+    stress.ops = 200000;
+    stress.goods = 4096;
+    while ((opt = getopt(argc, argv, "r:w:n:g:")) != -1) {
+        switch (opt) {
+            case 'r':
+                readers = atoi(optarg);
+                break;
+            case 'w':
+                writers = atoi(optarg);
+                break;
+            case 'n':
+                stress.ops = atoi(optarg);
+                break;
+            case 'g':
+                stress.goods = atoi(optarg);
+                break;
+            default:
+                readers = 0;
+                break;
+        }
+    }
+    if (readers < 1 || writers < 1 || stress.ops < 1 || stress.goods < 1) {
+        fprintf(stderr, "Usage: depotstress [-r readers] [-w writers] "
+                "[-n ops_per_reader] [-g goods]\n");
+        exit(1);
+    }
+    pthread_mutex_init(&stress.sinksLock, 0);
+    stress.depot = depot_create("stress");
+    stress.depot->portNo = 1;
+    for (int i = 0; i < STABLE_PEERS; i++) {
+        char im[MAX_LINE];
+        snprintf(im, sizeof(im), "IM:%d:stable%d:1000000000\n", i + 2, i);
+        session_init(&stress.stable[i], stress.depot,
+                sink_link(sink_create(&stress)));
+        session_open(&stress.stable[i]);
+        session_input(&stress.stable[i], im);
+    }
+    stress.readersLeft = readers;
+    int numThreads = readers + writers;
+    pthread_t* threads = malloc(sizeof(pthread_t) * numThreads);
+    Worker* workers = malloc(sizeof(Worker) * numThreads);
+    double start = wall_seconds();
+    for (int i = 0; i < numThreads; i++) {
+        workers[i].stress = &stress;
+        workers[i].id = i < readers ? i : i - readers;
+        pthread_create(&threads[i], 0, i < readers ? reader : writer,
+                &workers[i]);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        pthread_join(threads[i], 0);
+    }
+    double elapsed = wall_seconds() - start;
+
+    long sent = 0;
+    for (Sink* sink = stress.sinks; sink; sink = sink->next) {
+        sent += sink->sent;
+    }
+    long expected = stress.delivered - stress.withdrawn - sent;
+    long stock = total_stock(stress.depot);
+    printf("%d readers, %d writers: %ld ops in %.3f s (%.0f ops/s)\n",
+            readers, writers, (long) readers * stress.ops, elapsed,
+            readers * stress.ops / elapsed);
+    printf("writers: %ld churns, %ld sorts, %ld compaction steps, %ld "
+            "acks\n", stress.churns, stress.sorts, stress.compactions,
+            stress.acks);
+    printf("tables: %d goods (capacity %d, %" PRIu64 " removed), %d "
+            "neighbours\n", stress.depot->numResources,
+            stress.depot->resourceCapacity,
+            stress.depot->compaction.reclaimed,
+            stress.depot->numNeighbours);
+    ebr_report(stdout);
+    printf("stock %ld, expected %ld: %s\n", stock, expected,
+            stock == expected ? "conserved" : "MISMATCH");
+
+    for (int i = 0; i < STABLE_PEERS; i++) {
+        Sink* sink = (Sink*) stress.stable[i].link.handle;
+        session_destroy(&stress.stable[i]);
+        sink_drop(sink);
+    }
+    depot_destroy(stress.depot);
+    int live = 0;
+    while (stress.sinks) {
+        Sink* sink = stress.sinks;
+        stress.sinks = sink->next;
+        live += !sink->dead;
+        free(sink);
+    }
+    printf("links still held after teardown: %d\n", live);
+    free(threads);
+    free(workers);
+    return stock == expected && !live ? 0 : 1;
+}
+
+/**
+ * Makes a sink holding one reference, for the session it is made for.
+ *
+ * Params: (Stress* stress)
+ * Return: (Sink*) the sink.
+ */
+Sink* sink_create(Stress* stress) {
+    Sink* sink = calloc(1, sizeof(Sink));
+    sink->refs = 1;
+    pthread_mutex_lock(&stress->sinksLock);
+    sink->next = stress->sinks;
+    stress->sinks = sink;
+    pthread_mutex_unlock(&stress->sinksLock);
+    return sink;
+}
+
+/**
+ * Link send function. Aborts if the sink has been released, else adds
+ * the amount of a Deliver to what has been sent through it.
+ *
+ * Params: (void* handle, const char* message) handle is a Sink*.
+ * Return: void
+ */
+void sink_send(void* handle, const char* message) {
+    Sink* sink = (Sink*) handle;
+    int64_t amount;
+    if (__atomic_load_n(&sink->dead, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "send through a released link: %s", message);
+        abort();
+    }
+    if (sscanf(message, "Deliver:%" SCNd64 ":", &amount) == 1) {
+        __atomic_add_fetch(&sink->sent, amount, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Link hold function.
+ *
+ * Params: (void* handle) handle is a Sink*.
+ * Return: void
+ */
+void sink_hold(void* handle) {
+    Sink* sink = (Sink*) handle;
+    if (__atomic_fetch_add(&sink->refs, 1, __ATOMIC_RELAXED) <= 0) {
+        fprintf(stderr, "hold on a released link\n");
+        abort();
+    }
+}
+
+/**
+ * Link drop function, marking the sink dead on the last drop.
+ *
+ * Params: (void* handle) handle is a Sink*.
+ * Return: void
+ */
+void sink_drop(void* handle) {
+    Sink* sink = (Sink*) handle;
+    int refs = __atomic_sub_fetch(&sink->refs, 1, __ATOMIC_ACQ_REL);
+    if (refs < 0) {
+        fprintf(stderr, "link dropped too often\n");
+        abort();
+    }
+    if (refs == 0) {
+        __atomic_store_n(&sink->dead, true, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Gives the link for a sink.
+ *
+ * Params: (Sink* sink)
+ * Return: (Link) the link.
+ */
+Link sink_link(Sink* sink) {
+    Link link = {sink_send, sink, sink_hold, sink_drop};
+    return link;
+}
+
+/**
+ * Reader thread. Runs ops random commands through a session of its
+ * own: Deliver or Withdraw of a random good, a Deliver and Withdraw of
+ * the same amount of a fleeting good, or a Transfer to a stable
+ * neighbour or a churning name, which may or may not be registered.
+ *
+ * Params: (void* input) the Worker.
+ * Return: NULL
+ */
+void* reader(void* input) {
+    Worker* worker = (Worker*) input;
+    Stress* stress = worker->stress;
+    unsigned seed = worker->id * 7919 + 1;
+    long delivered = 0, withdrawn = 0;
+    Sink* sink = sink_create(stress);
+    Session session;
+    session_init(&session, stress->depot, sink_link(sink));
+    for (int i = 0; i < stress->ops; i++) {
+        char line[MAX_LINE];
+        int amount = rand_r(&seed) % 100 + 1;
+        int good = rand_r(&seed) % stress->goods;
+        int kind = rand_r(&seed) % 10;
+        if (kind == 9) {
+            snprintf(line, sizeof(line), "Deliver:%d:f%d\n", amount,
+                    good % FLEETING_GOODS);
+            validate_input(line, &session);
+            snprintf(line, sizeof(line), "Withdraw:%d:f%d\n", amount,
+                    good % FLEETING_GOODS);
+            delivered += amount;
+            withdrawn += amount;
+        } else if (kind < 4) {
+            snprintf(line, sizeof(line), "Deliver:%d:g%d\n", amount, good);
+            delivered += amount;
+        } else if (kind < 6) {
+            snprintf(line, sizeof(line), "Withdraw:%d:g%d\n", amount, good);
+            withdrawn += amount;
+        } else if (kind < 8) {
+            snprintf(line, sizeof(line), "Transfer:%d:g%d:stable%d\n",
+                    amount, good, rand_r(&seed) % STABLE_PEERS);
+        } else if (kind < 9) {
+            snprintf(line, sizeof(line), "Transfer:%d:g%d:churn%d\n",
+                    amount, good, rand_r(&seed) % CHURN_NAMES);
+        }
+        validate_input(line, &session);
+    }
+    session_destroy(&session);
+    sink_drop(sink);
+    __atomic_add_fetch(&stress->delivered, delivered, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress->withdrawn, withdrawn, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stress->readersLeft, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Writer thread. Until the readers are done, registers a client under
+ * a churning name and hangs it up again, then runs a step of
+ * compaction, every SORT_EVERY churns sorting the tables; the first
+ * writer also acks the stable neighbours.
+ *
+ * Params: (void* input) the Worker.
+ * Return: NULL
+ */
+void* writer(void* input) {
+    Worker* worker = (Worker*) input;
+    Stress* stress = worker->stress;
+    unsigned seed = worker->id * 104729 + 3;
+    FILE* devNull = fopen("/dev/null", "w");
+    long churns = 0, sorts = 0, compactions = 0;
+    while (__atomic_load_n(&stress->readersLeft, __ATOMIC_ACQUIRE)) {
+        char im[MAX_LINE];
+        snprintf(im, sizeof(im), "IM:%ld:churn%d\n",
+                100 + worker->id * 1000000L + churns % 1000000,
+                rand_r(&seed) % CHURN_NAMES);
+        Sink* sink = sink_create(stress);
+        Session session;
+        session_init(&session, stress->depot, sink_link(sink));
+        session_input(&session, im);
+        sched_yield();
+        session_destroy(&session);
+        sink_drop(sink);
+        depot_compact(stress->depot);
+        compactions++;
+        if (++churns % SORT_EVERY == 0) {
+            depot_report(stress->depot, devNull);
+            sorts++;
+        }
+        if (worker->id == 0) {
+            ack_stable(stress);
+        }
+    }
+    fclose(devNull);
+    __atomic_add_fetch(&stress->churns, churns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress->sorts, sorts, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stress->compactions, compactions, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * Acks everything sent so far to each stable neighbour, through that
+ * neighbour's own session.
+ *
+ * Params: (Stress* stress)
+ * Return: void
+ */
+void ack_stable(Stress* stress) {
+    Depot* depot = stress->depot;
+    for (int i = 0; i < STABLE_PEERS; i++) {
+        char ack[MAX_LINE];
+        uint64_t sent = 0;
+        pthread_mutex_lock(&depot->lock);
+        for (int j = 0; j < depot->numNeighbours; j++) {
+            Neighbour* neighbour = depot->neighbours[j];
+            if (strcmp(neighbour->name, stress->stable[i].peer) == 0) {
+                pthread_mutex_lock(&neighbour->lock);
+                sent = neighbour->sent;
+                pthread_mutex_unlock(&neighbour->lock);
+            }
+        }
+        pthread_mutex_unlock(&depot->lock);
+        if (sent) {
+            snprintf(ack, sizeof(ack), "Ack:%" PRIu64 ":%" PRIu64 "\n",
+                    depot->epoch, sent);
+            session_input(&stress->stable[i], ack);
+            stress->acks++;
+        }
+    }
+}
+
+/**
+ * Adds up the depot's stock of every good, passing over the dead.
+ *
+ * Params: (Depot* depot)
+ * Return: (long) total stock.
+ */
+long total_stock(Depot* depot) {
+    long total = 0;
+    for (int i = 0; i < depot->numResources; i++) {
+        if (depot->resources[i]->amount != RESOURCE_DEAD) {
+            total += depot->resources[i]->amount;
+        }
+    }
+    return total;
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * Params: void
+ * Return: (double) seconds since an arbitrary point.
+ */
+double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
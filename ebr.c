@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ebr.h"
+
+/**
+ * A thread's announcement of the epoch it is reading in. epoch is the
+ * global epoch seen on entering its outermost critical section, or 0
+ * while it is outside one; depth counts nested sections. Like flight
+ * recorder rings, records outlive their threads and are handed on.
+ */
+typedef struct EbrRecord {
+    uint64_t epoch;
+    int depth;
+    bool inUse;
+    struct EbrRecord* next;
+} EbrRecord;
+
+/**
+ * Something unlinked by a writer, waiting for readers to move on:
+ * reclaim(item) is called once the global epoch reaches epoch + 2.
+ */
+typedef struct {
+    void* item;
+    void (*reclaim)(void* item);
+    uint64_t epoch;
+} Retired;
+
+static uint64_t globalEpoch = 1;
+static EbrRecord* records;
+static Retired* limbo;
+static int numLimbo;
+static int limboCapacity;
+static int sinceCollect;
+static uint64_t reclaimed;
+static pthread_mutex_t ebrLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t recordKey;
+static __thread EbrRecord* record;
+
+static void release_record(void* input);
+static void create_key();
+static EbrRecord* claim_record();
+static bool try_advance();
+static int take_reclaimable(Retired** ready);
+static void reclaim_all(Retired* ready, int count);
+
+/**
+ * Enters a critical section, within which pointers loaded from shared
+ * tables stay valid. Sections nest.
+ *
+ * Params: void
+ * Return: void
+ */
+void ebr_enter(void) {
+    if (!record) {
+        record = claim_record();
+    }
+    if (record->depth++ == 0) {
+        __atomic_store_n(&record->epoch,
+                __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED),
+                __ATOMIC_RELAXED);
+        /* The announcement must be visible before any shared load. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Leaves a critical section entered by ebr_enter().
+ *
+ * Params: void
+ * Return: void
+ */
+void ebr_exit(void) {
+    if (--record->depth == 0) {
+        __atomic_store_n(&record->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Hands over something already unlinked from every shared table, to be
+ * reclaimed once no reader can still hold it. Every EBR_BATCH calls the
+ * epoch is pushed on and whatever has become safe is reclaimed.
+ *
+ * Params: (void* item, void (*reclaim)(void* item)) reclaim is called
+ * with item, from whichever thread reclaims it.
+ * Return: void
+ */
+void ebr_retire(void* item, void (*reclaim)(void* item)) {
+    Retired* ready = 0;
+    int count = 0;
+    pthread_mutex_lock(&ebrLock);
+    if (numLimbo == limboCapacity) {
+        limboCapacity = limboCapacity * 2 + EBR_BATCH;
+        limbo = realloc(limbo, sizeof(Retired) * limboCapacity);
+    }
+    limbo[numLimbo].item = item;
+    limbo[numLimbo].reclaim = reclaim;
+    limbo[numLimbo].epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+    numLimbo++;
+    if (++sinceCollect >= EBR_BATCH) {
+        sinceCollect = 0;
+        try_advance();
+        count = take_reclaimable(&ready);
+    }
+    pthread_mutex_unlock(&ebrLock);
+    reclaim_all(ready, count);
+}
+
+/**
+ * Waits until every critical section in progress has ended, then
+ * reclaims all that was retired before the call. Must not be called
+ * from within a critical section.
+ *
+ * Params: void
+ * Return: void
+ */
+void ebr_synchronize(void) {
+    Retired* ready;
+    uint64_t target = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE) + 2;
+    while (true) {
+        pthread_mutex_lock(&ebrLock);
+        try_advance();
+        bool done = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED) >=
+                target;
+        int count = done ? take_reclaimable(&ready) : 0;
+        pthread_mutex_unlock(&ebrLock);
+        if (done) {
+            reclaim_all(ready, count);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * Prints the global epoch, what is waiting to be reclaimed and what
+ * has been.
+ *
+ * Params: (FILE* out)
+ * Return: void
+ */
+void ebr_report(FILE* out) {
+    pthread_mutex_lock(&ebrLock);
+    fprintf(out, "Reclamation: epoch %" PRIu64 " retired %d reclaimed %"
+            PRIu64 "\n", globalEpoch, numLimbo, reclaimed);
+    pthread_mutex_unlock(&ebrLock);
+}
+
+/**
+ * Thread exit destructor, freeing the thread's record for reuse.
+ *
+ * Params: (void* input) the record.
+ * Return: void
+ */
+static void release_record(void* input) {
+    EbrRecord* released = (EbrRecord*) input;
+    pthread_mutex_lock(&ebrLock);
+    released->depth = 0;
+    __atomic_store_n(&released->epoch, 0, __ATOMIC_RELEASE);
+    released->inUse = false;
+    pthread_mutex_unlock(&ebrLock);
+}
+
+static void create_key() {
+    pthread_key_create(&recordKey, release_record);
+}
+
+/**
+ * Gives the calling thread a record, reusing one left by an exited
+ * thread where possible.
+ *
+ * Params: void
+ * Return: (EbrRecord*) the thread's record.
+ */
+static EbrRecord* claim_record() {
+    EbrRecord* claimed = 0;
+    pthread_once(&keyOnce, create_key);
+    pthread_mutex_lock(&ebrLock);
+    for (EbrRecord* r = records; r && !claimed; r = r->next) {
+        if (!r->inUse) {
+            claimed = r;
+        }
+    }
+    if (!claimed) {
+        claimed = calloc(1, sizeof(EbrRecord));
+        claimed->next = records;
+        records = claimed;
+    }
+    claimed->inUse = true;
+    pthread_mutex_unlock(&ebrLock);
+    pthread_setspecific(recordKey, claimed);
+    return claimed;
+}
+
+/**
+ * Moves the global epoch on by one if every thread inside a critical
+ * section entered it in the current epoch. ebrLock must be held.
+ *
+ * Params: void
+ * Return: (bool) true if the epoch moved on.
+ */
+static bool try_advance() {
+    uint64_t epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+    /* Pairs with the fence in ebr_enter(): either the reader's
+     * announcement is seen here, or it sees what was unlinked. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (EbrRecord* r = records; r; r = r->next) {
+        uint64_t seen = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE);
+        if (seen && seen != epoch) {
+            return false;
+        }
+    }
+    __atomic_store_n(&globalEpoch, epoch + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Takes out of limbo everything retired two or more epochs ago. ebrLock
+ * must be held.
+ *
+ * Params: (Retired** ready) set to the entries taken, to be passed to
+ * reclaim_all().
+ * Return: (int) how many were taken.
+ */
+static int take_reclaimable(Retired** ready) {
+    uint64_t epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+    int count = 0;
+    *ready = malloc(sizeof(Retired) * (numLimbo + 1));
+    for (int i = 0; i < numLimbo; i++) {
+        if (limbo[i].epoch + 2 <= epoch) {
+            (*ready)[count++] = limbo[i];
+        } else {
+            limbo[i - count] = limbo[i];
+        }
+    }
+    numLimbo -= count;
+    reclaimed += count;
+    return count;
+}
+
+/**
+ * Reclaims entries taken by take_reclaimable(), outside ebrLock so a
+ * reclaim function is free to retire more.
+ *
+ * Params: (Retired* ready, int count)
+ * Return: void
+ */
+static void reclaim_all(Retired* ready, int count) {
+    for (int i = 0; i < count; i++) {
+        ready[i].reclaim(ready[i].item);
+    }
+    free(ready);
+}
@@ -0,0 +1,26 @@
+#ifndef EBR_H
+#define EBR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Retirements between attempts to advance the epoch and reclaim. */
+#define EBR_BATCH 64
+
+/*
+ * Epoch-based reclamation, shared by every depot in the process.
+ * Readers bracket lock-free access to shared tables with ebr_enter()
+ * and ebr_exit(). A writer that has unlinked something readers may
+ * still be looking at hands it to ebr_retire() rather than freeing it,
+ * and it is reclaimed once every thread that was inside a critical
+ * section at the time has left, i.e. the global epoch has moved on
+ * twice since.
+ */
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void* item, void (*reclaim)(void* item));
+void ebr_synchronize(void);
+void ebr_report(FILE* out);
+
+#endif
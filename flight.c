@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "flight.h"
+
+/**
+ * A thread's ring of recent events. Only the owning thread writes to
+ * it; flight_dump() reads it while traffic carries on. Like latency
+ * recorders, rings outlive their threads and are handed on.
+ */
+typedef struct FlightRing {
+    FlightEvent events[FLIGHT_EVENTS];
+    uint64_t head;
+    int id;
+    bool inUse;
+    struct FlightRing* next;
+} FlightRing;
+
+static const char* const kindNames[] = {"open", "command", "im", "close"};
+
+static FlightRing* rings;
+static int numRings;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringKey;
+static __thread FlightRing* ring;
+
+static void release_ring(void* input);
+static void create_key();
+static FlightRing* claim_ring();
+static int event_cmp(const void* a, const void* b);
+
+/**
+ * Writes an event into the calling thread's ring, overwriting the
+ * oldest. The slot's seq is made odd for the duration of the copy.
+ *
+ * Params: (FlightKind kind, unsigned connId, uint64_t time,
+ * const char* detail, int length) detail need not be terminated.
+ * Return: void
+ */
+void flight_record(FlightKind kind, unsigned connId, uint64_t time,
+        const char* detail, int length) {
+    if (!ring) {
+        ring = claim_ring();
+    }
+    uint64_t head = ring->head;
+    FlightEvent* event = &ring->events[head % FLIGHT_EVENTS];
+    if (length > FLIGHT_DETAIL) {
+        length = FLIGHT_DETAIL;
+    }
+    __atomic_store_n(&event->seq, 2 * head + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->time = time;
+    event->connId = connId;
+    event->kind = (uint16_t) kind;
+    event->length = (uint16_t) length;
+    memcpy(event->detail, detail, length);
+    __atomic_store_n(&event->seq, 2 * head + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Prints every thread's recent events, oldest first. Slots being
+ * written at the time are skipped rather than waited for.
+ *
+ * Params: (FILE* out)
+ * Return: void
+ */
+void flight_dump(FILE* out) {
+    pthread_mutex_lock(&ringsLock);
+    FlightEvent* copies = malloc(sizeof(FlightEvent) * FLIGHT_EVENTS
+            * (numRings + 1));
+    int count = 0;
+    for (FlightRing* r = rings; r; r = r->next) {
+        for (int i = 0; i < FLIGHT_EVENTS; i++) {
+            FlightEvent* event = &r->events[i];
+            uint64_t seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+            if (seq == 0 || seq % 2) {
+                continue;
+            }
+            memcpy(&copies[count], event, sizeof(FlightEvent));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq) {
+                /* Once copied, seq carries the recording thread. */
+                copies[count].seq = r->id;
+                count++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+    qsort(copies, count, sizeof(FlightEvent), event_cmp);
+    fprintf(out, "Flight recorder: time(ns) thread conn event detail\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%" PRIu64 " %" PRIu64 " %u %s %.*s\n", copies[i].time,
+                copies[i].seq, copies[i].connId, kindNames[copies[i].kind],
+                copies[i].length, copies[i].detail);
+    }
+    fflush(out);
+    free(copies);
+}
+
+/**
+ * Thread exit destructor, freeing the thread's ring for reuse.
+ *
+ * Params: (void* input) the ring.
+ * Return: void
+ */
+static void release_ring(void* input) {
+    FlightRing* released = (FlightRing*) input;
+    pthread_mutex_lock(&ringsLock);
+    released->inUse = false;
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void create_key() {
+    pthread_key_create(&ringKey, release_ring);
+}
+
+/**
+ * Gives the calling thread a ring, reusing one left by an exited
+ * thread where possible.
+ *
+ * Params: void
+ * Return: (FlightRing*) the thread's ring.
+ */
+static FlightRing* claim_ring() {
+    FlightRing* claimed = 0;
+    pthread_once(&keyOnce, create_key);
+    pthread_mutex_lock(&ringsLock);
+    for (FlightRing* r = rings; r && !claimed; r = r->next) {
+        if (!r->inUse) {
+            claimed = r;
+        }
+    }
+    if (!claimed) {
+        claimed = calloc(1, sizeof(FlightRing));
+        claimed->id = numRings++;
+        claimed->next = rings;
+        rings = claimed;
+    }
+    claimed->inUse = true;
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, claimed);
+    return claimed;
+}
+
+/**
+ * Orders events by time.
+ *
+ * Params: (const void* a, const void* b) FlightEvents.
+ * Return: (int) as per strcmp.
+ */
+static int event_cmp(const void* a, const void* b) {
+    const FlightEvent* event1 = (FlightEvent*) a;
+    const FlightEvent* event2 = (FlightEvent*) b;
+    return (event1->time > event2->time) - (event1->time < event2->time);
+}
@@ -0,0 +1,39 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Events kept per thread; older ones are overwritten. */
+#define FLIGHT_EVENTS 256
+/* Bytes of each event's text kept, the rest is cut off. */
+#define FLIGHT_DETAIL 48
+
+/**
+ * The kinds of protocol event the flight recorder keeps.
+ */
+typedef enum {
+    FLIGHT_OPEN,
+    FLIGHT_COMMAND,
+    FLIGHT_IM,
+    FLIGHT_CLOSE
+} FlightKind;
+
+/**
+ * One recorded event. seq is odd while the owning thread is writing
+ * the slot, so a reader can tell a torn copy from a good one.
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t time;
+    uint32_t connId;
+    uint16_t kind;
+    uint16_t length;
+    char detail[FLIGHT_DETAIL];
+} FlightEvent;
+
+void flight_record(FlightKind kind, unsigned connId, uint64_t time,
+        const char* detail, int length);
+void flight_dump(FILE* out);
+
+#endif
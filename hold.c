@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "hold.h"
+
+static Hold** find_link(HoldTable* table, uint64_t id);
+static void grow(HoldTable* table);
+static void unlink_slot(HoldTable* table, Hold* hold);
+
+/**
+ * Allocates an empty table of holds, each to last ttl.
+ *
+ * Params: (uint64_t ttl) in whatever clock the caller passes as now.
+ * Return: (HoldTable*) the new table.
+ */
+HoldTable* hold_create(uint64_t ttl) {
+    HoldTable* table = calloc(1, sizeof(HoldTable));
+    table->ttl = ttl;
+    /* A hold can land up to two ticks past ttl after the current one. */
+    table->tick = ttl / (HOLD_SLOTS - 2) + 1;
+    table->numBuckets = HOLD_BUCKETS;
+    table->buckets = calloc(table->numBuckets, sizeof(Hold*));
+    return table;
+}
+
+/**
+ * Frees a table and every hold still in it.
+ *
+ * Params: (HoldTable* table)
+ * Return: void
+ */
+void hold_destroy(HoldTable* table) {
+    for (int i = 0; i < table->numBuckets; i++) {
+        Hold* hold = table->buckets[i];
+        while (hold) {
+            Hold* chain = hold->chain;
+            free(hold);
+            hold = chain;
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+/**
+ * Adds a hold, expiring ttl after now, unless the id is taken.
+ *
+ * Params: (HoldTable* table, uint64_t id, void* good, int64_t amount,
+ * uint64_t now)
+ * Return: (Hold*) the new hold, or NULL if id already has one.
+ */
+Hold* hold_add(HoldTable* table, uint64_t id, void* good, int64_t amount,
+        uint64_t now) {
+    Hold** link = find_link(table, id);
+    if (*link) {
+        return 0;
+    }
+    Hold* hold = calloc(1, sizeof(Hold));
+    hold->id = id;
+    hold->good = good;
+    hold->amount = amount;
+    hold->expiry = now + table->ttl;
+    *link = hold;
+    /* The tick whose expiry pass first finds the hold due. */
+    uint64_t tick = (hold->expiry + table->tick - 1) / table->tick;
+    if (tick < table->current) {
+        tick = table->current;
+    }
+    hold->slot = tick % HOLD_SLOTS;
+    hold->next = table->slots[hold->slot];
+    if (hold->next) {
+        hold->next->prev = hold;
+    }
+    table->slots[hold->slot] = hold;
+    if (++table->count > table->numBuckets) {
+        grow(table);
+    }
+    return hold;
+}
+
+/**
+ * Removes a hold, as when it is committed or released.
+ *
+ * Params: (HoldTable* table, uint64_t id)
+ * Return: (Hold*) the hold, now the caller's to free, or NULL if there
+ * is none with the id.
+ */
+Hold* hold_take(HoldTable* table, uint64_t id) {
+    Hold** link = find_link(table, id);
+    Hold* hold = *link;
+    if (hold) {
+        *link = hold->chain;
+        unlink_slot(table, hold);
+        table->count--;
+    }
+    return hold;
+}
+
+/**
+ * Removes every hold which has expired by now. Walks the wheel from
+ * the last tick looked at to now's, at most once round; a hold met
+ * which is not yet due was added while expiry lagged behind and is
+ * left for a later turn of the wheel.
+ *
+ * Params: (HoldTable* table, uint64_t now)
+ * Return: (Hold*) the expired holds, linked through next, for the
+ * caller to free.
+ */
+Hold* hold_expire(HoldTable* table, uint64_t now) {
+    Hold* expired = 0;
+    uint64_t target = now / table->tick;
+    if (target >= table->current + HOLD_SLOTS) {
+        table->current = target - HOLD_SLOTS + 1;
+    }
+    for (; table->current <= target; table->current++) {
+        Hold* hold = table->slots[table->current % HOLD_SLOTS];
+        while (hold) {
+            Hold* next = hold->next;
+            if (hold->expiry <= now) {
+                unlink_slot(table, hold);
+                *find_link(table, hold->id) = hold->chain;
+                table->count--;
+                table->expired++;
+                hold->next = expired;
+                expired = hold;
+            }
+            hold = next;
+        }
+    }
+    return expired;
+}
+
+/**
+ * Finds where a hold with the given id is, or would be, linked into
+ * its bucket.
+ *
+ * Params: (HoldTable* table, uint64_t id)
+ * Return: (Hold**) the link, pointing at the hold or at NULL.
+ */
+static Hold** find_link(HoldTable* table, uint64_t id) {
+    uint64_t hash = id * 0x9e3779b97f4a7c15ULL;
+    Hold** link = &table->buckets[(hash >> 32) & (table->numBuckets - 1)];
+    while (*link && (*link)->id != id) {
+        link = &(*link)->chain;
+    }
+    return link;
+}
+
+/**
+ * Doubles the number of buckets, rehashing every hold.
+ *
+ * Params: (HoldTable* table)
+ * Return: void
+ */
+static void grow(HoldTable* table) {
+    Hold** old = table->buckets;
+    int numOld = table->numBuckets;
+    table->numBuckets *= 2;
+    table->buckets = calloc(table->numBuckets, sizeof(Hold*));
+    for (int i = 0; i < numOld; i++) {
+        Hold* hold = old[i];
+        while (hold) {
+            Hold* chain = hold->chain;
+            Hold** link = find_link(table, hold->id);
+            hold->chain = 0;
+            *link = hold;
+            hold = chain;
+        }
+    }
+    free(old);
+}
+
+/**
+ * Takes a hold out of its wheel slot.
+ *
+ * Params: (HoldTable* table, Hold* hold)
+ * Return: void
+ */
+static void unlink_slot(HoldTable* table, Hold* hold) {
+    if (hold->prev) {
+        hold->prev->next = hold->next;
+    } else {
+        table->slots[hold->slot] = hold->next;
+    }
+    if (hold->next) {
+        hold->next->prev = hold->prev;
+    }
+    hold->prev = 0;
+    hold->next = 0;
+}
@@ -0,0 +1,59 @@
+#ifndef HOLD_H
+#define HOLD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Slots in the expiry wheel; a hold's lifetime spans nearly all. */
+#define HOLD_SLOTS 256
+/* Buckets the id hash starts with; doubled as holds outnumber them. */
+#define HOLD_BUCKETS 64
+
+/*
+ * Reservations of stock, looked up by id through a chained hash and
+ * expired through a hashed timing wheel. Every hold lives for the same
+ * ttl, which the wheel's HOLD_SLOTS ticks just cover, so a hold lands
+ * in the slot of the tick it expires in and adding, removing and
+ * expiring one are all constant time. Not thread safe: the depot calls
+ * it with its lock held.
+ */
+
+/**
+ * A reservation of amount of a good, which the owner looks after.
+ * chain links holds in the same hash bucket, prev and next those in
+ * the same wheel slot, slot.
+ */
+typedef struct Hold {
+    uint64_t id;
+    int64_t amount;
+    void* good;
+    uint64_t expiry;
+    int slot;
+    struct Hold* chain;
+    struct Hold* prev;
+    struct Hold* next;
+} Hold;
+
+/**
+ * The holds outstanding. tick is the wheel's granularity and current
+ * the next tick expiry has to look at, both in the caller's clock.
+ */
+typedef struct {
+    uint64_t ttl;
+    uint64_t tick;
+    uint64_t current;
+    int count;
+    int numBuckets;
+    Hold** buckets;
+    Hold* slots[HOLD_SLOTS];
+    uint64_t expired;
+} HoldTable;
+
+HoldTable* hold_create(uint64_t ttl);
+void hold_destroy(HoldTable* table);
+Hold* hold_add(HoldTable* table, uint64_t id, void* good, int64_t amount,
+        uint64_t now);
+Hold* hold_take(HoldTable* table, uint64_t id);
+Hold* hold_expire(HoldTable* table, uint64_t now);
+
+#endif
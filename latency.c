@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "latency.h"
+
+/**
+ * A thread's histograms, one per command and stage. Recorders are
+ * never freed; when a thread exits its recorder is handed on to the
+ * next thread which records, so its counts keep contributing.
+ */
+typedef struct LatencyRecorder {
+    Histogram histograms[COMMAND_INVALID][NUM_STAGES];
+    struct LatencyRecorder* next;
+    bool inUse;
+} LatencyRecorder;
+
+static const char* const stageNames[] = {"parse", "handler", "flush"};
+
+bool latencyEnabled = true;
+
+static LatencyRecorder* recorders;
+static pthread_mutex_t recordersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t recorderKey;
+static __thread LatencyRecorder* recorder;
+
+static void release_recorder(void* input);
+static void create_key();
+static LatencyRecorder* claim_recorder();
+static int bucket_index(uint64_t nanos);
+static uint64_t bucket_value(int index);
+
+/**
+ * Reads the clock used for latency measurements.
+ *
+ * Params: void
+ * Return: (uint64_t) nanoseconds since an arbitrary point.
+ */
+uint64_t latency_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Adds a measurement to the calling thread's histogram for the given
+ * command and stage. Only plain loads and stores are used, as no other
+ * thread writes to it.
+ *
+ * Params: (CommandType type, LatencyStage stage, uint64_t nanos)
+ * Return: void
+ */
+void latency_record(CommandType type, LatencyStage stage, uint64_t nanos) {
+    if (!recorder) {
+        recorder = claim_recorder();
+    }
+    Histogram* histogram = &recorder->histograms[type][stage];
+    uint32_t* bucket = &histogram->counts[bucket_index(nanos)];
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, histogram->sum + nanos,
+            __ATOMIC_RELAXED);
+    if (nanos > histogram->max) {
+        __atomic_store_n(&histogram->max, nanos, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&histogram->count, histogram->count + 1,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * Merges every thread's histogram for a command and stage.
+ *
+ * Params: (CommandType type, LatencyStage stage, Histogram* out)
+ * Return: void
+ */
+void latency_snapshot(CommandType type, LatencyStage stage, Histogram* out) {
+    memset(out, 0, sizeof(Histogram));
+    pthread_mutex_lock(&recordersLock);
+    for (LatencyRecorder* r = recorders; r; r = r->next) {
+        Histogram* histogram = &r->histograms[type][stage];
+        uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+        out->count += __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+        out->max = max > out->max ? max : out->max;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            out->counts[i] += __atomic_load_n(&histogram->counts[i],
+                    __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&recordersLock);
+}
+
+/**
+ * Finds the value at the given percentile of a histogram, to within
+ * its bucket resolution.
+ *
+ * Params: (Histogram* histogram, double percentile) 0 to 100.
+ * Return: (uint64_t) nanoseconds, or 0 for an empty histogram.
+ */
+uint64_t histogram_percentile(Histogram* histogram, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += histogram->counts[i];
+    }
+    uint64_t target = (uint64_t) (total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= target && seen > 0) {
+            uint64_t value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prints the count, mean, percentiles and maximum of every command and
+ * stage seen so far.
+ *
+ * Params: (FILE* out)
+ * Return: void
+ */
+void latency_report(FILE* out) {
+    Histogram* histogram = malloc(sizeof(Histogram));
+    fprintf(out, "Latency (ns): count mean p50 p90 p99 p99.9 max\n");
+    for (int type = 0; type < COMMAND_INVALID; type++) {
+        for (int stage = 0; stage < NUM_STAGES; stage++) {
+            latency_snapshot((CommandType) type, (LatencyStage) stage,
+                    histogram);
+            if (histogram->count == 0) {
+                continue;
+            }
+            fprintf(out, "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+                    " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+                    command_name((CommandType) type), stageNames[stage],
+                    histogram->count, histogram->sum / histogram->count,
+                    histogram_percentile(histogram, 50),
+                    histogram_percentile(histogram, 90),
+                    histogram_percentile(histogram, 99),
+                    histogram_percentile(histogram, 99.9), histogram->max);
+        }
+    }
+    fflush(out);
+    free(histogram);
+}
+
+/**
+ * Thread exit destructor, freeing the thread's recorder for reuse.
+ *
+ * Params: (void* input) the recorder.
+ * Return: void
+ */
+static void release_recorder(void* input) {
+    LatencyRecorder* released = (LatencyRecorder*) input;
+    pthread_mutex_lock(&recordersLock);
+    released->inUse = false;
+    pthread_mutex_unlock(&recordersLock);
+}
+
+static void create_key() {
+    pthread_key_create(&recorderKey, release_recorder);
+}
+
+/**
+ * Gives the calling thread a recorder, reusing one left by an exited
+ * thread where possible.
+ *
+ * Params: void
+ * Return: (LatencyRecorder*) the thread's recorder.
+ */
+static LatencyRecorder* claim_recorder() {
+    LatencyRecorder* claimed = 0;
+    pthread_once(&keyOnce, create_key);
+    pthread_mutex_lock(&recordersLock);
+    for (LatencyRecorder* r = recorders; r && !claimed; r = r->next) {
+        if (!r->inUse) {
+            claimed = r;
+        }
+    }
+    if (!claimed) {
+        claimed = calloc(1, sizeof(LatencyRecorder));
+        claimed->next = recorders;
+        recorders = claimed;
+    }
+    claimed->inUse = true;
+    pthread_mutex_unlock(&recordersLock);
+    pthread_setspecific(recorderKey, claimed);
+    return claimed;
+}
+
+/**
+ * Maps a latency to its histogram bucket.
+ *
+ * Params: (uint64_t nanos)
+ * Return: (int) bucket index.
+ */
+static int bucket_index(uint64_t nanos) {
+    if (nanos >= LATENCY_MAX) {
+        nanos = LATENCY_MAX - 1;
+    }
+    if (nanos < 32) {
+        return (int) nanos;
+    }
+    int shift = 63 - __builtin_clzll(nanos) - 4;
+    return (shift + 1) * 16 + (int) (nanos >> shift) - 16;
+}
+
+/**
+ * Gives the highest latency which maps to a bucket.
+ *
+ * Params: (int index)
+ * Return: (uint64_t) nanoseconds.
+ */
+static uint64_t bucket_value(int index) {
+    if (index < 32) {
+        return index;
+    }
+    int shift = index / 16 - 1;
+    return (((uint64_t) (index % 16 + 16) + 1) << shift) - 1;
+}
@@ -0,0 +1,49 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "depot.h"
+
+/*
+ * HDR style histogram of nanosecond latencies: exact below 32ns, then
+ * 16 linear sub-buckets per power of two (about 6% resolution), up to
+ * LATENCY_MAX (about 68s), beyond which values are clamped.
+ */
+#define LATENCY_MAX ((uint64_t) 1 << 36)
+#define LATENCY_BUCKETS 528
+
+/**
+ * Points on a message's path which latency is recorded up to, each
+ * measured from when the line was recieved. FLUSH is only recorded by
+ * Transfer and Spread, once their Delivers have been written to the
+ * neighbours.
+ */
+typedef enum {
+    STAGE_PARSE,
+    STAGE_HANDLER,
+    STAGE_FLUSH,
+    NUM_STAGES
+} LatencyStage;
+
+/**
+ * A latency histogram. Each is only written by the thread owning it,
+ * and read racily (but atomically) by reporting.
+ */
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t counts[LATENCY_BUCKETS];
+} Histogram;
+
+extern bool latencyEnabled;
+
+uint64_t latency_now();
+void latency_record(CommandType type, LatencyStage stage, uint64_t nanos);
+void latency_snapshot(CommandType type, LatencyStage stage, Histogram* out);
+uint64_t histogram_percentile(Histogram* histogram, double percentile);
+void latency_report(FILE* out);
+
+#endif
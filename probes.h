@@ -0,0 +1,26 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * Static tracepoints on the message path, in the "depot" provider. With
+ * systemtap's <sys/sdt.h> available they compile to a single nop plus
+ * an ELF note, so cost nothing until a tracer (perf, bpftrace, ...)
+ * attaches. Without it, or with DEPOT_NO_PROBES defined, they vanish.
+ * Double underscores in names show up as dashes to tracers.
+ */
+#if defined(__has_include) && !defined(DEPOT_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DEPOT_PROBE1(name, a) DTRACE_PROBE1(depot, name, a)
+#define DEPOT_PROBE2(name, a, b) DTRACE_PROBE2(depot, name, a, b)
+#define DEPOT_PROBE3(name, a, b, c) DTRACE_PROBE3(depot, name, a, b, c)
+#endif
+#endif
+
+#ifndef DEPOT_PROBE1
+#define DEPOT_PROBE1(name, a) do {} while (0)
+#define DEPOT_PROBE2(name, a, b) do {} while (0)
+#define DEPOT_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "rebalance.h"
+#include "latency.h"
+
+static int level_good(Rebalancer* rebalancer, Target* target,
+        int64_t amount, char* moves, int numMoves);
+static void prune_reports(Rebalancer* rebalancer);
+static void record_move(Rebalancer* rebalancer, Command* command);
+
+/**
+ * Allocates a rebalancer for a depot, with no targets.
+ *
+ * Params: (Depot* depot)
+ * Return: (Rebalancer*) the new rebalancer.
+ */
+Rebalancer* rebalance_create(Depot* depot) {
+    Rebalancer* rebalancer = calloc(1, sizeof(Rebalancer));
+    Link none = {0};
+    rebalancer->depot = depot;
+    session_init(&rebalancer->session, depot, none);
+    pthread_mutex_init(&rebalancer->lock, 0);
+    return rebalancer;
+}
+
+/**
+ * Frees a rebalancer.
+ *
+ * Params: (Rebalancer* rebalancer)
+ * Return: void
+ */
+void rebalance_destroy(Rebalancer* rebalancer) {
+    for (int i = 0; i < rebalancer->numTargets; i++) {
+        free(rebalancer->targets[i].good);
+    }
+    for (int i = 0; i < rebalancer->numReports; i++) {
+        free(rebalancer->reports[i].good);
+    }
+    free(rebalancer->targets);
+    free(rebalancer->reports);
+    session_destroy(&rebalancer->session);
+    pthread_mutex_destroy(&rebalancer->lock);
+    free(rebalancer);
+}
+
+/**
+ * Sets the level a good is to be kept at. A target of 0 stops levelling
+ * the good, once neighbours have been told so by the next round.
+ *
+ * Params: (Rebalancer* rebalancer, const char* good, int64_t target)
+ * Return: void
+ */
+void rebalance_target(Rebalancer* rebalancer, const char* good,
+        int64_t target) {
+    pthread_mutex_lock(&rebalancer->lock);
+    Target* found = 0;
+    for (int i = 0; i < rebalancer->numTargets && !found; i++) {
+        if (strcmp(rebalancer->targets[i].good, good) == 0) {
+            found = &rebalancer->targets[i];
+        }
+    }
+    if (!found && target) {
+        if (rebalancer->numTargets == rebalancer->targetCapacity) {
+            rebalancer->targetCapacity = rebalancer->targetCapacity * 2 + 8;
+            rebalancer->targets = realloc(rebalancer->targets,
+                    sizeof(Target) * rebalancer->targetCapacity);
+        }
+        found = &rebalancer->targets[rebalancer->numTargets++];
+        memset(found, 0, sizeof(Target));
+        found->good = strdup(good);
+    }
+    if (found) {
+        found->target = target;
+        /* Never a real amount, so the next round summarises it. */
+        found->lastSent = RESOURCE_DEAD;
+    }
+    pthread_mutex_unlock(&rebalancer->lock);
+}
+
+/**
+ * Takes in a neighbour's summary of a good. A target of 0 means the
+ * neighbour no longer levels the good, and its summary is forgotten.
+ *
+ * Params: (Rebalancer* rebalancer, const char* peer, const char* good,
+ * int64_t amount, int64_t target)
+ * Return: void
+ */
+void rebalance_observe(Rebalancer* rebalancer, const char* peer,
+        const char* good, int64_t amount, int64_t target) {
+    pthread_mutex_lock(&rebalancer->lock);
+    Report* found = 0;
+    for (int i = 0; i < rebalancer->numReports && !found; i++) {
+        Report* report = &rebalancer->reports[i];
+        if (strcmp(report->peer, peer) == 0 &&
+                strcmp(report->good, good) == 0) {
+            found = report;
+        }
+    }
+    if (!found && target) {
+        if (rebalancer->numReports == rebalancer->reportCapacity) {
+            rebalancer->reportCapacity = rebalancer->reportCapacity * 2 + 8;
+            rebalancer->reports = realloc(rebalancer->reports,
+                    sizeof(Report) * rebalancer->reportCapacity);
+        }
+        found = &rebalancer->reports[rebalancer->numReports++];
+        snprintf(found->peer, MAX_PEER, "%s", peer);
+        found->good = strdup(good);
+    }
+    if (found) {
+        found->amount = amount;
+        found->target = target;
+        /* A forgotten summary is as good as stale, and pruned as one. */
+        found->round = target ? rebalancer->round : 0;
+    }
+    pthread_mutex_unlock(&rebalancer->lock);
+}
+
+/**
+ * Runs one round: summarises every good with a target whose free
+ * amount has changed (or is due a refresh) to the neighbour depots,
+ * and issues whatever Transfers are needed to level them, at most
+ * REBALANCE_MOVES. Targets cleared since the last round are summarised
+ * one last time, with a target of 0, and dropped. Only the Transfers
+ * the depot takes are counted; one it refuses, the neighbour gone or
+ * out of credit or the stock spent meanwhile, is planned again next
+ * round.
+ *
+ * Params: (Rebalancer* rebalancer)
+ * Return: (bool) true if any Transfer was made.
+ */
+bool rebalance_round(Rebalancer* rebalancer) {
+    Depot* depot = rebalancer->depot;
+    bool unbalanced = false;
+    int numLines = 0, numMoves = 0, numMade = 0;
+    pthread_mutex_lock(&rebalancer->lock);
+    uint64_t round = ++rebalancer->round;
+    char* lines = malloc(sizeof(char) * MAX_LINE *
+            (rebalancer->numTargets + 1));
+    char* moves = malloc(sizeof(char) * MAX_LINE * REBALANCE_MOVES);
+    prune_reports(rebalancer);
+    for (int i = 0; i < rebalancer->numTargets; i++) {
+        Target* target = &rebalancer->targets[i];
+        int64_t amount = depot_stock(depot, target->good);
+        if (amount != target->lastSent ||
+                round - target->sentRound >= REBALANCE_REFRESH) {
+            snprintf(lines + numLines++ * MAX_LINE, MAX_LINE,
+                    "Level:%s:%" PRId64 ":%" PRId64 "\n", target->good,
+                    amount, target->target);
+            target->lastSent = amount;
+            target->sentRound = round;
+        }
+        if (!target->target) {
+            free(target->good);
+            rebalancer->targets[i--] =
+                    rebalancer->targets[--rebalancer->numTargets];
+            continue;
+        }
+        numMoves = level_good(rebalancer, target, amount, moves, numMoves);
+        unbalanced = unbalanced || target->active;
+    }
+    uint64_t now = latency_now();
+    if (unbalanced && !rebalancer->unbalancedSince) {
+        rebalancer->unbalancedSince = now;
+    } else if (!unbalanced && rebalancer->unbalancedSince) {
+        rebalancer->lastConvergence = now - rebalancer->unbalancedSince;
+        rebalancer->unbalancedSince = 0;
+        rebalancer->convergences++;
+    }
+    pthread_mutex_unlock(&rebalancer->lock);
+    for (int i = 0; i < numMoves; i++) {
+        Command command;
+        if (parse_command(moves + i * MAX_LINE, &command)) {
+            transfer_message(&command, &rebalancer->session);
+        }
+        if (command.applied) {
+            record_move(rebalancer, &command);
+            numMade++;
+        }
+    }
+    for (int i = 0; i < numLines; i++) {
+        int told = depot_tell(depot, 0, lines + i * MAX_LINE);
+        __atomic_add_fetch(&rebalancer->summaries, told, __ATOMIC_RELAXED);
+    }
+    free(lines);
+    free(moves);
+    return numMade > 0;
+}
+
+/**
+ * Prints how much work levelling has taken and how long the depot
+ * last took to come back into level.
+ *
+ * Params: (Rebalancer* rebalancer, FILE* out)
+ * Return: void
+ */
+void rebalance_report(Rebalancer* rebalancer, FILE* out) {
+    pthread_mutex_lock(&rebalancer->lock);
+    fprintf(out, "Rebalancing: targets %d rounds %" PRIu64 " summaries %"
+            PRIu64 " transfers %" PRIu64 " moved %" PRIu64 " converged %"
+            PRIu64 " last %.3f s%s\n", rebalancer->numTargets,
+            rebalancer->round, __atomic_load_n(&rebalancer->summaries,
+            __ATOMIC_RELAXED), rebalancer->transfers, rebalancer->moved,
+            rebalancer->convergences, rebalancer->lastConvergence / 1e9,
+            rebalancer->unbalancedSince ? " (levelling)" : "");
+    pthread_mutex_unlock(&rebalancer->lock);
+}
+
+/**
+ * Works out the Transfers levelling one good this round. The widest
+ * gap to a neighbour sets the good active once past twice the band,
+ * and idle again once within it. While active, each neighbour more
+ * than the band below gets a share of the gap: half of it, split
+ * between this depot and its neighbours with summaries, so that two
+ * depots sending to the same neighbour cannot overshoot. Only free
+ * stock is sent. rebalancer->lock must be held.
+ *
+ * Params: (Rebalancer* rebalancer, Target* target, int64_t amount,
+ * char* moves, int numMoves) amount is the good's free stock; moves
+ * holds REBALANCE_MOVES lines, numMoves of which are already used.
+ * Return: (int) the number of moves now used.
+ */
+static int level_good(Rebalancer* rebalancer, Target* target,
+        int64_t amount, char* moves, int numMoves) {
+    int64_t band = target->target / 100 * REBALANCE_BAND;
+    int64_t excess, theirs, gap, widest = 0;
+    int fresh = 0;
+    if (band < 1) {
+        band = 1;
+    }
+    if (__builtin_sub_overflow(amount, target->target, &excess)) {
+        return numMoves;
+    }
+    for (int i = 0; i < rebalancer->numReports; i++) {
+        Report* report = &rebalancer->reports[i];
+        if (strcmp(report->good, target->good) == 0 &&
+                rebalancer->round - report->round <= REBALANCE_STALE &&
+                !__builtin_sub_overflow(report->amount, report->target,
+                &theirs) && !__builtin_sub_overflow(excess, theirs, &gap)) {
+            fresh++;
+            widest = gap > widest ? gap : widest;
+        }
+    }
+    if (widest > band * 2) {
+        target->active = true;
+    } else if (widest <= band) {
+        target->active = false;
+    }
+    for (int i = 0; target->active && i < rebalancer->numReports &&
+            numMoves < REBALANCE_MOVES && amount > 0; i++) {
+        Report* report = &rebalancer->reports[i];
+        if (strcmp(report->good, target->good) != 0 ||
+                rebalancer->round - report->round > REBALANCE_STALE ||
+                __builtin_sub_overflow(report->amount, report->target,
+                &theirs) || __builtin_sub_overflow(excess, theirs, &gap) ||
+                gap <= band) {
+            continue;
+        }
+        int64_t move = gap / (2 * (fresh + 1));
+        move = move < 1 ? 1 : move > amount ? amount : move;
+        if (__builtin_add_overflow(report->amount, move, &theirs)) {
+            continue;
+        }
+        amount -= move;
+        excess -= move;
+        snprintf(moves + numMoves++ * MAX_LINE, MAX_LINE,
+                "Transfer:%" PRId64 ":%s:%s\n", move, target->good,
+                report->peer);
+    }
+    return numMoves;
+}
+
+/**
+ * Counts a Transfer the depot has made, bumping the neighbour's summary
+ * by what is on its way so the next round does not send it again.
+ *
+ * Params: (Rebalancer* rebalancer, Command* command) the Transfer.
+ * Return: void
+ */
+static void record_move(Rebalancer* rebalancer, Command* command) {
+    int64_t move = strtoll(command->args[1], 0, 10), theirs;
+    pthread_mutex_lock(&rebalancer->lock);
+    for (int i = 0; i < rebalancer->numReports; i++) {
+        Report* report = &rebalancer->reports[i];
+        if (strcmp(report->peer, command->args[3]) == 0 &&
+                strcmp(report->good, command->args[2]) == 0) {
+            if (!__builtin_add_overflow(report->amount, move, &theirs)) {
+                report->amount = theirs;
+            }
+            break;
+        }
+    }
+    rebalancer->transfers++;
+    rebalancer->moved += move;
+    pthread_mutex_unlock(&rebalancer->lock);
+}
+
+/**
+ * Forgets summaries which have been stale for as long again.
+ * rebalancer->lock must be held.
+ *
+ * Params: (Rebalancer* rebalancer)
+ * Return: void
+ */
+static void prune_reports(Rebalancer* rebalancer) {
+    for (int i = 0; i < rebalancer->numReports; i++) {
+        Report* report = &rebalancer->reports[i];
+        if (rebalancer->round - report->round > REBALANCE_STALE * 2) {
+            free(report->good);
+            *report = rebalancer->reports[--rebalancer->numReports];
+            i--;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef REBALANCE_H
+#define REBALANCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "depot.h"
+
+/* Percent of a good's target two depots may differ by and count as
+ * level; a good starts moving once they differ by twice as much. */
+#define REBALANCE_BAND 5
+/* Transfers one round may issue at most. */
+#define REBALANCE_MOVES 16
+/* Rounds after which an unchanged level is summarised again anyway. */
+#define REBALANCE_REFRESH 8
+/* Rounds after which a neighbour's summary is no longer acted upon. */
+#define REBALANCE_STALE 16
+
+/**
+ * A good this depot levels towards target. lastSent and sentRound are
+ * the free amount last summarised to neighbours and when; active is
+ * set while a neighbour is far enough below this depot (relative to
+ * their targets) for stock to be moving towards it.
+ */
+typedef struct {
+    char* good;
+    int64_t target;
+    int64_t lastSent;
+    uint64_t sentRound;
+    bool active;
+} Target;
+
+/**
+ * A neighbour's last summary of a good: its free amount and target,
+ * and the round it was heard in.
+ */
+typedef struct {
+    char peer[MAX_PEER];
+    char* good;
+    int64_t amount;
+    int64_t target;
+    uint64_t round;
+} Report;
+
+/**
+ * Levels a depot's goods with its neighbours'. Each round, run from
+ * the host's heartbeat, summarises the free amount of every good with
+ * a target to the neighbour depots as Level:good:amount:target, and
+ * diffuses stock downhill: for each neighbour whose fresh summary
+ * leaves it further below its target than this depot is below its own
+ * by more than the band, a Transfer of a share of the difference,
+ * damped by the number of neighbours, is issued through session as an
+ * operator's would be. Stock moves one hop a round, so a mesh levels
+ * by diffusion; it never moves uphill, and the band with hysteresis
+ * keeps it still once level. rounds, summaries, transfers and moved
+ * count the work done; unbalancedSince is when this depot last found
+ * itself out of level, and lastConvergence how long it took to get
+ * back. lock guards it all.
+ */
+typedef struct Rebalancer {
+    Depot* depot;
+    Session session;
+    int numTargets;
+    int targetCapacity;
+    Target* targets;
+    int numReports;
+    int reportCapacity;
+    Report* reports;
+    uint64_t round;
+    uint64_t summaries;
+    uint64_t transfers;
+    uint64_t moved;
+    uint64_t convergences;
+    uint64_t unbalancedSince;
+    uint64_t lastConvergence;
+    pthread_mutex_t lock;
+} Rebalancer;
+
+Rebalancer* rebalance_create(Depot* depot);
+void rebalance_destroy(Rebalancer* rebalancer);
+void rebalance_target(Rebalancer* rebalancer, const char* good,
+        int64_t target);
+void rebalance_observe(Rebalancer* rebalancer, const char* peer,
+        const char* good, int64_t amount, int64_t target);
+bool rebalance_round(Rebalancer* rebalancer);
+void rebalance_report(Rebalancer* rebalancer, FILE* out);
+
+#endif
@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "replica.h"
+#include "latency.h"
+#include "ebr.h"
+
+/* Bytes read from the stream at a time by a standby. */
+#define REPLICA_READ 65536
+
+static void append(Replica* replica, const char* kind, int64_t number,
+        const char* name);
+static bool write_all(int fd, const char* data, size_t length);
+static void* send_batches(void* input);
+static void* read_acks(void* input);
+static void apply_record(Depot* depot, Standby* standby, char* line);
+
+/**
+ * Starts streaming a depot's mutations over fd, a connected stream
+ * socket to its standby. The stream opens with a snapshot of the
+ * depot's port, name, stock and neighbour depots, taken under the
+ * depot lock once every change made without it has finished, so none
+ * is missed. Changes logged between attaching and the snapshot are
+ * overwritten by it, Stock records being absolute. Holds are not
+ * streamed: a Stock record counts held stock with the free, which a
+ * standby taking over has all free. Nor are the neighbours' sequence
+ * numbers: a standby taking over runs under its own epoch, so its
+ * neighbours take it for their old neighbour restarted, number their
+ * unacked Transfers to it afresh and send them again. Transfers the
+ * primary had yet to have acked are lost with it, as are changes
+ * still in the stream.
+ *
+ * Params: (Depot* depot, int fd)
+ * Return: (Replica*) the replica, now depot->replica.
+ */
+Replica* replica_attach(Depot* depot, int fd) {
+    Replica* replica = calloc(1, sizeof(Replica));
+    replica->depot = depot;
+    replica->fd = fd;
+    replica->capacity = REPLICA_READ;
+    replica->pending = malloc(replica->capacity);
+    pthread_mutex_init(&replica->lock, 0);
+    pthread_cond_init(&replica->ready, 0);
+    pthread_mutex_lock(&depot->lock);
+    __atomic_store_n(&depot->replica, replica, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&depot->lock);
+    /* Stock changes made without the lock, by readers yet to see the
+     * replica, are over once this returns; all later ones are logged. */
+    ebr_synchronize();
+    pthread_mutex_lock(&depot->lock);
+    append(replica, "Port", depot->portNo, depot->name);
+    for (int i = 0; i < depot->numResources; i++) {
+        int64_t amount = __atomic_load_n(&depot->resources[i]->amount,
+                __ATOMIC_RELAXED);
+        if (amount != RESOURCE_DEAD) {
+            append(replica, "Stock", amount +
+                    depot->resources[i]->reserved,
+                    depot->resources[i]->resource);
+        }
+    }
+    for (int i = 0; i < depot->numNeighbours; i++) {
+        Neighbour* neighbour = depot->neighbours[i];
+        pthread_mutex_lock(&neighbour->lock);
+        bool peer = neighbour->window;
+        pthread_mutex_unlock(&neighbour->lock);
+        if (peer) {
+            append(replica, "Neighbour", neighbour->portNo,
+                    neighbour->name);
+        }
+    }
+    pthread_mutex_unlock(&depot->lock);
+    pthread_create(&replica->sender, 0, send_batches, replica);
+    pthread_create(&replica->acker, 0, read_acks, replica);
+    return replica;
+}
+
+/**
+ * Stops replicating a depot. Whatever is already logged is sent, then
+ * the stream is closed and, once the standby hangs up, freed.
+ *
+ * Params: (Depot* depot)
+ * Return: void
+ */
+void replica_detach(Depot* depot) {
+    pthread_mutex_lock(&depot->lock);
+    Replica* replica = depot->replica;
+    depot->replica = 0;
+    pthread_mutex_unlock(&depot->lock);
+    if (!replica) {
+        return;
+    }
+    pthread_mutex_lock(&replica->lock);
+    replica->closing = true;
+    pthread_cond_signal(&replica->ready);
+    pthread_mutex_unlock(&replica->lock);
+    pthread_join(replica->sender, 0);
+    pthread_join(replica->acker, 0);
+    close(replica->fd);
+    pthread_mutex_destroy(&replica->lock);
+    pthread_cond_destroy(&replica->ready);
+    free(replica->pending);
+    free(replica);
+}
+
+/**
+ * Logs a good's new amount. The depot lock must be held, which keeps
+ * records in the order their mutations were applied.
+ *
+ * Params: (Replica* replica, const char* good, int64_t amount)
+ * Return: void
+ */
+void replica_stock(Replica* replica, const char* good, int64_t amount) {
+    append(replica, "Stock", amount, good);
+}
+
+/**
+ * Logs a newly added neighbour depot, for a standby taking over to dial
+ * back. Clients are not logged. The depot lock must be held.
+ *
+ * Params: (Replica* replica, const char* name, int portNo)
+ * Return: void
+ */
+void replica_neighbour(Replica* replica, const char* name, int portNo) {
+    append(replica, "Neighbour", portNo, name);
+}
+
+/**
+ * Logs the loss of a neighbour depot's link, after which a standby
+ * taking over leaves it to redial, as the neighbour will be doing. The
+ * depot lock must be held.
+ *
+ * Params: (Replica* replica, const char* name, int portNo)
+ * Return: void
+ */
+void replica_lost(Replica* replica, const char* name, int portNo) {
+    append(replica, "Lost", portNo, name);
+}
+
+/**
+ * Prints how far the standby is behind: records logged, sent and
+ * acknowledged, batching, and the time from sending a batch to its
+ * ack (last and worst).
+ *
+ * Params: (Replica* replica, FILE* out)
+ * Return: void
+ */
+void replica_report(Replica* replica, FILE* out) {
+    pthread_mutex_lock(&replica->lock);
+    fprintf(out, "Replication: logged %" PRIu64 " sent %" PRIu64 " acked %"
+            PRIu64 " lag %" PRIu64 "%s\n", replica->logged, replica->sent,
+            replica->acked, replica->logged - replica->acked,
+            replica->lost ? " (standby lost)" : "");
+    fprintf(out, "Replication batches %" PRIu64 " bytes %" PRIu64
+            " ack(ns) %" PRIu64 " max %" PRIu64 "\n", replica->batches,
+            replica->bytes, replica->lastAck, replica->maxAck);
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Runs a standby: applies a primary's stream from fd to depot until it
+ * ends, acknowledging after every read what has been applied so far.
+ *
+ * Params: (Depot* depot, int fd, Standby* standby) standby is filled in
+ * with what is needed to take over.
+ * Return: void
+ */
+void replica_follow(Depot* depot, int fd, Standby* standby) {
+    char* buffer = malloc(REPLICA_READ);
+    size_t have = 0;
+    uint64_t acked = 0;
+    ssize_t got;
+    while ((got = read(fd, buffer + have, REPLICA_READ - have)) > 0 ||
+            (got < 0 && errno == EINTR)) {
+        have += got > 0 ? got : 0;
+        char* line = buffer;
+        char* end;
+        while ((end = memchr(line, '\n', buffer + have - line))) {
+            *end = '\0';
+            apply_record(depot, standby, line);
+            line = end + 1;
+        }
+        have -= line - buffer;
+        memmove(buffer, line, have);
+        if (have == REPLICA_READ) {
+            have = 0;
+        }
+        if (standby->applied > acked) {
+            acked = standby->applied;
+            dprintf(fd, "Ack:%" PRIu64 "\n", acked);
+        }
+    }
+    free(buffer);
+}
+
+/**
+ * Appends one record, "Kind:seq:number:name", to the pending batch and
+ * wakes the sender. If the standby has fallen REPLICA_BACKLOG bytes
+ * behind it is given up on rather than letting the primary stall.
+ *
+ * Params: (Replica* replica, const char* kind, int64_t number,
+ * const char* name)
+ * Return: void
+ */
+static void append(Replica* replica, const char* kind, int64_t number,
+        const char* name) {
+    char record[MAX_LINE + 64];
+    pthread_mutex_lock(&replica->lock);
+    if (replica->lost || replica->closing) {
+        pthread_mutex_unlock(&replica->lock);
+        return;
+    }
+    int length = snprintf(record, sizeof(record), "%s:%" PRIu64 ":%"
+            PRId64 ":%s\n", kind, replica->logged + 1, number, name);
+    if (replica->length + length > REPLICA_BACKLOG) {
+        replica->lost = true;
+        shutdown(replica->fd, SHUT_RDWR);
+        pthread_cond_signal(&replica->ready);
+        pthread_mutex_unlock(&replica->lock);
+        return;
+    }
+    if (replica->length + length > replica->capacity) {
+        replica->capacity *= 2;
+        replica->pending = realloc(replica->pending, replica->capacity);
+    }
+    memcpy(replica->pending + replica->length, record, length);
+    /* The sender only sleeps on an empty batch. */
+    if (!replica->length) {
+        pthread_cond_signal(&replica->ready);
+    }
+    replica->length += length;
+    replica->logged++;
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/**
+ * Writes all of data to fd, across short writes.
+ *
+ * Params: (int fd, const char* data, size_t length)
+ * Return: (bool) false if the stream failed.
+ */
+static bool write_all(int fd, const char* data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+/**
+ * Sender thread. Takes everything logged since the last write as one
+ * batch, swapping in a spare buffer so logging carries on meanwhile,
+ * and writes it out. Acks are not waited for, so batches pipeline.
+ *
+ * Params: (void* input) the Replica.
+ * Return: NULL
+ */
+static void* send_batches(void* input) {
+    Replica* replica = (Replica*) input;
+    size_t spareCapacity = REPLICA_READ;
+    char* spare = malloc(spareCapacity);
+    pthread_mutex_lock(&replica->lock);
+    while (true) {
+        while (!replica->length && !replica->closing && !replica->lost) {
+            pthread_cond_wait(&replica->ready, &replica->lock);
+        }
+        if (!replica->length || replica->lost) {
+            break;
+        }
+        char* batch = replica->pending;
+        size_t batchCapacity = replica->capacity;
+        size_t length = replica->length;
+        uint64_t last = replica->logged;
+        replica->pending = spare;
+        replica->capacity = spareCapacity;
+        replica->length = 0;
+        pthread_mutex_unlock(&replica->lock);
+        uint64_t sentAt = latency_now();
+        bool written = write_all(replica->fd, batch, length);
+        pthread_mutex_lock(&replica->lock);
+        spare = batch;
+        spareCapacity = batchCapacity;
+        if (!written) {
+            replica->lost = true;
+            break;
+        }
+        replica->sent = last;
+        replica->bytes += length;
+        replica->batchSeq[replica->batches % REPLICA_BATCHES] = last;
+        replica->batchTime[replica->batches % REPLICA_BATCHES] = sentAt;
+        replica->batches++;
+    }
+    pthread_mutex_unlock(&replica->lock);
+    shutdown(replica->fd, SHUT_WR);
+    free(spare);
+    return 0;
+}
+
+/**
+ * Acker thread. Reads the standby's cumulative acks, timing each
+ * against the batch it completes, until the standby hangs up.
+ *
+ * Params: (void* input) the Replica.
+ * Return: NULL
+ */
+static void* read_acks(void* input) {
+    Replica* replica = (Replica*) input;
+    char buffer[MAX_LINE];
+    size_t have = 0;
+    ssize_t got;
+    while ((got = read(replica->fd, buffer + have, sizeof(buffer) - have))
+            > 0 || (got < 0 && errno == EINTR)) {
+        have += got > 0 ? got : 0;
+        uint64_t acked = 0;
+        char* line = buffer;
+        char* end;
+        while ((end = memchr(line, '\n', buffer + have - line))) {
+            *end = '\0';
+            sscanf(line, "Ack:%" SCNu64, &acked);
+            line = end + 1;
+        }
+        have -= line - buffer;
+        memmove(buffer, line, have);
+        if (have == sizeof(buffer)) {
+            have = 0;
+        }
+        uint64_t now = latency_now();
+        pthread_mutex_lock(&replica->lock);
+        if (acked > replica->acked) {
+            replica->acked = acked;
+            for (int i = 0; i < REPLICA_BATCHES; i++) {
+                if (replica->batchSeq[i] == acked) {
+                    replica->lastAck = now - replica->batchTime[i];
+                    if (replica->lastAck > replica->maxAck) {
+                        replica->maxAck = replica->lastAck;
+                    }
+                }
+            }
+        }
+        pthread_mutex_unlock(&replica->lock);
+    }
+    pthread_mutex_lock(&replica->lock);
+    if (!replica->closing) {
+        replica->lost = true;
+        pthread_cond_signal(&replica->ready);
+    }
+    pthread_mutex_unlock(&replica->lock);
+    return 0;
+}
+
+/**
+ * Applies one record of the stream to a standby depot. Stock records
+ * carry absolute amounts, so applying one twice does no harm.
+ *
+ * Params: (Depot* depot, Standby* standby, char* line) the record,
+ * without its newline.
+ * Return: void
+ */
+static void apply_record(Depot* depot, Standby* standby, char* line) {
+    char kind[16];
+    char name[MAX_LINE];
+    uint64_t seq;
+    int64_t number;
+    if (sscanf(line, "%15[^:]:%" SCNu64 ":%" SCNd64 ":%255[^\n]", kind,
+            &seq, &number, name) != 4) {
+        return;
+    }
+    if (strcmp(kind, "Stock") == 0) {
+        depot_set_resource(depot, name, number);
+    } else if (strcmp(kind, "Neighbour") == 0) {
+        for (int i = 0; i < standby->numPeers; i++) {
+            if (standby->peerPorts[i] == number) {
+                number = 0;
+            }
+        }
+        if (number) {
+            if (standby->numPeers == standby->peerCapacity) {
+                standby->peerCapacity = standby->peerCapacity * 2 + 8;
+                standby->peerPorts = realloc(standby->peerPorts,
+                        sizeof(int) * standby->peerCapacity);
+            }
+            standby->peerPorts[standby->numPeers++] = number;
+        }
+    } else if (strcmp(kind, "Lost") == 0) {
+        for (int i = 0; i < standby->numPeers; i++) {
+            if (standby->peerPorts[i] == number) {
+                standby->peerPorts[i] =
+                        standby->peerPorts[--standby->numPeers];
+                break;
+            }
+        }
+    } else if (strcmp(kind, "Port") == 0) {
+        standby->portNo = number;
+        pthread_mutex_lock(&depot->lock);
+        free(depot->name);
+        depot->name = strdup(name);
+        pthread_mutex_unlock(&depot->lock);
+    } else {
+        return;
+    }
+    standby->applied = seq;
+}
@@ -0,0 +1,68 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "depot.h"
+
+/* Unsent bytes a primary holds before it gives up on its standby. */
+#define REPLICA_BACKLOG (4 << 20)
+/* Batches whose send time is kept to measure the standby's ack time. */
+#define REPLICA_BATCHES 64
+
+/**
+ * A primary's stream of applied mutations to its standby. Records are
+ * appended under the depot lock by replica_stock(), replica_neighbour()
+ * and replica_lost(), each with the next sequence number, and a
+ * sender thread writes out whatever has built up as one batch without
+ * waiting on acks. An acker thread reads back the standby's cumulative
+ * "Ack:seq" lines. logged, sent and acked are the last sequence number
+ * appended, written and acknowledged respectively.
+ */
+typedef struct Replica {
+    Depot* depot;
+    int fd;
+    pthread_t sender;
+    pthread_t acker;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char* pending;
+    size_t length;
+    size_t capacity;
+    uint64_t logged;
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t batches;
+    uint64_t bytes;
+    uint64_t lastAck;
+    uint64_t maxAck;
+    uint64_t batchSeq[REPLICA_BATCHES];
+    uint64_t batchTime[REPLICA_BATCHES];
+    bool closing;
+    bool lost;
+} Replica;
+
+/**
+ * What a standby learnt of its primary by the time the stream ended:
+ * the port to take over, the neighbour depots linked to it at the end,
+ * to dial back, and the last sequence number applied.
+ */
+typedef struct {
+    int portNo;
+    int numPeers;
+    int peerCapacity;
+    int* peerPorts;
+    uint64_t applied;
+} Standby;
+
+Replica* replica_attach(Depot* depot, int fd);
+void replica_detach(Depot* depot);
+void replica_stock(Replica* replica, const char* good, int64_t amount);
+void replica_neighbour(Replica* replica, const char* name, int portNo);
+void replica_lost(Replica* replica, const char* name, int portNo);
+void replica_report(Replica* replica, FILE* out);
+void replica_follow(Depot* depot, int fd, Standby* standby);
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "sketch.h"
+
+static uint64_t hash_key(const char* key);
+static uint32_t estimate_hash(Sketch* sketch, uint64_t hash);
+static void offer(Sketch* sketch, const char* key, uint64_t hash,
+        uint32_t estimate);
+static void decay(Sketch* sketch);
+static void update_floor(Sketch* sketch);
+static int hitter_cmp(const void* a, const void* b);
+
+/**
+ * Allocates an empty sketch, aligned so each block is a cache line.
+ *
+ * Params: void
+ * Return: (Sketch*) the new sketch.
+ */
+Sketch* sketch_create() {
+    void* memory;
+    if (posix_memalign(&memory, 64, sizeof(Sketch))) {
+        return 0;
+    }
+    Sketch* sketch = (Sketch*) memory;
+    memset(sketch, 0, sizeof(Sketch));
+    pthread_mutex_init(&sketch->lock, 0);
+    return sketch;
+}
+
+/**
+ * Frees a sketch.
+ *
+ * Params: (Sketch* sketch)
+ * Return: void
+ */
+void sketch_destroy(Sketch* sketch) {
+    pthread_mutex_destroy(&sketch->lock);
+    free(sketch);
+}
+
+/**
+ * Counts one occurrence of key. Bumps SKETCH_DEPTH counters within the
+ * key's block, and offers the key to the top list if it is not already
+ * there and its estimate (the smallest of those counters) beats the
+ * list's floor.
+ *
+ * Params: (Sketch* sketch, const char* key)
+ * Return: void
+ */
+void sketch_add(Sketch* sketch, const char* key) {
+    uint64_t hash = hash_key(key);
+    uint32_t* block = sketch->counts[hash % SKETCH_BLOCKS];
+    uint32_t estimate = UINT32_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        uint32_t* counter = &block[(hash >> (40 + 4 * i)) & 15];
+        uint32_t count = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        estimate = count < estimate ? count : estimate;
+    }
+    if (estimate > __atomic_load_n(&sketch->floor, __ATOMIC_RELAXED)) {
+        bool member = false;
+        for (int i = 0; i < SKETCH_TOP && !member; i++) {
+            member = __atomic_load_n(&sketch->hashes[i], __ATOMIC_RELAXED)
+                    == hash;
+        }
+        if (!member) {
+            offer(sketch, key, hash, estimate);
+        }
+    }
+    if (__atomic_add_fetch(&sketch->updates, 1, __ATOMIC_RELAXED)
+            % SKETCH_DECAY == 0) {
+        decay(sketch);
+    }
+}
+
+/**
+ * Estimates how often key has been seen (with decay applied). Never
+ * less than the true decayed count.
+ *
+ * Params: (Sketch* sketch, const char* key)
+ * Return: (uint32_t) estimated count.
+ */
+uint32_t sketch_estimate(Sketch* sketch, const char* key) {
+    return estimate_hash(sketch, hash_key(key));
+}
+
+/**
+ * Copies out the current heavy hitters with their estimates, largest
+ * first.
+ *
+ * Params: (Sketch* sketch, HeavyHitter* out) room for SKETCH_TOP.
+ * Return: (int) number of heavy hitters copied.
+ */
+int sketch_top(Sketch* sketch, HeavyHitter* out) {
+    pthread_mutex_lock(&sketch->lock);
+    int numTop = sketch->numTop;
+    for (int i = 0; i < numTop; i++) {
+        memcpy(out[i].key, sketch->keys[i], SKETCH_KEY);
+        out[i].count = estimate_hash(sketch, sketch->hashes[i]);
+    }
+    pthread_mutex_unlock(&sketch->lock);
+    qsort(out, numTop, sizeof(HeavyHitter), hitter_cmp);
+    return numTop;
+}
+
+/**
+ * Prints the heavy hitters under a title, one "key ~count" per line.
+ *
+ * Params: (Sketch* sketch, const char* title, FILE* out)
+ * Return: void
+ */
+void sketch_report(Sketch* sketch, const char* title, FILE* out) {
+    HeavyHitter top[SKETCH_TOP];
+    int numTop = sketch_top(sketch, top);
+    fprintf(out, "%s:\n", title);
+    for (int i = 0; i < numTop; i++) {
+        fprintf(out, "%s ~%u\n", top[i].key, top[i].count);
+    }
+}
+
+/**
+ * FNV-1a, with a final mix so the high bits used to pick counters
+ * within a block are well spread.
+ *
+ * Params: (const char* key)
+ * Return: (uint64_t) hash of key.
+ */
+static uint64_t hash_key(const char* key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char) *key) * 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ * Reads the smallest of a hash's counters.
+ *
+ * Params: (Sketch* sketch, uint64_t hash)
+ * Return: (uint32_t) estimated count.
+ */
+static uint32_t estimate_hash(Sketch* sketch, uint64_t hash) {
+    uint32_t* block = sketch->counts[hash % SKETCH_BLOCKS];
+    uint32_t estimate = UINT32_MAX;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        uint32_t* counter = &block[(hash >> (40 + 4 * i)) & 15];
+        uint32_t count = __atomic_load_n(counter, __ATOMIC_RELAXED);
+        estimate = count < estimate ? count : estimate;
+    }
+    return estimate;
+}
+
+/**
+ * Enters key into the top list, filling a free slot or else evicting
+ * the member with the smallest current estimate if key's is larger.
+ *
+ * Params: (Sketch* sketch, const char* key, uint64_t hash,
+ * uint32_t estimate)
+ * Return: void
+ */
+static void offer(Sketch* sketch, const char* key, uint64_t hash,
+        uint32_t estimate) {
+    int slot = -1;
+    uint32_t smallest = UINT32_MAX;
+    pthread_mutex_lock(&sketch->lock);
+    for (int i = 0; i < sketch->numTop; i++) {
+        if (sketch->hashes[i] == hash) {
+            pthread_mutex_unlock(&sketch->lock);
+            return;
+        }
+        uint32_t count = estimate_hash(sketch, sketch->hashes[i]);
+        if (count < smallest) {
+            smallest = count;
+            slot = i;
+        }
+    }
+    if (sketch->numTop < SKETCH_TOP) {
+        slot = sketch->numTop++;
+    } else if (estimate <= smallest) {
+        slot = -1;
+    }
+    if (slot >= 0) {
+        snprintf(sketch->keys[slot], SKETCH_KEY, "%s", key);
+        __atomic_store_n(&sketch->hashes[slot], hash, __ATOMIC_RELAXED);
+    }
+    update_floor(sketch);
+    pthread_mutex_unlock(&sketch->lock);
+}
+
+/**
+ * Halves every counter, so that the sketch tracks recent rates.
+ *
+ * Params: (Sketch* sketch)
+ * Return: void
+ */
+static void decay(Sketch* sketch) {
+    pthread_mutex_lock(&sketch->lock);
+    for (int i = 0; i < SKETCH_BLOCKS; i++) {
+        for (int j = 0; j < 16; j++) {
+            uint32_t count = __atomic_load_n(&sketch->counts[i][j],
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&sketch->counts[i][j], count / 2,
+                    __ATOMIC_RELAXED);
+        }
+    }
+    update_floor(sketch);
+    pthread_mutex_unlock(&sketch->lock);
+}
+
+/**
+ * Recomputes the estimate a key must beat to be offered to the top
+ * list: the smallest member's, once the list is full. The sketch lock
+ * must be held.
+ *
+ * Params: (Sketch* sketch)
+ * Return: void
+ */
+static void update_floor(Sketch* sketch) {
+    uint32_t floor = 0;
+    if (sketch->numTop == SKETCH_TOP) {
+        floor = UINT32_MAX;
+        for (int i = 0; i < sketch->numTop; i++) {
+            uint32_t count = estimate_hash(sketch, sketch->hashes[i]);
+            floor = count < floor ? count : floor;
+        }
+    }
+    __atomic_store_n(&sketch->floor, floor, __ATOMIC_RELAXED);
+}
+
+/**
+ * Orders heavy hitters by descending count.
+ *
+ * Params: (const void* a, const void* b) HeavyHitters.
+ * Return: (int) as per strcmp.
+ */
+static int hitter_cmp(const void* a, const void* b) {
+    const HeavyHitter* hitter1 = (HeavyHitter*) a;
+    const HeavyHitter* hitter2 = (HeavyHitter*) b;
+    return (hitter1->count < hitter2->count) -
+            (hitter1->count > hitter2->count);
+}
@@ -0,0 +1,54 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Blocked count-min sketch: a key hashes to one 64 byte block of 16
+ * counters and increments SKETCH_DEPTH of them, so an update touches a
+ * single cache line.
+ */
+#define SKETCH_BLOCKS 64
+#define SKETCH_DEPTH 4
+/* Heavy hitters tracked alongside the sketch. */
+#define SKETCH_TOP 10
+/* Bytes of a key kept in the top list. */
+#define SKETCH_KEY 32
+/* Every this many updates, all counts are halved so old traffic fades. */
+#define SKETCH_DECAY 65536
+
+/**
+ * A heavy hitter: the key and its estimated (decayed) count.
+ */
+typedef struct {
+    char key[SKETCH_KEY];
+    uint32_t count;
+} HeavyHitter;
+
+/**
+ * Count-min sketch with a top-K list. Counters are bumped with relaxed
+ * atomics from any thread. The top list holds keys only, their counts
+ * being read back from the sketch; it is locked only when a key not
+ * already in it (by hash) has an estimate beating the smallest member
+ * estimate seen (floor).
+ */
+typedef struct {
+    uint32_t counts[SKETCH_BLOCKS][16] __attribute__((aligned(64)));
+    uint64_t hashes[SKETCH_TOP];
+    uint32_t floor;
+    uint64_t updates;
+    int numTop;
+    char keys[SKETCH_TOP][SKETCH_KEY];
+    pthread_mutex_t lock;
+} Sketch;
+
+Sketch* sketch_create();
+void sketch_destroy(Sketch* sketch);
+void sketch_add(Sketch* sketch, const char* key);
+uint32_t sketch_estimate(Sketch* sketch, const char* key);
+int sketch_top(Sketch* sketch, HeavyHitter* out);
+void sketch_report(Sketch* sketch, const char* title, FILE* out);
+
+#endif
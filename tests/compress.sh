@@ -0,0 +1,17 @@
+#!/bin/bash
+# A compression offer too long to read whole is refused like any other
+# long line, and its tail is not taken as a command of its own.
+. tests/lib.sh
+
+DEPOT_COMPRESS=6 depot A "$(port 0)" apple 10
+exec 3<>"/dev/tcp/127.0.0.1/$(port 0)"
+read -r -t 2 -u 3 _
+echo "IM:1:peer:64" >&3
+sleep 0.3
+
+padding=$(printf 'g%.0s' $(seq 245))
+echo "Compress:$padding:Deliver:5:apple" >&3
+sleep 0.3
+expect "tail of the offer" "$(stock A apple)" 10
+
+finish
@@ -0,0 +1,42 @@
+#!/bin/bash
+# A Broadcast reaches every depot of a cycle exactly once, whichever
+# depot starts it.
+. tests/lib.sh
+
+depot A "$(port 0)"
+depot B "$(port 1)"
+depot C "$(port 2)"
+connect 3 "$(port 0)"
+connect 4 "$(port 1)"
+connect 5 "$(port 2)"
+echo "Connect:$(port 1)" >&3
+echo "Connect:$(port 2)" >&4
+echo "Connect:$(port 0)" >&5
+sleep 0.5
+
+for round in 1 2 3; do
+    echo "Broadcast:1:apple" >&3
+    echo "Broadcast:10:apple" >&4
+    echo "Broadcast:100:apple" >&5
+done
+sleep 0.5
+# Each of the nine goes to both neighbours of where it started, and on
+# from each to the third depot, which has it already: two repeats.
+suppressed=0
+for name in A B C; do
+    expect "stock at $name" "$(stock "$name" apple)" 333
+    floods=$(stats "$name" | grep '^Floods:')
+    expect "started and forwarded at $name" \
+            "$(echo "$floods" | awk '{ print $3, $5 }')" "3 12"
+    suppressed=$((suppressed + $(echo "$floods" | awk '{ print $7 }')))
+done
+expect "repeats" "$suppressed" 18
+
+# Only depots flood: one from a client goes nowhere.
+echo "Flood:12345:5:apple" >&3
+sleep 0.5
+for name in A B C; do
+    expect "client's flood at $name" "$(stock "$name" apple)" 333
+done
+
+finish
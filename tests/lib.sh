@@ -0,0 +1,161 @@
+# Helpers for the scripted tests: depots run in the background on
+# fixed ports, talked to over bash's /dev/tcp. Sourced by each test,
+# which runs from the top of the tree.
+
+set -u
+
+work=$(mktemp -d)
+base=$((20000 + RANDOM % 20000))
+declare -A pids
+failures=0
+
+cleanup() {
+    for pid in "${pids[@]}"; do
+        kill "$pid" 2>/dev/null
+    done
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# port N: the Nth port this test may listen on.
+port() {
+    echo $((base + $1))
+}
+
+# wait_port PORT: waits for something to listen on PORT.
+wait_port() {
+    for _ in $(seq 50); do
+        if (exec 3<>"/dev/tcp/127.0.0.1/$1") 2>/dev/null; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "nothing listening on $1" >&2
+    return 1
+}
+
+# depot NAME PORT [good qty ...]: starts a depot, with quick heartbeats
+# so that dead links are noticed within the test.
+depot() {
+    local name=$1 portNo=$2
+    shift 2
+    DEPOT_PORT=$portNo DEPOT_HEARTBEAT_MS=100 DEPOT_TIMEOUT_MS=600 \
+            ./2310depot "$name" "$@" >>"$work/$name.out" \
+            2>>"$work/$name.err" &
+    pids[$name]=$!
+    wait_port "$portNo"
+}
+
+# standby NAME: starts a standby waiting for a primary started with
+# DEPOT_REPLICATE=$work/NAME.sock.
+standby() {
+    DEPOT_STANDBY="$work/$1.sock" DEPOT_HEARTBEAT_MS=100 \
+            DEPOT_TIMEOUT_MS=600 ./2310depot "$1" >>"$work/$1.out" \
+            2>>"$work/$1.err" &
+    pids[$1]=$!
+    for _ in $(seq 50); do
+        if [ -S "$work/$1.sock" ]; then
+            return 0
+        fi
+        sleep 0.1
+    done
+    echo "standby $1 is not waiting" >&2
+    return 1
+}
+
+# stop NAME: kills a depot, as if it had crashed.
+stop() {
+    kill -9 "${pids[$1]}" 2>/dev/null
+    wait "${pids[$1]}" 2>/dev/null
+    unset "pids[$1]"
+}
+
+# proxy NAME PORT DEPOT_PORT [option ...]: starts a depotproxy.
+proxy() {
+    local name=$1 portNo=$2 depotPort=$3
+    shift 3
+    ./depotproxy -l "$portNo" "$@" "$depotPort" >>"$work/$name.out" \
+            2>>"$work/$name.err" &
+    pids[$name]=$!
+    wait_port "$portNo"
+}
+
+# connect FD PORT [IM_PORT]: opens a client connection on FD and does
+# the IM, giving IM_PORT (1 unless set) as the client's port.
+connect() {
+    eval "exec $1<>/dev/tcp/127.0.0.1/$2"
+    local im
+    read -r -t 2 -u "$1" im
+    echo "IM:${3:-1}:tester$1" >&"$1"
+}
+
+# answer FD: prints the next line from FD, or nothing after 2 seconds.
+answer() {
+    local line=""
+    read -r -t 2 -u "$1" line
+    echo "$line"
+}
+
+# stock NAME GOOD: prints how much of GOOD the depot reports having.
+stock() {
+    : >"$work/$1.out"
+    kill -HUP "${pids[$1]}"
+    sleep 0.2
+    awk -v good="$2" 'BEGIN { amount = 0 } $1 == good { amount = $2 }
+            END { print amount }' "$work/$1.out"
+}
+
+# neighbours NAME: prints the names of the depot's neighbours.
+neighbours() {
+    : >"$work/$1.out"
+    kill -HUP "${pids[$1]}"
+    sleep 0.2
+    awk '/^Neighbours:/ { on = 1; next } on { printf "%s ", $1 }' \
+            "$work/$1.out"
+}
+
+# stats NAME: prints the depot's runtime statistics.
+stats() {
+    : >"$work/$1.err"
+    kill -HUP "${pids[$1]}"
+    sleep 0.2
+    cat "$work/$1.err"
+}
+
+# unacked NAME NEIGHBOUR: prints the depot's count of Transfers to
+# NEIGHBOUR unacked and queued, or lost neighbour's unacked and
+# redials, or nothing if it has none.
+unacked() {
+    stats "$1" | awk -v name="$2" '/^Unacked transfers:/ { on = 1; next }
+            /^Holds:/ { on = 0 }
+            on && $1 == name { print $2, $3 }'
+}
+
+# expect WHAT GOT WANT: records a failure unless GOT is WANT.
+expect() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: got '$2', want '$3'" >&2
+        failures=$((failures + 1))
+    fi
+}
+
+# eventually WHAT WANT COMMAND...: like expect, but gives COMMAND five
+# seconds to print WANT.
+eventually() {
+    local what=$1 want=$2 got
+    shift 2
+    for _ in $(seq 25); do
+        got=$("$@")
+        if [ "$got" = "$want" ]; then
+            return 0
+        fi
+        sleep 0.2
+    done
+    expect "$what" "$got" "$want"
+}
+
+# finish: the test's exit status.
+finish() {
+    [ "$failures" -eq 0 ]
+}
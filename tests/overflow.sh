@@ -0,0 +1,31 @@
+#!/bin/bash
+# Stock a depot cannot take, or a Transfer cannot send, is not lost.
+. tests/lib.sh
+
+max=9223372036854775807
+depot A "$(port 0)" apple "$max"
+depot B "$(port 1)" apple 10
+connect 3 "$(port 1)"
+echo "Connect:$(port 0)" >&3
+sleep 0.5
+
+echo "Req:1:Transfer:5:pear:Nobody" >&3
+expect "transfer to a stranger" "$(answer 3)" "Res:1:Error"
+expect "stranger's good" "$(stock B pear)" 0
+
+echo "Req:2:Transfer:5:apple:A" >&3
+expect "transfer" "$(answer 3)" "Res:2:OK:5"
+sleep 0.5
+expect "overflowing" "$(stock A apple)" "$max"
+expect "kept for A" "$(unacked B A)" "1 0"
+
+connect 4 "$(port 0)"
+echo "Req:3:Deliver:1:apple" >&4
+expect "overflowing deliver" "$(answer 4)" "Res:3:Error"
+
+echo "Req:4:Broadcast:1:apple" >&4
+expect "overflowing broadcast" "$(answer 4)" "Res:4:Error"
+sleep 0.5
+expect "broadcast kept from B" "$(stock B apple)" 5
+
+finish
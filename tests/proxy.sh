@@ -0,0 +1,50 @@
+#!/bin/bash
+# Clients sharing a proxy link each get the answers to their own Reqs,
+# including Errors for commands the proxy refuses or the depot sits on,
+# and are freed once they have gone.
+. tests/lib.sh
+
+# answers FD N: prints the next N lines from FD, sorted, on one line.
+answers() {
+    for _ in $(seq "$2"); do
+        answer "$1"
+    done | sort | tr '\n' ' '
+}
+
+# clients NAME: prints how many clients the proxy has.
+clients() {
+    stats "$1" | awk '$1 == "Proxy:" { print $3 }'
+}
+
+depot A "$(port 0)" apple 10 pear 10
+proxy P "$(port 1)" "$(port 0)" -k 1 -t 300
+connect 3 "$(port 1)"
+connect 4 "$(port 1)"
+
+echo "Req:1:Deliver:5:apple" >&3
+echo "Req:1:Withdraw:2:pear" >&4
+echo "Req:2:Deliver:1:$(printf 'a%.0s' $(seq 300))" >&3
+echo "Req:2:Withdraw:1:pear" >&4
+echo "Req:3" >&3
+echo "Req:3:" >&4
+echo "Deliver:1:apple" >&3
+echo "Req:4:Withdraw:1:apple" >&3
+expect "first client" "$(answers 3 4)" \
+        "Res:1:OK:15 Res:2:Error Res:3:Error Res:4:OK:15 "
+expect "second client" "$(answers 4 3)" \
+        "Res:1:OK:8 Res:2:OK:7 Res:3:Error "
+expect "stock" "$(stock A apple) $(stock A pear)" "15 7"
+
+# A command the depot takes too long over is answered with an Error,
+# and its late answer goes nowhere.
+kill -STOP "${pids[A]}"
+echo "Req:5:Deliver:3:apple" >&3
+expect "timed out" "$(answer 3)" "Res:5:Error"
+kill -CONT "${pids[A]}"
+echo "Req:6:Withdraw:1:apple" >&3
+expect "after timeout" "$(answer 3)" "Res:6:OK:17"
+
+exec 3>&- 4>&-
+eventually "clients freed" 0 clients P
+
+finish
@@ -0,0 +1,23 @@
+#!/bin/bash
+# Every Req gets its Res, even when the command it carries is too long,
+# has too many fields or is missing.
+. tests/lib.sh
+
+depot A "$(port 0)" apple 10
+connect 3 "$(port 0)"
+
+echo "Req:1:Deliver:5:apple" >&3
+expect "deliver" "$(answer 3)" "Res:1:OK:15"
+echo "Req:2:$(printf 'x:%.0s' $(seq 20))" >&3
+expect "too many fields" "$(answer 3)" "Res:2:Error"
+echo "Req:3:Deliver:1:$(printf 'a%.0s' $(seq 300))" >&3
+expect "too long" "$(answer 3)" "Res:3:Error"
+echo "Req:4" >&3
+expect "no command" "$(answer 3)" "Res:4:Error"
+echo "Req:5:" >&3
+expect "empty command" "$(answer 3)" "Res:5:Error"
+echo "Req:6:Withdraw:5:apple" >&3
+expect "withdraw" "$(answer 3)" "Res:6:OK:10"
+expect "stock" "$(stock A apple)" 10
+
+finish
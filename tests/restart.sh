@@ -0,0 +1,73 @@
+#!/bin/bash
+# Transfers to a depot that restarts on the same port carry on, and
+# those it never acked are applied by the new run exactly once.
+. tests/lib.sh
+
+# transfer COUNT: has A Transfer one apple to B COUNT times.
+transfer() {
+    for _ in $(seq "$1"); do
+        echo "Transfer:1:apple:B" >&3
+    done
+}
+
+depot A "$(port 0)" apple 1000
+depot B "$(port 1)"
+connect 3 "$(port 0)"
+echo "Connect:$(port 1)" >&3
+sleep 0.5
+
+# Far enough past the dedup window that a B with no record of A's
+# numbering would refuse anything numbered after them.
+transfer 100
+eventually "before restarting" 100 stock B apple
+eventually "acked before restarting" "" unacked A B
+
+stop B
+depot B "$(port 1)"
+sleep 1
+transfer 5
+eventually "after restarting" 5 stock B apple
+eventually "acked after restarting" "" unacked A B
+
+# Transfers B never acked, sent again behind A's IM when it redials.
+restart_unacked() {
+    kill -STOP "${pids[B]}"
+    transfer "$1"
+    sleep 1
+    stop B
+    depot B "$(port 1)"
+}
+restart_unacked 3
+eventually "unacked across a restart" 3 stock B apple
+eventually "acked across a restart" "" unacked A B
+
+# Numbered within the dedup window, so the new run would take them and
+# then take them again renumbered, did it not ignore the first flight.
+transfer 2
+eventually "before the second restart" 5 stock B apple
+restart_unacked 3
+eventually "first flight across a restart" 3 stock B apple
+eventually "acked after the second restart" "" unacked A B
+expect "at A" "$(stock A apple)" 887
+
+# A sequenced Deliver from a session with no neighbour behind it, as
+# before the IM or once the link has gone, is left for the sender to
+# send again rather than applied unrecorded.
+exec 4<>"/dev/tcp/127.0.0.1/$(port 1)"
+read -r -t 2 -u 4 _
+echo "Deliver:5:pear:7:1" >&4
+sleep 0.3
+expect "before the IM" "$(stock B pear)" 0
+exec 5<>"/dev/tcp/127.0.0.1/$(port 1)"
+read -r -t 2 -u 5 _
+echo "IM:1:ghost" >&4
+sleep 0.3
+echo "IM:1:ghost" >&5
+sleep 0.3
+exec 5>&-
+sleep 0.3
+echo "Deliver:5:pear:7:1" >&4
+sleep 0.3
+expect "once lost" "$(stock B pear)" 0
+
+finish
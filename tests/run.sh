@@ -0,0 +1,16 @@
+#!/bin/bash
+# Runs every test script in tests/, from the top of the tree.
+cd "$(dirname "$0")/.." || exit 1
+failed=0
+for test in tests/*.sh; do
+    case $test in
+        tests/lib.sh|tests/run.sh) continue ;;
+    esac
+    if bash "$test"; then
+        echo "PASS $test"
+    else
+        echo "FAIL $test"
+        failed=$((failed + 1))
+    fi
+done
+[ "$failed" -eq 0 ]
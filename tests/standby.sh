@@ -0,0 +1,37 @@
+#!/bin/bash
+# A standby taking over dials back its primary's neighbour depots, not
+# its clients, and Transfers to and from it carry on.
+. tests/lib.sh
+
+standby S
+DEPOT_REPLICATE="$work/S.sock" depot A "$(port 0)" apple 1000
+depot B "$(port 1)" pear 1000
+depot C "$(port 2)"
+# A client claiming C's port, which the standby must not dial.
+connect 3 "$(port 0)" "$(port 2)"
+echo "Connect:$(port 1)" >&3
+connect 4 "$(port 1)"
+sleep 0.5
+
+# transfer COUNT: has B Transfer one pear to A COUNT times.
+transfer() {
+    for _ in $(seq "$1"); do
+        echo "Transfer:1:pear:A" >&4
+    done
+}
+
+transfer 100
+eventually "before taking over" 100 stock A pear
+eventually "acked before taking over" "" unacked B A
+
+stop A
+eventually "taken over" 100 stock S pear
+transfer 5
+eventually "after taking over" 105 stock S pear
+eventually "acked after taking over" "" unacked B A
+connect 5 "$(port 0)"
+echo "Transfer:10:apple:B" >&5
+eventually "from the standby" 10 stock B apple
+expect "clients dialled" "$(neighbours C)" ""
+
+finish
@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+#include "zip.h"
+
+/* Words of the protocol every dictionary starts with; the goods and
+ * Deliver, the likeliest matches, go last where they are nearest. */
+static const char vocabulary[] = "Level:Flood:Transfer:Ack:";
+
+static Zip* zip_create(bool inflating, int level, const char* goods);
+static int pump(Zip* zip, const char* data, int length, char** out,
+        int capacity);
+
+/**
+ * Creates the sending end of a compressed link.
+ *
+ * Params: (int level, const char* goods) level is zlib's, 1 to 9;
+ * goods are the names offered to the peer, ':' separated.
+ * Return: (Zip*) the stream, or NULL if zlib could not set it up.
+ */
+Zip* zip_deflater(int level, const char* goods) {
+    return zip_create(false, level, goods);
+}
+
+/**
+ * Creates the recieving end of a compressed link.
+ *
+ * Params: (const char* goods) as offered by the peer.
+ * Return: (Zip*) the stream, or NULL if zlib could not set it up.
+ */
+Zip* zip_inflater(const char* goods) {
+    return zip_create(true, 0, goods);
+}
+
+/**
+ * Frees a stream.
+ *
+ * Params: (Zip* zip) may be NULL.
+ * Return: void
+ */
+void zip_destroy(Zip* zip) {
+    if (!zip) {
+        return;
+    }
+    if (zip->inflating) {
+        inflateEnd(&zip->stream);
+    } else {
+        deflateEnd(&zip->stream);
+    }
+    free(zip);
+}
+
+/**
+ * Compresses a frame, flushing the stream so the peer can take it
+ * without waiting for the next.
+ *
+ * Params: (Zip* zip, const char* data, int length, char** out) out is
+ * set to the compressed bytes, for the caller to free.
+ * Return: (int) the number of compressed bytes, or -1 on failure.
+ */
+int zip_frame(Zip* zip, const char* data, int length, char** out) {
+    int packed = pump(zip, data, length, out, length / 2 + 64);
+    if (packed >= 0) {
+        zip->frames++;
+        zip->text += length;
+        zip->packed += packed;
+    }
+    return packed;
+}
+
+/**
+ * Decompresses a frame made by the peer's zip_frame().
+ *
+ * Params: (Zip* zip, const char* data, int length, char** out) out is
+ * set to the text, NUL terminated, for the caller to free.
+ * Return: (int) the length of the text, or -1 if the frame was
+ * corrupt, in which case the stream cannot be used again.
+ */
+int zip_unframe(Zip* zip, const char* data, int length, char** out) {
+    int text = pump(zip, data, length, out, length * 4 + 64);
+    if (text >= 0) {
+        zip->frames++;
+        zip->text += text;
+        zip->packed += length;
+    }
+    return text;
+}
+
+/**
+ * Sets up a stream in either direction, priming it with the
+ * dictionary both ends build from the goods.
+ *
+ * Params: (bool inflating, int level, const char* goods)
+ * Return: (Zip*) the stream, or NULL if zlib could not set it up.
+ */
+static Zip* zip_create(bool inflating, int level, const char* goods) {
+    Zip* zip = calloc(1, sizeof(Zip));
+    zip->inflating = inflating;
+    int status = inflating ?
+            inflateInit2(&zip->stream, -ZIP_WINDOW_BITS) :
+            deflateInit2(&zip->stream, level, Z_DEFLATED, -ZIP_WINDOW_BITS,
+            ZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    if (status != Z_OK) {
+        free(zip);
+        return 0;
+    }
+    int length = sizeof(vocabulary) + strlen(goods) + 16;
+    char* dictionary = malloc(length);
+    length = snprintf(dictionary, length, "%s%s:\nDeliver:", vocabulary,
+            goods);
+    if (inflating) {
+        inflateSetDictionary(&zip->stream, (Bytef*) dictionary, length);
+    } else {
+        deflateSetDictionary(&zip->stream, (Bytef*) dictionary, length);
+    }
+    free(dictionary);
+    return zip;
+}
+
+/**
+ * Runs a frame through the stream, growing the output until it has all
+ * come out. Text inflating to more than 16 maximum frames is refused.
+ *
+ * Params: (Zip* zip, const char* data, int length, char** out,
+ * int capacity) capacity is the first guess at the output's size.
+ * Return: (int) the bytes written to *out, or -1 on failure.
+ */
+static int pump(Zip* zip, const char* data, int length, char** out,
+        int capacity) {
+    int used = 0, status;
+    *out = malloc(capacity + 1);
+    zip->stream.next_in = (Bytef*) data;
+    zip->stream.avail_in = length;
+    do {
+        if (used == capacity) {
+            capacity *= 2;
+            *out = realloc(*out, capacity + 1);
+        }
+        zip->stream.next_out = (Bytef*) *out + used;
+        zip->stream.avail_out = capacity - used;
+        status = zip->inflating ? inflate(&zip->stream, Z_SYNC_FLUSH) :
+                deflate(&zip->stream, Z_SYNC_FLUSH);
+        used = capacity - zip->stream.avail_out;
+    } while (status == Z_OK && (zip->stream.avail_in || used == capacity) &&
+            used < ZIP_MAX_FRAME * 16);
+    if ((status != Z_OK && status != Z_BUF_ERROR) || zip->stream.avail_in) {
+        free(*out);
+        *out = 0;
+        return -1;
+    }
+    (*out)[used] = '\0';
+    return used;
+}
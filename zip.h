@@ -0,0 +1,40 @@
+#ifndef ZIP_H
+#define ZIP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zlib.h>
+
+/* Frames shorter than this go over a compressed link as they are. */
+#define ZIP_THRESHOLD 512
+/* Log2 of the history a stream compresses against, and of deflate's
+ * hash memory: frames are small, so links keep these small too. */
+#define ZIP_WINDOW_BITS 12
+#define ZIP_MEM_LEVEL 4
+/* Largest compressed frame a link will take. */
+#define ZIP_MAX_FRAME (1 << 20)
+
+/**
+ * One direction of a compressed link: a raw deflate or inflate stream
+ * lasting as long as the connection, so every frame is compressed
+ * against those before it. Both ends prime it with the same
+ * dictionary, the protocol's words and the goods the sender named when
+ * it offered compression. frames, text and packed count the frames it
+ * has handled and their bytes before and after compression. Not thread
+ * safe.
+ */
+typedef struct {
+    z_stream stream;
+    bool inflating;
+    uint64_t frames;
+    uint64_t text;
+    uint64_t packed;
+} Zip;
+
+Zip* zip_deflater(int level, const char* goods);
+Zip* zip_inflater(const char* goods);
+void zip_destroy(Zip* zip);
+int zip_frame(Zip* zip, const char* data, int length, char** out);
+int zip_unframe(Zip* zip, const char* data, int length, char** out);
+
+#endif